@@ -0,0 +1,67 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Allocation comparison over the examples/ corpus: translates each example
+# with two msc builds (e.g., before and after a change) and reports the
+# number of heap allocations each made during translation, and the change
+# over the reference build. Both builds must count allocations (scons
+# --alloc-stats). Counts depend on the compiler and library versions msc is
+# built with, so compare builds made with the same toolchain, e.g.,
+#   bench/allocs.py --ref-msc /path/to/old/msc --msc ./msc
+
+import argparse
+import os
+import re
+import shutil
+import sys
+import tempfile
+
+benchDir = os.path.dirname(os.path.realpath(__file__))
+sys.path.append(os.path.join(benchDir, "..", "tests"))
+from mstest import runMsc
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, default="msc", help="msc binary to compare")
+parser.add_argument("--ref-msc", type=str, required=True, help="reference msc binary")
+parser.add_argument("-d", "--dir", type=str,
+        default=os.path.join(benchDir, "..", "examples"),
+        help="examples directory")
+args = parser.parse_args()
+
+def countAllocs(msc, srcFile, tmpDir):
+    returncode, output, _ = runMsc(msc, srcFile, ["-o", "bsv", "--alloc-stats"], cwd=tmpDir, merge=True)
+    m = re.search(r"translation made (\d+) allocations", output)
+    if m is None:
+        print(output)
+        sys.exit("%s: no allocation stats from %s (exit code %d)" % (srcFile, msc, returncode))
+    return int(m.group(1))
+
+tmpDir = tempfile.mkdtemp(suffix="_msbench")
+examples = sorted(f for f in os.listdir(args.dir) if f.endswith(".ms"))
+print("  %-24s %12s %12s %8s" % ("example", "allocations", "reference", "change"))
+total, refTotal = 0, 0
+for f in examples:
+    srcFile = os.path.abspath(os.path.join(args.dir, f))
+    allocs = countAllocs(args.msc, srcFile, tmpDir)
+    ref = countAllocs(args.ref_msc, srcFile, tmpDir)
+    total += allocs
+    refTotal += ref
+    print("  %-24s %12d %12d %+7.1f%%" % (f, allocs, ref, 100.0 * (allocs - ref) / ref))
+shutil.rmtree(tmpDir)
+print("  %-24s %12d %12d %+7.1f%%" % ("total", total, refTotal, 100.0 * (total - refTotal) / refTotal))
@@ -0,0 +1,83 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmark for Bluespec error translation: replays the bsc outputs in
+# tests/bscoutput, each repeated many times, and a generated output with
+# thousands of distinct warnings on a large design (tests/bscgen.py) through
+# msc --replay-bsc-output, and reports the time spent per bsc message. The time to translate the
+# Minispec file itself is measured by replaying an empty output, and is
+# subtracted. All repeated messages are reported (--all-errors), so
+# filtering does not hide translation costs.
+
+import argparse
+import os
+import re
+import shutil
+import subprocess as sp
+import sys
+import tempfile
+import time
+
+benchDir = os.path.dirname(os.path.realpath(__file__))
+corpusDir = os.path.join(benchDir, "..", "tests", "bscoutput")
+sys.path.append(os.path.join(benchDir, "..", "tests"))
+from bscgen import genBscOutput
+from mstest import mscCmd
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, default="msc", help="msc binary")
+parser.add_argument("-r", "--repeat", type=int, default=1000,
+        help="number of times each bsc output is repeated")
+parser.add_argument("-w", "--warnings", type=int, default=1000,
+        help="size of the generated bsc output (2x warnings, not repeated)")
+parser.add_argument("-t", "--trials", type=int, default=3,
+        help="number of runs per output (reports the fastest)")
+args = parser.parse_args()
+
+def runMsc(srcFile, bscoutFile):
+    cmd = mscCmd(args.msc, srcFile, ["--no-cache", "--all-errors", "--replay-bsc-output", bscoutFile])
+    best = None
+    for _ in range(args.trials):
+        start = time.perf_counter()
+        sp.run(cmd, stdout=sp.DEVNULL, stderr=sp.DEVNULL)
+        elapsed = time.perf_counter() - start
+        best = elapsed if best is None else min(best, elapsed)
+    return best
+
+tmpDir = tempfile.mkdtemp(suffix="_msbench")
+emptyFile = os.path.join(tmpDir, "empty.bscout")
+open(emptyFile, "w").close()
+inputs = []
+for f in sorted(os.listdir(corpusDir)):
+    if not f.endswith(".bscout"): continue
+    name = os.path.splitext(f)[0]
+    srcFile = os.path.abspath(os.path.join(corpusDir, "..", name + ".ms"))
+    inputs.append((name, srcFile, os.path.join(corpusDir, f), args.repeat))
+if args.warnings > 0:
+    inputs.append(("Many",) + genBscOutput(args.msc, tmpDir, args.warnings) + (1,))
+
+print("bsc output translation, %d repetitions (generated output: 1)" % args.repeat)
+print("  %-16s %10s %10s %12s" % ("output", "messages", "time (s)", "us/message"))
+for name, srcFile, bscoutFile, repeat in inputs:
+    with open(bscoutFile, "r") as bscout: output = bscout.read()
+    msgs = len(re.findall(r"(^|\n)(Error|Warning):", output)) * repeat
+    repeatedFile = os.path.join(tmpDir, name + ".repeated.bscout")
+    with open(repeatedFile, "w") as rf: rf.write(output * repeat)
+    t = runMsc(srcFile, repeatedFile) - runMsc(srcFile, emptyFile)
+    print("  %-16s %10d %10.3f %12.2f" % (name, msgs, t, t * 1e6 / msgs))
+shutil.rmtree(tmpDir)
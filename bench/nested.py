@@ -0,0 +1,97 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Stress benchmark for deeply nested elaboration: a function with deeply
+# nested unrolled for loops, with case statements and if/else blocks at each
+# level, whose translated code is merged many levels up. Runs msc on
+# increasingly larger designs (doubling the innermost loop's trip count) and
+# reports time and peak memory per unrolled iteration, which should stay
+# roughly constant as the design grows (i.e., msc scales linearly). Only
+# Bluespec output is produced, and bsc results come from the bsc cache after
+# the first (untimed) run of each size.
+
+import argparse
+import os
+import shutil
+import subprocess as sp
+import tempfile
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, default="msc", help="msc binary")
+parser.add_argument("-d", "--depth", type=int, default=6,
+        help="loop nesting depth (outer loops have 2 iterations each)")
+parser.add_argument("-n", "--size", type=int, default=16,
+        help="innermost loop trip count of the smallest design")
+parser.add_argument("-s", "--steps", type=int, default=4,
+        help="number of designs (each doubles the innermost trip count)")
+args = parser.parse_args()
+
+def genDesign(depth, n):
+    code = "function Bit#(32) nested(Bit#(32) x);\n    Bit#(32) acc = x;\n"
+    indent = "    "
+    for d in range(depth):
+        trips = 2 if d < depth - 1 else n
+        code += '''%(ind)sfor (Integer i%(d)d = 0; i%(d)d < %(t)d; i%(d)d = i%(d)d + 1) begin
+%(ind)s    case (i%(d)d %% 3)
+%(ind)s        0: acc = acc + %(d)d;
+%(ind)s        1: acc = acc ^ (acc >> %(d)d);
+%(ind)s        default: acc = acc - 1;
+%(ind)s    endcase
+''' % {"ind": indent, "d": d, "t": trips}
+        indent += "    "
+    code += "%sif (acc[0] == 1) acc = acc + 3; else acc = acc << 1;\n" % indent
+    for d in reversed(range(depth)):
+        indent = indent[:-4]
+        code += "%send\n" % indent
+    code += '''    return acc;
+endfunction
+
+module Nested;
+    Reg#(Bit#(32)) r(0);
+    rule step;
+        r <= nested(r);
+    endrule
+endmodule
+'''
+    return code
+
+def runMsc(srcFile, cwd):
+    start = time.perf_counter()
+    p = sp.Popen([args.msc, srcFile, "Nested", "-o", "bsv"], cwd=cwd, stdout=sp.PIPE, stderr=sp.STDOUT)
+    out = p.stdout.read()
+    _, status, rusage = os.wait4(p.pid, 0)
+    elapsed = time.perf_counter() - start
+    if os.waitstatus_to_exitcode(status) != 0:
+        print(out.decode("utf-8"))
+        raise SystemExit("%s failed with exit status %d" % (args.msc, status))
+    return elapsed, rusage.ru_maxrss  # KB on Linux
+
+tmpDir = tempfile.mkdtemp(suffix="_msbench")
+print("Nested design, depth %d" % args.depth)
+print("  %10s %10s %10s %12s %12s" % ("iterations", "time (s)", "RSS (MB)", "us/iter", "KB/iter"))
+for step in range(args.steps):
+    n = args.size << step
+    iters = (2 ** (args.depth - 1)) * n
+    srcFile = os.path.join(tmpDir, "Nested%d.ms" % n)
+    with open(srcFile, "w") as f: f.write(genDesign(args.depth, n))
+    runMsc(srcFile, tmpDir)  # warm up the bsc cache
+    t, rss = runMsc(srcFile, tmpDir)
+    print("  %10d %10.3f %10.1f %12.2f %12.2f" % (iters, t, rss / 1024, t * 1e6 / iters, rss / iters))
+shutil.rmtree(tmpDir)
@@ -0,0 +1,105 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Compile-time benchmark on a large unrolled design: nested for loops and
+# many instances of a loop-based parametric function. Elaboration dominates
+# msc's runtime on this design, as bsc results come from the bsc cache after
+# the first (untimed) run. Pass several msc binaries to compare them, e.g.,
+#   bench/unrolled.py --msc /path/to/old/msc ./msc
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess as sp
+import tempfile
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, nargs="+", default=["msc"],
+        help="msc binaries to benchmark (the first one is the baseline)")
+parser.add_argument("-n", "--size", type=int, default=64,
+        help="design size (loop trip counts and number of adder instances)")
+parser.add_argument("-r", "--runs", type=int, default=5,
+        help="timed runs per binary")
+args = parser.parse_args()
+
+def genDesign(n):
+    code = '''
+function Bit#(w) add#(Integer w)(Bit#(w) a, Bit#(w) b);
+    Bit#(w+1) cin = 0;
+    Bit#(w) res = 0;
+    for (Integer i = 0; i < w; i = i + 1) begin
+        let sum = a[i] ^ b[i] ^ cin[i];
+        let cout = (a[i] & b[i]) | (a[i] & cin[i]) | (b[i] & cin[i]);
+        res[i] = sum;
+        cin[i+1] = cout;
+    end
+    return res;
+endfunction
+
+function Bit#(%(n)d) mix(Bit#(%(n)d) x, Bit#(%(n)d) y);
+    Bit#(%(n)d) acc = 0;
+    for (Integer i = 0; i < %(n)d; i = i + 1) begin
+        for (Integer j = 0; j < %(n)d; j = j + 1) begin
+            if ((i + j) %% 3 == 0) acc[(i + j) %% %(n)d] = acc[(i + j) %% %(n)d] ^ (x[i] & y[j]);
+        end
+    end
+    return acc;
+endfunction
+
+module Unrolled;
+    Reg#(Bit#(%(n)d)) x(1);
+    Reg#(Bit#(%(n)d)) y(2);
+    rule mixStep;
+        x <= mix(x, y);
+        y <= add#(%(n)d)(x, y);
+    endrule
+''' % {"n": n}
+    for w in range(1, n + 1):
+        code += '''    Reg#(Bit#(%(w)d)) r%(w)d(0);
+    rule addStep%(w)d;
+        r%(w)d <= add#(%(w)d)(r%(w)d, %(w)d'd1);
+    endrule
+''' % {"w": w}
+    code += "endmodule\n"
+    return code
+
+tmpDir = tempfile.mkdtemp(suffix="_msbench")
+srcFile = os.path.join(tmpDir, "Unrolled.ms")
+with open(srcFile, "w") as f: f.write(genDesign(args.size))
+
+def runMsc(msc):
+    start = time.perf_counter()
+    p = sp.run([msc, srcFile, "Unrolled", "-o", "verilog"], cwd=tmpDir, stdout=sp.PIPE, stderr=sp.STDOUT)
+    elapsed = time.perf_counter() - start
+    if p.returncode != 0:
+        print(p.stdout.decode("utf-8"))
+        raise SystemExit("%s failed with exit code %d" % (msc, p.returncode))
+    return elapsed
+
+results = []
+for msc in args.msc:
+    runMsc(msc)  # warm up the bsc cache
+    results.append(statistics.median([runMsc(msc) for _ in range(args.runs)]))
+shutil.rmtree(tmpDir)
+
+print("Unrolled design, size %d (median of %d runs)" % (args.size, args.runs))
+for msc, t in zip(args.msc, results):
+    print("  %-40s %8.3f s  %6.2fx" % (msc, t, results[0] / t))
@@ -0,0 +1,80 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+
+# Elaboration walk benchmark over the examples/ corpus. Compiles parametric
+# examples with their Integer parameters scaled up to BSV, and reports the
+# time of the whole msc run. bsc's typecheck results come from the bsc cache
+# after the first (untimed) run, so elaboration dominates. Works with any msc
+# that has a bsc cache (no newer flags are needed), so pass several msc
+# binaries to compare them, e.g.,
+#   bench/walker.py --msc /path/to/old/msc ./msc
+
+import argparse
+import os
+import shutil
+import statistics
+import subprocess as sp
+import tempfile
+import time
+
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, nargs="+", default=["msc"],
+        help="msc binaries to benchmark (the first one is the baseline)")
+parser.add_argument("-s", "--scale", type=int, default=8,
+        help="factor to scale the Integer parameters of top-level targets by")
+parser.add_argument("-r", "--runs", type=int, default=5,
+        help="timed runs per binary and target")
+args = parser.parse_args()
+
+examplesDir = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "examples")
+# (file, top-level parametric, Integer parameter at scale 1)
+targets = [
+    ("cmp", "cmp", 11),
+    ("fanout", "mux", 64),
+    ("loop", "add", 27),
+    ("tree", "lessThan", 32),  # recursive, with a specialized base case
+]
+
+tmpDir = tempfile.mkdtemp(suffix="_msbench")
+
+def runMsc(msc, srcFile, topLevel):
+    cmd = [msc, srcFile, topLevel, "-o", "bsv"]
+    start = time.perf_counter()
+    p = sp.run(cmd, cwd=tmpDir, stdout=sp.PIPE, stderr=sp.STDOUT)
+    elapsed = time.perf_counter() - start
+    if p.returncode != 0:
+        print(p.stdout.decode("utf-8"))
+        raise SystemExit("%s failed with exit code %d" % (" ".join(cmd), p.returncode))
+    return elapsed
+
+results = {msc: [] for msc in args.msc}
+for f, name, param in targets:
+    srcFile = os.path.join(examplesDir, f + ".ms")
+    topLevel = "%s#(%d)" % (name, param * args.scale)
+    for msc in args.msc:
+        runMsc(msc, srcFile, topLevel)  # warm up the bsc cache
+        results[msc].append(statistics.median([runMsc(msc, srcFile, topLevel) for _ in range(args.runs)]))
+shutil.rmtree(tmpDir)
+
+print("msc time over %d examples, scale %d (median of %d runs)" % (len(targets), args.scale, args.runs))
+base = sum(results[args.msc[0]])
+for msc in args.msc:
+    t = sum(results[msc])
+    print("  %-40s %8.3f s  %6.2fx" % (msc, t, base / t))
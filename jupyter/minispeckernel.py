@@ -21,7 +21,7 @@
 
 from ipykernel.kernelbase import Kernel
 from IPython.display import SVG
-from subprocess import Popen, PIPE
+from subprocess import Popen, PIPE, DEVNULL
 from tempfile import mkdtemp
 import os, re, select, signal, sys
 
@@ -54,6 +54,7 @@ class MinispecKernel(Kernel):
     # Stores all files that form part of history
     history_files = []
     tmpDir = ""
+    mscServer = None
 
     # Display functions allow post-processing of a command's stdout/stderr 
     # before sending to Jupyter. runCmd guarantees that:
@@ -109,12 +110,22 @@ class MinispecKernel(Kernel):
         
         return p.returncode
 
+    def do_shutdown(self, restart):
+        if self.mscServer:
+            self.mscServer.terminate()
+        return {'status': 'ok', 'restart': restart}
+
     def do_execute(self, code, silent, store_history=True, user_expressions=None,
                    allow_stdin=False):
         # Initialize
         if self.tmpDir == "":
             self.tmpDir = mkdtemp(suffix="msj")
             self.log.warn("Using tmpDir: " + self.tmpDir)
+            # Run msc as a compile server, so each compile reuses the files
+            # parsed by earlier ones. msc compiles locally until it's up.
+            serverSocket = os.path.join(self.tmpDir, "msc.sock")
+            self.mscServer = Popen(["msc", "--server", serverSocket], stdout=DEVNULL)
+            os.environ["MSC_SERVER"] = serverSocket
         tmpDir = self.tmpDir
         errMsg = {'status': 'error'}
         userDir = os.getcwd()
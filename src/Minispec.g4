@@ -23,6 +23,10 @@
 
 grammar Minispec;
 
+// All parse tree contexts derive from MinispecRuleContext (see parsetree.h)
+options { contextSuperClass = MinispecRuleContext; }
+@parser::header { #include "parsetree.h" }
+
 UpperCaseIdentifier : [A-Z][a-zA-Z0-9_]* ;
 LowerCaseIdentifier : [a-z_][a-zA-Z0-9_]* ;
 DollarIdentifier : [$][a-z][a-zA-Z0-9_$]* ;
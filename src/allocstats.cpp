@@ -0,0 +1,57 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+#include "allocstats.h"
+
+#ifdef MSC_ALLOC_STATS
+
+static std::atomic<uint64_t> allocs(0);
+static std::atomic<uint64_t> bytes(0);
+
+bool allocStatsEnabled() { return true; }
+
+AllocStats getAllocStats() {
+    return {allocs.load(std::memory_order_relaxed), bytes.load(std::memory_order_relaxed)};
+}
+
+static void* countedAlloc(size_t size) {
+    allocs.fetch_add(1, std::memory_order_relaxed);
+    bytes.fetch_add(size, std::memory_order_relaxed);
+    void* p = malloc(size? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+// The nothrow and aligned variants of new call these or use malloc-family
+// allocators, and all variants of delete end up in free()
+void* operator new(size_t size) { return countedAlloc(size); }
+void* operator new[](size_t size) { return countedAlloc(size); }
+void operator delete(void* p) noexcept { free(p); }
+void operator delete[](void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+void operator delete[](void* p, size_t) noexcept { free(p); }
+
+#else
+
+bool allocStatsEnabled() { return false; }
+AllocStats getAllocStats() { return {0, 0}; }
+
+#endif  // MSC_ALLOC_STATS
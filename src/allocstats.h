@@ -0,0 +1,33 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+// Heap allocation counters, for allocation comparisons (see
+// bench/allocs.py). Builds with MSC_ALLOC_STATS defined (scons
+// --alloc-stats) replace the global operator new to count all allocations
+// (in all threads) made through it, including those of the ANTLR runtime.
+// Other builds do not count allocations, so they pay nothing for them.
+struct AllocStats {
+    uint64_t allocs;
+    uint64_t bytes;
+};
+bool allocStatsEnabled();
+AllocStats getAllocStats();
@@ -0,0 +1,593 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+#include <tuple>
+#include <unordered_map>
+#include "bscoutput.h"
+#include "errors.h"
+#include "parse.h"
+#include "strutils.h"
+
+using namespace antlr4;
+
+/* Scanning */
+
+static bool startsWith(const std::string& s, size_t pos, const char* prefix) {
+    return s.compare(pos, strlen(prefix), prefix) == 0;
+}
+
+std::vector<BscMessage> scanBscOutput(const std::string& output) {
+    std::vector<BscMessage> res;
+    size_t pos = 0;
+    while (pos < output.size()) {
+        // Find the next block start (blocks may start mid-line)
+        size_t start = pos;
+        bool isError = false;
+        size_t hdrLen = 0;
+        for (; start < output.size(); start++) {
+            if (output[start] == 'E' && startsWith(output, start, "Error: ")) {
+                isError = true;
+                hdrLen = strlen("Error: ");
+                break;
+            } else if (output[start] == 'W' && startsWith(output, start, "Warning: ")) {
+                hdrLen = strlen("Warning: ");
+                break;
+            }
+        }
+        if (start >= output.size()) break;
+
+        // The block ends before the next line that starts a block
+        size_t textStart = start + hdrLen;
+        size_t end = textStart;
+        for (; end < output.size(); end++) {
+            if (output[end] == '\n' && (startsWith(output, end + 1, "Error:") ||
+                        startsWith(output, end + 1, "Warning:")))
+                break;
+        }
+        res.push_back({isError, output.substr(textStart, end - textStart)});
+        pos = end;
+    }
+    return res;
+}
+
+/* Matching helpers. These follow the semantics of the regexes that msc used
+ * to match bsc messages (e.g., \s+, \S+, and lazy .*? captures), but each
+ * runs in a single pass. */
+
+// multiline: whether newlines count as spaces. Messages are matched line by
+// line (i.e., a space sequence never spans lines), except when translating
+// the locations of unknown messages.
+static bool isSpace(char c, bool multiline) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v' || (multiline && c == '\n');
+}
+
+static size_t skipSpaces(const std::string& s, size_t pos, bool multiline) {
+    while (pos < s.size() && isSpace(s[pos], multiline)) pos++;
+    return pos;
+}
+
+// End of the run of non-space characters starting at pos
+static size_t runEnd(const std::string& s, size_t pos) {
+    while (pos < s.size() && !isSpace(s[pos], true)) pos++;
+    return pos;
+}
+
+static size_t skipDigits(const std::string& s, size_t pos) {
+    while (pos < s.size() && isdigit(s[pos])) pos++;
+    return pos;
+}
+
+struct BscLoc {
+    size_t start, end;  // matched text
+    std::string file;
+    uint32_t line, lineChar;
+    std::string code;
+};
+
+// Matches a bsc location, "<file>", line <n>, column <n>, starting at the
+// quote at s[q], and if withCode, the following ": (<code>)"
+static bool matchLoc(const std::string& s, size_t q, bool withCode, bool multiline, BscLoc& loc) {
+    if (s[q] != '"') return false;
+    size_t e = runEnd(s, q + 1);
+    if (e < q + 4 || s[e - 2] != '"' || s[e - 1] != ',') return false;
+    size_t p = skipSpaces(s, e, multiline);
+    if (p == e || !startsWith(s, p, "line")) return false;
+    size_t lineStart = skipSpaces(s, p + 4, multiline);
+    if (lineStart == p + 4) return false;
+    size_t lineEnd = skipDigits(s, lineStart);
+    if (lineEnd == lineStart || lineEnd >= s.size() || s[lineEnd] != ',') return false;
+    p = skipSpaces(s, lineEnd + 1, multiline);
+    if (p == lineEnd + 1 || !startsWith(s, p, "column")) return false;
+    size_t colStart = skipSpaces(s, p + 6, multiline);
+    if (colStart == p + 6) return false;
+    size_t colEnd = skipDigits(s, colStart);
+    if (colEnd == colStart) return false;
+
+    loc.start = q;
+    loc.end = colEnd;
+    loc.file = s.substr(q + 1, e - 2 - (q + 1));
+    loc.line = atoi(s.c_str() + lineStart);
+    loc.lineChar = atoi(s.c_str() + colStart);
+    if (withCode) {
+        if (colEnd >= s.size() || s[colEnd] != ':') return false;
+        p = skipSpaces(s, colEnd + 1, multiline);
+        if (p == colEnd + 1 || !startsWith(s, p, "(")) return false;
+        size_t codeStart = p + 1;
+        size_t codeEnd = s.rfind(')', runEnd(s, codeStart) - 1);
+        if (codeEnd == std::string::npos || codeEnd <= codeStart) return false;
+        loc.code = s.substr(codeStart, codeEnd - codeStart);
+        loc.end = codeEnd + 1;
+    }
+    return true;
+}
+
+static bool findLoc(const std::string& s, bool withCode, bool multiline, BscLoc& loc) {
+    for (size_t q = s.find('"'); q != std::string::npos; q = s.find('"', q + 1)) {
+        if (matchLoc(s, q, withCode, multiline, loc)) return true;
+    }
+    return false;
+}
+
+// Matches lits[0] (.*?) lits[1] (.*?) ... lits[n-1] in s, and if toEnd, a
+// final capture until the end of s. Each literal is matched at its first
+// occurrence, as a regex with lazy captures would.
+static bool matchLiterals(const std::string& s, const std::vector<const char*>& lits, bool toEnd,
+        std::vector<std::string>& caps) {
+    size_t pos = s.find(lits[0]);
+    if (pos == std::string::npos) return false;
+    pos += strlen(lits[0]);
+    caps.clear();
+    for (size_t i = 1; i < lits.size(); i++) {
+        size_t litPos = s.find(lits[i], pos);
+        if (litPos == std::string::npos) return false;
+        caps.push_back(s.substr(pos, litPos - pos));
+        pos = litPos + strlen(lits[i]);
+    }
+    if (toEnd) caps.push_back(s.substr(pos));
+    return true;
+}
+
+// Matches <prefix>\s+(\S+?)#\((.*)\), i.e., a typeclass proviso
+static bool matchProviso(const std::string& s, const char* prefix, std::string& typeclass, std::string& type) {
+    for (size_t pos = s.find(prefix); pos != std::string::npos; pos = s.find(prefix, pos + 1)) {
+        size_t start = skipSpaces(s, pos + strlen(prefix), false);
+        if (start == pos + strlen(prefix)) continue;
+        size_t hash = s.find("#(", start);
+        if (hash == std::string::npos || hash == start || runEnd(s, start) < hash) continue;
+        size_t close = s.rfind(')');
+        if (close == std::string::npos || close < hash + 2) continue;
+        typeclass = s.substr(start, hash - start);
+        type = s.substr(hash + 2, close - (hash + 2));
+        return true;
+    }
+    return false;
+}
+
+/* Per-code rewriters. Each rewrites the message body on success, and
+ * otherwise leaves it as is. */
+
+struct BscDiag {
+    bool isError;
+    std::string code;
+    std::string body;  // processed (locations translated, elements highlighted)
+    std::string unprocessedBody;
+    std::string loc;
+    uint32_t line, lineChar;
+    std::vector<std::string> elems;
+    std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> locToPos;
+    bool simOut;
+};
+
+static void rewriteTypeError(BscDiag& d) {
+    // NOTE: T0020 is for expressions and T0080 is for functions, but
+    // Bluespec seems to implement several constant as functions (e.g.,
+    // True and False). So, we output exactly the same error message
+    // for both
+    std::vector<std::string> m;
+    bool matched = (d.code == "T0020")?
+        matchLiterals(d.body, {"type error at: ", " Expected type: ", " Inferred type: "}, true, m) :
+        matchLiterals(d.body, {"type error at the use of the following function: ",
+                " The expected return type of the function: ",
+                " The return type according to the use: "}, true, m);
+    if (matched) {
+        std::string elem = m[0];
+        std::string expectedType = m[1];
+        std::string type = m[2];
+        d.body = "expression " + errorColored("'" + elem + "'") + " has type " + hlColored(type) + ", but use requires type " + hlColored(expectedType);
+        d.elems.push_back(elem);
+    }
+}
+
+static void rewriteBitsProviso(BscDiag& d, const std::string& type) {
+    // Match (.*?), (\S+)
+    for (size_t sep = type.find(", "); sep != std::string::npos; sep = type.find(", ", sep + 1)) {
+        size_t lenEnd = runEnd(type, sep + 2);
+        if (lenEnd == sep + 2) continue;
+        std::string badType = type.substr(0, sep);
+        std::string length = type.substr(sep + 2, lenEnd - (sep + 2));
+        d.body = "type " + errorColored("'" + badType + "'") + " cannot be used here";
+        if (badType == "Integer") {
+            d.body += " because Integer is a compile-time-only type with an unbounded number of bits, so it can't be synthesized to hardware";
+        } else if (length == "a__") {
+            // FIXME: This happens in Reg#(), but seems very tailored.
+            d.body += " because this type is not synthesizable to bits, which is required by the use";
+        } else {
+            d.body += " because either this type is not synthesizable to bits, or it has a bit-width incompatible with its use";
+        }
+        return;
+    }
+}
+
+static void rewriteAddProviso(BscDiag& d, const std::string& type) {
+    d.body = "expression type has a number of bits or elements incompatible with its use";
+    // Find "n1, n2, n3" and "n1, <name>_, 0"
+    for (size_t p = 0; p < type.size(); p++) {
+        if (!isdigit(type[p]) || (p > 0 && isdigit(type[p - 1]))) continue;
+        size_t e1 = skipDigits(type, p);
+        if (!startsWith(type, e1, ", ")) continue;
+        size_t e2 = skipDigits(type, e1 + 2);
+        if (e2 == e1 + 2 || !startsWith(type, e2, ", ")) continue;
+        size_t e3 = skipDigits(type, e2 + 2);
+        if (e3 == e2 + 2) continue;
+        d.body += " (for lengths to match, " + type.substr(p, e1 - p) + " + " +
+            type.substr(e1 + 2, e2 - (e1 + 2)) + " should equal " + type.substr(e2 + 2, e3 - (e2 + 2)) + ")";
+        break;
+    }
+    // All the "overlength" expressions I've seen so far (e.g.,
+    // concatenation) follow this format; if you see something
+    // else, e.g., Add#(a__, 1, 0), generalize this match.
+    for (size_t p = 0; p < type.size(); p++) {
+        if (!isdigit(type[p]) || (p > 0 && isdigit(type[p - 1]))) continue;
+        size_t e1 = skipDigits(type, p);
+        if (!startsWith(type, e1, ", ")) continue;
+        size_t e2 = runEnd(type, e1 + 2);
+        if (e2 < e1 + 5 || !startsWith(type, e2 - 2, "_,") || !startsWith(type, e2, " 0")) continue;
+        d.body += " (expression has " + type.substr(p, e1 - p) + " more/fewer bits or elements than its use allows)";
+        break;
+    }
+}
+
+static void rewriteProvisoError(BscDiag& d) {
+    // First, find if the compiler is pinpointing an expression.
+    // If so, use the expression loc as the loc, as that is,
+    // by observation, more accurate.
+    // NOTE: We used to do this only for T0032, where the default loc
+    // is always way off---the beginning of the offending module. But
+    // for some T0031s we've found the default loc to be bad too, so
+    // just do it always. If the location is perplexing in some cases,
+    // we could do more detailed analysis to see when the default loc
+    // is bad (e.g., it's untranslated)
+    const char* exprMarker = " The proviso was implied by expressions at the following positions: ";
+    size_t exprPos = d.body.find(exprMarker);
+    if (exprPos != std::string::npos) {
+        size_t locStart = exprPos + strlen(exprMarker);
+        size_t locEnd = runEnd(d.body, locStart);
+        std::string exprLoc = d.body.substr(locStart, locEnd - locStart);
+        bool isLoc = d.locToPos.find(exprLoc) != d.locToPos.end();
+        bool isMinispec = exprLoc.find("(translated") == std::string::npos;
+        if (locEnd > locStart && isLoc && isMinispec) {
+            d.loc = exprLoc;
+            std::tie(d.line, d.lineChar) = d.locToPos[exprLoc];
+            replace(d.body, d.body.substr(exprPos, locEnd - exprPos), "");  // take it out
+        }
+    }
+
+    // Then, handle the actual proviso error
+    std::string typeclass, type;
+    if (!matchProviso(d.body, (d.code == "T0031")? "no instances of the form:" :
+                "proviso which could not be resolved:", typeclass, type)) return;
+    if (typeclass == "Arith") {
+        d.body = "type " + hlColored(type) + " does not support arithmetic operations";
+    } else if (typeclass == "Ord") {
+        d.body = "type " + hlColored(type) + " does not support comparison operations";
+    } else if (typeclass == "Literal") {
+        d.body = "cannot convert literal to type " + hlColored(type);
+    } else if (typeclass == "FShow") {
+        d.body = "cannot display value of type " + hlColored(type);
+        if (type.find("function") == 0)
+            d.body += " (this is a function, did you forget some/all the arguments?)";
+    } else if (typeclass == "Bits") {
+        rewriteBitsProviso(d, type);
+    } else if (typeclass == "Add") {
+        rewriteAddProviso(d, type);
+    }
+}
+
+static void rewriteUnboundConstructor(BscDiag& d) {
+    // I see these only on mistyped literals, but unbound constructor
+    // is such a general message that who knows where else it may show
+    // up. So leave the translated error general.
+    replace(d.body, "unbound constructor", "undefined literal, type, or module");
+}
+
+static void rewriteUnboundVariable(BscDiag& d) {
+    replace(d.body, "unbound variable", "undefined variable or function");
+}
+
+static void rewriteUnboundType(BscDiag& d) {
+    replace(d.body, "unbound type constructor", "undefined type or module");
+}
+
+static void rewriteMissingField(BscDiag& d) {
+    // Error message is good, except when it's an input, so process only that
+    std::vector<std::string> m;
+    if (matchLiterals(d.unprocessedBody, {"Field `", "___input' is not in the type `",
+                "' which was derived for this expression"}, false, m)) {
+        d.body = "module " + hlColored(m[1]) + " does not have an input named " + errorColored("'" + m[0] + "'");
+    }
+}
+
+static void rewriteArgCount(BscDiag& d) {
+    // Errors related to using a function with the wrong number of arguments
+    // First, the expected/inferred type trailing info is more confusing then helpful (function type noise). So take that out.
+    std::string trailMarker = (d.code == "T0081")? " Expected type:" : " The expected type is:";
+    auto trailStart = d.body.find(trailMarker);
+    d.body = d.body.substr(0, trailStart);  // safe even if trail is string::npos
+    // Second, if the function is actually a module, don't call it a function :)
+    if (d.body.find(": mk") != std::string::npos) {
+        replace(d.body, ": mk", ": ");
+        replace(d.body, "function", "module");
+    }
+}
+
+// Matches (.*?)(\S+)<suffix> starting at pos: the first non-space run that
+// is immediately followed by suffix
+static bool matchRunBefore(const std::string& s, size_t pos, const char* suffix,
+        std::string& guard, std::string& run, size_t& end) {
+    for (size_t p = pos; p < s.size(); p++) {
+        if (isSpace(s[p], true) || (p > pos && !isSpace(s[p - 1], true))) continue;
+        size_t e = runEnd(s, p);
+        if (!startsWith(s, e, suffix)) continue;
+        guard = s.substr(pos, p - pos);
+        run = s.substr(p, e - p);
+        end = e + strlen(suffix);
+        return true;
+    }
+    return false;
+}
+
+static void rewriteConflict(BscDiag& d) {
+    // Register double-writes and input/wire double-sets
+    const std::string& s = d.unprocessedBody;
+    std::vector<std::string> m;
+    if (!matchLiterals(s, {"Rule `", "' uses methods that conflict in parallel: "}, false, m)) return;
+    std::string rule = m[0];
+    size_t pos = s.find("' uses methods that conflict in parallel: ") + strlen("' uses methods that conflict in parallel: ");
+    // g1/g2 are the "guards" and may be empty; m1 and m2 are the methods
+    std::string g1, m1, g2, m2;
+    if (!matchRunBefore(s, pos, " and ", g1, m1, pos)) return;
+    if (!matchRunBefore(s, pos, " For the complete expressions", g2, m2, pos)) return;
+    bool isWrite = m1.find(".write") != std::string::npos;
+    bool isWset = m1.find(".wset") != std::string::npos;
+    bool isWget2 = m2.find(".wget") != std::string::npos;
+    bool isWhas2 = m2.find(".whas") != std::string::npos;
+    std::string base1 = "'" + m1.substr(0, m1.find(".")) + "'";
+    std::string base2 = "'" + m2.substr(0, m1.find(".")) + "'";
+
+    d.body = "rule " + errorColored("'" + rule + "'") + " ";
+    if (m1 == m2 && (isWrite || isWset)) {
+        if (isWrite) {
+            d.body += "writes to register " + errorColored(base1) + " more than once, which is forbidden";
+        } else {
+            assert(isWset);
+            d.body += "sets input or wire " + errorColored(base1) + " more than once, which is forbidden";
+        }
+        // Non-disjoint if statements are confusing, so clarify
+        if (g1 == g2 || g1 == "if (...) ")
+            d.body += "; these happen inside if statements that have overlapping predicates (make the if statements mutually exclusive, so that they never take effect on the same cycle)";
+    } else if (isWset && isWget2 && base1 == base2) {
+        d.body += "both sets input or wire " + errorColored(base1) + ", and reads from it (perhaps through a method), which is forbidden";
+    } else if (isWset && isWhas2 && base1 == base2) {
+        // NOTE(dsm): whas seems to always fire with wget; print them separately though, in case there's a wset/whas conflict but not wset/wget
+        d.body += "both sets input or wire " + errorColored(base1) + " (which has a default value), and reads from it (perhaps through a method), which is forbidden";
+    } else {
+        // Print a generic message, this must be interacting with Bluespec code
+        d.body += "cannot call methods " + errorColored(m1) + " and " + errorColored(m2) + " because they conflict";
+    }
+}
+
+static void rewriteBlockedRule(BscDiag& d) {
+    // Minispec rules must fire every cycle
+    std::vector<std::string> m;
+    if (matchLiterals(d.unprocessedBody, {"The assertion `fire_when_enabled' failed for rule `",
+                "' because it is blocked by rule ", " in the scheduler"}, false, m)) {
+        d.body = "rules " + errorColored(m[0]) + " and " + errorColored(m[1]) +
+            " conflict and cannot both fire every cycle (e.g., they both try to set the same input of a shared module)";
+    }
+}
+
+static void rewriteUnsetInput(BscDiag& d) {
+    std::vector<std::string> m;
+    if (matchLiterals(d.unprocessedBody, {"Instance `", "' requires the following method to be always enabled"}, false, m)) {
+        d.body = "input or wire " + errorColored("'" + m[0] + "'") + " has no default value, so it must be set every cycle, but it is never being set";
+    }
+}
+
+static void rewriteSometimesSetInput(BscDiag& d) {
+    std::vector<std::string> m;
+    if (matchLiterals(d.unprocessedBody, {"Instance `", "' requires the following method to be always enabled, "
+                "but the condition for executing the method could not be proven to be always True: _write"}, false, m)) {
+        // This is a warning, but its gravity is context-dependent. If
+        // we're producing Verilog, then it should stay a warning (or
+        // go away); if this is simulation, then we must promote it to
+        // an error, as it'll actually cause things to misbehave.
+        d.isError = d.simOut;
+        d.body = "input or wire " + errorColored("'" + m[0] + "'") + " has no default value, so it must be set every cycle, but it is being set only sometimes (at least, I cannot prove that a rule is setting it every cycle; simplify your control flow or add a default value); note: this warning is promoted to an error when producing simulation executables";
+    }
+}
+
+typedef void (*BscRewriteFn)(BscDiag&);
+static const std::unordered_map<std::string, BscRewriteFn> bscRewriters = {
+    {"T0020", rewriteTypeError},
+    {"T0080", rewriteTypeError},
+    {"T0031", rewriteProvisoError},
+    {"T0032", rewriteProvisoError},
+    {"T0003", rewriteUnboundConstructor},
+    {"T0004", rewriteUnboundVariable},
+    {"T0007", rewriteUnboundType},
+    {"T0016", rewriteMissingField},
+    {"T0081", rewriteArgCount},
+    {"T0083", rewriteArgCount},
+    {"T0084", rewriteArgCount},
+    {"G0004", rewriteConflict},
+    {"G0005", rewriteBlockedRule},
+    {"G0066", rewriteUnsetInput},
+    {"G0015", rewriteSometimesSetInput},
+};
+
+/* Reporting */
+
+static std::string translateLoc(const SourceMap* sm, uint32_t line, uint32_t lineChar) {
+    auto pt = sm->find(line, lineChar);
+    if (pt) return getLoc(pt);
+    else return "(translated bsv:" + std::to_string(line) + ":" + std::to_string(lineChar) + ")";
+}
+
+// Replaces all bsc locations in msg with (highlighted) Minispec locations
+static std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> translateAllLocs(
+        std::string& msg, const TranslatedPackages& pkgs, bool multiline) {
+    std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> locToPos;
+    std::string res;
+    size_t pos = 0;
+    BscLoc bscLoc;
+    for (size_t q = msg.find('"'); q != std::string::npos; q = msg.find('"', q + 1)) {
+        if (!matchLoc(msg, q, false, multiline, bscLoc)) continue;
+        std::string loc;
+        if (auto locSm = pkgs.find(bscLoc.file)) {
+            loc = translateLoc(locSm, bscLoc.line, bscLoc.lineChar);
+        } else {
+            loc = bscLoc.file + ":" + std::to_string(bscLoc.line) + ":" + std::to_string(bscLoc.lineChar);
+        }
+        res.append(msg, pos, q - pos);
+        res += hlColored(loc);
+        locToPos[hlColored(loc)] = std::make_tuple(bscLoc.line, bscLoc.lineChar);
+        pos = bscLoc.end;
+        q = pos - 1;
+    }
+    if (pos == 0) return locToPos;
+    res.append(msg, pos, std::string::npos);
+    msg = std::move(res);
+    return locToPos;
+}
+
+// Replaces all `elem' with highlighted 'elem', returning the elements.
+// Module constructors are translated back to the module name.
+static std::vector<std::string> highlightElems(std::string& body) {
+    std::vector<std::string> elems;
+    std::string res;
+    size_t pos = 0;
+    while (true) {
+        size_t start = body.find('`', pos);
+        if (start == std::string::npos) break;
+        size_t end = body.find('\'', start + 1);
+        if (end == std::string::npos) break;
+        std::string elem = body.substr(start + 1, end - start - 1);
+        if (elem.size() > 2 && elem.find("mk") == 0 && isupper(elem[2]))
+            elem = elem.substr(2);
+        if (std::find(elems.begin(), elems.end(), elem) == elems.end()) elems.push_back(elem);
+        res.append(body, pos, start - pos);
+        res += errorColored("'" + elem + "'");
+        pos = end + 1;
+    }
+    res.append(body, pos, std::string::npos);
+    body = std::move(res);
+    return elems;
+}
+
+// Joins lines and collapses space runs into single spaces, and trims
+static std::string joinLines(const std::string& s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '\n') c = ' ';
+        if (c == ' ' && (res.empty() || res.back() == ' ')) continue;
+        res += c;
+    }
+    if (!res.empty() && res.back() == ' ') res.pop_back();
+    return res;
+}
+
+static std::string contextStr(const SourceMap* sm, uint32_t line, uint32_t lineChar,
+        const std::vector<std::string>& elems) {
+    tree::ParseTree* ctx = nullptr;
+    for (auto elem : elems) {
+        ctx = sm->find(line, lineChar, elem);
+        if (ctx) break;
+    }
+    if (!ctx) ctx = sm->find(line, lineChar);
+    if (ctx) return contextStr(ctx, {ctx});
+    return "";
+}
+
+void reportBluespecOutput(const std::string& output, const TranslatedPackages& pkgs,
+        const std::string& topLevel, bool simOut) {
+    auto reportUnknownMsg = [&](bool isError, std::string msg) {
+        translateAllLocs(msg, pkgs, /*multiline=*/true);
+        msg = (isError? errorColored("error:") : warnColored("warning:")) + " " + msg + "\n";
+        reportMsg(isError, msg);
+    };
+
+    for (auto& [isError, msg] : scanBscOutput(output)) {
+        BscLoc hdr;
+        if (!findLoc(msg, /*withCode=*/true, /*multiline=*/false, hdr)) {
+            // Special-case not-found top-level error
+            if (msg.find("Command line:") != std::string::npos && msg.find("Unbound variable `mk") != std::string::npos) {
+                bool isModule = isupper(topLevel[0]);
+                reportMsg(isError, errorColored("error:") + " cannot find top-level " +
+                        (isModule? "module" : "function") + " " + errorColored("'" + topLevel + "'"));
+            } else {
+                reportUnknownMsg(isError, msg);
+            }
+            continue;
+        }
+        const SourceMap* sm = pkgs.find(hdr.file);
+        if (!sm) {
+            reportUnknownMsg(isError, "in imported BSV file " + msg);
+            continue;
+        }
+
+        BscDiag d;
+        d.isError = isError;
+        d.code = hdr.code;
+        d.line = hdr.line;
+        d.lineChar = hdr.lineChar;
+        d.simOut = simOut;
+        d.loc = translateLoc(sm, d.line, d.lineChar);
+        d.body = joinLines(msg.substr(hdr.end));
+        d.unprocessedBody = d.body;
+        if (d.body.size()) d.body[0] = tolower(d.body[0]);
+        d.locToPos = translateAllLocs(d.body, pkgs, /*multiline=*/false);
+        d.elems = highlightElems(d.body);
+
+        // Rewriters rewrite body on success, o/w they leave the default message
+        auto it = bscRewriters.find(d.code);
+        if (it != bscRewriters.end()) it->second(d);
+
+        // Simplify bsc output: Translated::TypeName -> TypeName, etc.
+        for (const auto& name : pkgs.names) replace(d.body, name + "::", "");
+        replace(d.body, "Vector::Vector", "Vector");
+
+        std::stringstream ss;
+        ss << hlColored(d.loc + ":") << " " << (d.isError? errorColored("error:") : warnColored("warning:")) << " " << d.body << "\n";
+        ss << contextStr(sm, d.line, d.lineChar, d.elems);
+        reportMsg(d.isError, ss.str(), sm->getContextInfo(d.line, d.lineChar), sm->find(d.line, d.lineChar));
+    }
+}
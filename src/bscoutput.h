@@ -0,0 +1,41 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+#include "translate.h"
+
+// Processing of Bluespec compiler (bsc) output. bsc reports diagnostics as
+// blocks that start with "Error: " or "Warning: " and extend until the next
+// block (a line that starts with "Error:" or "Warning:"). Blocks are scanned
+// in a single pass without regexes; each block's locations are translated to
+// Minispec locations, and messages with known codes are rewritten into
+// Minispec terms by a per-code rewriter.
+
+struct BscMessage {
+    bool isError;
+    std::string text;  // everything after "Error: " or "Warning: "
+};
+
+std::vector<BscMessage> scanBscOutput(const std::string& output);
+
+// Reports all diagnostics in bsc's output
+void reportBluespecOutput(const std::string& output, const TranslatedPackages& pkgs,
+        const std::string& topLevel, bool simOut);
@@ -0,0 +1,220 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include "cache.h"
+#include "hash.h"
+#include "log.h"
+#include "process.h"
+
+namespace fs = std::filesystem;
+
+static std::string cacheDir = "";
+static uint64_t cacheMaxBytes = 0;
+// Lookups may run concurrently (e.g., sim and Verilog flows)
+static struct {
+    std::atomic<uint64_t> hits, misses, evictions;
+} stats = {{0}, {0}, {0}};
+
+void initBscCache(const std::string& dir, uint64_t maxBytes) {
+    cacheDir = dir;
+    cacheMaxBytes = maxBytes;
+    if (cacheDir == "") return;
+    std::error_code ec;
+    fs::create_directories(cacheDir, ec);
+    if (ec) {
+        warn("could not create cache directory %s (%s), disabling cache", cacheDir.c_str(), ec.message().c_str());
+        cacheDir = "";
+    }
+}
+
+bool bscCacheEnabled() { return cacheDir != ""; }
+
+std::string defaultBscCacheDir() {
+    const char* xdgCache = getenv("XDG_CACHE_HOME");
+    if (xdgCache && xdgCache[0]) return fs::path(xdgCache) / "msc";
+    const char* home = getenv("HOME");
+    if (home && home[0]) return fs::path(home) / ".cache" / "msc";
+    return "";
+}
+
+std::string bscCacheKey(const std::vector<std::string>& inputs) {
+    return contentHash(std::vector<std::string_view>(inputs.begin(), inputs.end()));
+}
+
+bool lookupBscCache(const std::string& key, const std::string& workDir,
+        const std::vector<std::string>& outFiles, std::string& output) {
+    if (!bscCacheEnabled()) return false;
+    fs::path entry = fs::path(cacheDir) / key;
+    std::error_code ec;
+    if (!fs::is_directory(entry, ec)) {
+        stats.misses++;
+        return false;
+    }
+
+    std::ifstream outputStream(entry / "output");
+    if (!outputStream.good()) {
+        stats.misses++;
+        return false;
+    }
+    std::stringstream ss;
+    ss << outputStream.rdbuf();
+
+    bool ok = true;
+    fs::path workEntry = entry / "work";
+    if (fs::is_directory(workEntry, ec)) {
+        for (auto& f : fs::directory_iterator(workEntry, ec)) {
+            ok &= fastCopyFile(f.path(), fs::path(workDir) / f.path().filename());
+        }
+    }
+    for (size_t i = 0; i < outFiles.size(); i++) {
+        fs::path cached = entry / "out" / std::to_string(i);
+        if (fs::exists(cached, ec)) ok &= fastCopyFile(cached, outFiles[i]);
+    }
+    if (!ok || ec) {
+        // Partially restored entry; treat as a miss, bsc will overwrite everything
+        warn("could not restore cache entry %s, ignoring it", entry.c_str());
+        stats.misses++;
+        return false;
+    }
+
+    // Track LRU order through the entry's modification time
+    fs::last_write_time(entry, fs::file_time_type::clock::now(), ec);
+    output = ss.str();
+    stats.hits++;
+    return true;
+}
+
+static uint64_t dirSize(const fs::path& dir) {
+    uint64_t size = 0;
+    std::error_code ec;
+    for (auto& f : fs::recursive_directory_iterator(dir, ec)) {
+        if (f.is_regular_file(ec)) size += f.file_size(ec);
+    }
+    return size;
+}
+
+// Approximate total size of the cache entries, kept in a file so stores need
+// not scan the whole cache. Updated under a file lock, as several msc
+// processes may share the cache. Adds delta to the size and returns the new
+// total, or sets the size to delta with reset (after a full scan). Returns
+// UINT64_MAX if the size is unknown (e.g., the index does not exist yet).
+static uint64_t updateSizeIndex(uint64_t delta, bool reset) {
+    std::string indexFile = fs::path(cacheDir) / ".size";
+    int fd = open(indexFile.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return UINT64_MAX;
+    flock(fd, LOCK_EX);
+    char buf[32];
+    ssize_t bytes = pread(fd, buf, sizeof(buf) - 1, 0);
+    uint64_t size = UINT64_MAX;
+    if (reset) {
+        size = delta;
+    } else if (bytes > 0) {
+        buf[bytes] = 0;
+        size = strtoull(buf, nullptr, 10) + delta;
+    }
+    if (size != UINT64_MAX) {
+        int len = snprintf(buf, sizeof(buf), "%lu\n", (unsigned long) size);
+        if (ftruncate(fd, 0) != 0 || pwrite(fd, buf, len, 0) != len) size = UINT64_MAX;
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    return size;
+}
+
+// Scans the cache and evicts least-recently-used entries until it is below
+// 90% of its maximum size, so evictions (and scans) are not triggered on
+// every store once the cache is full
+static void evictBscCache() {
+    struct Entry {
+        fs::path path;
+        fs::file_time_type lastUse;
+        uint64_t size;
+    };
+    std::vector<Entry> entries;
+    uint64_t totalSize = 0;
+    std::error_code ec;
+    for (auto& e : fs::directory_iterator(cacheDir, ec)) {
+        // Skip entries being written by other msc processes
+        // (and the size index)
+        if (!e.is_directory(ec) || e.path().filename().string().find('.') != std::string::npos) continue;
+        Entry entry = {e.path(), fs::last_write_time(e.path(), ec), dirSize(e.path())};
+        totalSize += entry.size;
+        entries.push_back(entry);
+    }
+    uint64_t targetSize = cacheMaxBytes / 10 * 9;
+    if (totalSize > cacheMaxBytes) {
+        std::sort(entries.begin(), entries.end(),
+                [](const Entry& a, const Entry& b) { return a.lastUse < b.lastUse; });
+        for (const auto& entry : entries) {
+            if (totalSize <= targetSize) break;
+            fs::remove_all(entry.path, ec);
+            totalSize -= entry.size;
+            stats.evictions++;
+        }
+    }
+    updateSizeIndex(totalSize, /*reset=*/true);
+}
+
+void storeBscCache(const std::string& key, const std::string& workDir, const std::string& skipFile,
+        const std::vector<std::string>& outFiles, const std::string& output) {
+    if (!bscCacheEnabled()) return;
+    // Build the entry under a temporary name and rename it into place, so
+    // concurrent msc processes never see partial entries
+    fs::path entry = fs::path(cacheDir) / key;
+    fs::path tmpEntry = fs::path(cacheDir) / (key + ".tmp" + std::to_string(getpid()));
+    std::error_code ec;
+    fs::remove_all(tmpEntry, ec);
+    fs::create_directories(tmpEntry / "work", ec);
+    fs::create_directories(tmpEntry / "out", ec);
+
+    bool ok = !ec;
+    for (auto& f : fs::directory_iterator(workDir, ec)) {
+        if (!f.is_regular_file(ec) || f.path().filename() == skipFile) continue;
+        ok &= fastCopyFile(f.path(), tmpEntry / "work" / f.path().filename());
+    }
+    for (size_t i = 0; i < outFiles.size(); i++) {
+        if (fs::exists(outFiles[i], ec)) ok &= fastCopyFile(outFiles[i], tmpEntry / "out" / std::to_string(i));
+    }
+    std::ofstream outputStream(tmpEntry / "output");
+    outputStream << output;
+    outputStream.close();
+    ok &= outputStream.good();
+
+    bool stored = false;
+    uint64_t entrySize = dirSize(tmpEntry);
+    if (ok && !ec) {
+        fs::rename(tmpEntry, entry, ec);
+        // If another process stored the same entry first, keep theirs
+        stored = !ec;
+    }
+    fs::remove_all(tmpEntry, ec);
+    if (stored && updateSizeIndex(entrySize, /*reset=*/false) > cacheMaxBytes) evictBscCache();
+}
+
+BscCacheStats getBscCacheStats() {
+    return {stats.hits.load(), stats.misses.load(), stats.evictions.load()};
+}
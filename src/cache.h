@@ -0,0 +1,58 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+// Persistent, content-addressed cache of Bluespec compiler results. Each bsc
+// invocation is a cache step, identified by a key that hashes all of its
+// inputs. A hit restores the files the step produced (e.g., .bo/.ba files
+// in the working directory and simulation executables or Verilog outputs)
+// and returns bsc's output, so warnings can be reported again.
+
+// Must be called before any other cache function. An empty dir disables the
+// cache. maxBytes bounds the cache size (least-recently-used entries are
+// evicted first).
+void initBscCache(const std::string& dir, uint64_t maxBytes);
+bool bscCacheEnabled();
+
+// Default cache directory ($XDG_CACHE_HOME/msc or ~/.cache/msc)
+std::string defaultBscCacheDir();
+
+// Returns a hex key that hashes all inputs (see contentHash() in hash.h)
+std::string bscCacheKey(const std::vector<std::string>& inputs);
+
+// On a hit, copies the step's files into workDir and outFiles, sets output to
+// bsc's output, and returns true. outFiles must match those given to store.
+bool lookupBscCache(const std::string& key, const std::string& workDir,
+        const std::vector<std::string>& outFiles, std::string& output);
+
+// Stores the results of a successful step: all files in workDir (except
+// skipFile) and all existing outFiles. When the cache outgrows maxBytes,
+// evicts old entries until it is below 90% of maxBytes.
+void storeBscCache(const std::string& key, const std::string& workDir, const std::string& skipFile,
+        const std::vector<std::string>& outFiles, const std::string& output);
+
+struct BscCacheStats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t evictions;
+};
+BscCacheStats getBscCacheStats();
@@ -377,9 +377,10 @@ int main(int argc, const char* argv[]) {
         exit(-1);
     }
 
+    Compilation compilation;
     std::vector<MinispecParser::PackageDefContext*> parseTrees;
     for (int i = 1; i < argc; i++) {
-        parseTrees.push_back(parseSingleFile(argv[i]));
+        parseTrees.push_back(parseSingleFile(compilation, argv[i]));
     }
 
     RenameTable renameTable(parseTrees);
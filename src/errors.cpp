@@ -26,21 +26,29 @@
 using namespace antlr4;
 
 // Error reporting
-static std::unordered_set<std::string> warnMsgs, errMsgs;
-static std::unordered_set<tree::ParseTree*> warnCtxs, errCtxs;
-static size_t totalErrs = 0;
-static size_t totalWarns = 0;
-static bool reportAllMsgs = false;
+static Reporter defaultReporter(std::cout, std::cerr);
+static thread_local Reporter* reporter = &defaultReporter;
+static thread_local DeferredReports* deferredReports = nullptr;
+
+Reporter& currentReporter() { return *reporter; }
+
+ReporterScope::ReporterScope(Reporter* r) : prevReporter(reporter) { reporter = r; }
+ReporterScope::~ReporterScope() { reporter = prevReporter; }
 
 void initReporting(bool reportAllErrors) {
-    reportAllMsgs = reportAllErrors;
+    reporter->reportAllMsgs = reportAllErrors;
 }
 
 void reportMsg(bool isError, const std::string& msg,
         const std::string& locInfo, tree::ParseTree* ctx) {
-    auto& msgs = isError? errMsgs : warnMsgs;
-    auto& ctxs = isError? errCtxs : warnCtxs;
-    size_t& total = isError? totalErrs : totalWarns;
+    if (deferredReports) {
+        deferredReports->push_back({isError, msg, locInfo, ctx});
+        return;
+    }
+    Reporter& r = *reporter;
+    auto& msgs = isError? r.errMsgs : r.warnMsgs;
+    auto& ctxs = isError? r.errCtxs : r.warnCtxs;
+    size_t& total = isError? r.totalErrs : r.totalWarns;
     if (msgs.count(msg)) {
         // Sometimes bsc derps out and spits the same error multiple times
         // (e.g. double-writes). If we have emitted EXACTLY the same error
@@ -48,10 +56,10 @@ void reportMsg(bool isError, const std::string& msg,
         // reportAllMsgs
         return;
     }
-    if (reportAllMsgs || (!msgs.count(msg) && !ctxs.count(ctx))) {
+    if (r.reportAllMsgs || (!msgs.count(msg) && !ctxs.count(ctx))) {
         msgs.insert(msg);
         if (ctx) ctxs.insert(ctx);
-        std::cerr << locInfo << msg << "\n";
+        r.err << locInfo << msg << "\n";
     }
     total++;
 }
@@ -62,15 +70,20 @@ void reportErr(const std::string& msg, const std::string& locInfo,
 void reportWarn(const std::string& msg, const std::string& locInfo,
         tree::ParseTree* ctx) { reportMsg(false, msg, locInfo, ctx); }
 
+void deferReports(DeferredReports* buf) {
+    deferredReports = buf;
+}
+
 void exitIfErrors() {
-    if (!totalErrs) return;
-    if (totalErrs > errMsgs.size()) {
-        auto omittedErrs = totalErrs - errMsgs.size();
-        std::cerr << noteColored("note:") << " omitted " << omittedErrs
+    Reporter& r = *reporter;
+    if (!r.totalErrs) return;
+    if (r.totalErrs > r.errMsgs.size()) {
+        auto omittedErrs = r.totalErrs - r.errMsgs.size();
+        r.err << noteColored("note:") << " omitted " << omittedErrs
             << " errors similar to those reported; run with "
             << hlColored("--all-errors") << " to see all errors\n";
     }
-    exit(-1);
+    fatalExit(-1);
 }
 
 // Error formatting / locs
@@ -18,10 +18,45 @@
 
 #pragma once
 
+#include <iostream>
 #include <string>
+#include <unordered_set>
+#include <vector>
 #include "antlr4-runtime.h"
 
-// Reporting of errors in user code (**not** errors in the compiler itself)
+// Reporting of errors in user code (**not** errors in the compiler itself).
+// Messages go to the current thread's Reporter, which by default prints
+// them to stdout and stderr. In-process compilations (see minispec.h) give
+// each compilation its own Reporter, through a ReporterScope on every thread
+// working on the compilation.
+class Reporter {
+    public:
+        Reporter(std::ostream& out, std::ostream& err) : out(out), err(err) {}
+
+        std::ostream& out;
+        std::ostream& err;  // error and warning messages
+        bool reportAllMsgs = false;
+
+    private:
+        std::unordered_set<std::string> warnMsgs, errMsgs;
+        std::unordered_set<antlr4::tree::ParseTree*> warnCtxs, errCtxs;
+        size_t totalErrs = 0;
+        size_t totalWarns = 0;
+
+        friend void reportMsg(bool, const std::string&, const std::string&, antlr4::tree::ParseTree*);
+        friend void exitIfErrors();
+};
+
+Reporter& currentReporter();
+
+class ReporterScope {
+    private:
+        Reporter* prevReporter;
+    public:
+        ReporterScope(Reporter* reporter);
+        ~ReporterScope();
+};
+
 void initReporting(bool reportAllErrors);
 
 void reportMsg(bool isError, const std::string& msg,
@@ -33,8 +68,21 @@ void reportErr(const std::string& msg, const std::string& locInfo = "",
 void reportWarn(const std::string& msg, const std::string& locInfo = "",
         antlr4::tree::ParseTree* ctx = nullptr);
 
+// Exits (see fatalExit() in log.h) if any errors have been reported
 void exitIfErrors();
 
+// Deferred reporting. While a thread defers reports, its messages are
+// buffered rather than reported, so work done concurrently can report in a
+// deterministic order by passing the buffered messages to reportMsg().
+struct DeferredReport {
+    bool isError;
+    std::string msg;
+    std::string locInfo;
+    antlr4::tree::ParseTree* ctx;
+};
+typedef std::vector<DeferredReport> DeferredReports;
+void deferReports(DeferredReports* buf);  // nullptr stops deferring
+
 // Error locations
 std::string getLoc(antlr4::tree::ParseTree* pt);
 std::string getSubLoc(antlr4::tree::ParseTree* pt);
@@ -0,0 +1,111 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "hash.h"
+
+// SHA-256, as specified in FIPS 180-4
+namespace {
+
+class Sha256 {
+    private:
+        uint32_t state[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        uint8_t block[64];
+        size_t blockLen = 0;
+        uint64_t totalLen = 0;
+
+        static uint32_t rotr(uint32_t x, uint32_t n) { return (x >> n) | (x << (32 - n)); }
+
+        void compress(const uint8_t* data) {
+            static const uint32_t k[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+            uint32_t w[64];
+            for (size_t i = 0; i < 16; i++) {
+                w[i] = ((uint32_t) data[4*i] << 24) | ((uint32_t) data[4*i + 1] << 16) |
+                       ((uint32_t) data[4*i + 2] << 8) | (uint32_t) data[4*i + 3];
+            }
+            for (size_t i = 16; i < 64; i++) {
+                uint32_t s0 = rotr(w[i-15], 7) ^ rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+                uint32_t s1 = rotr(w[i-2], 17) ^ rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+                w[i] = w[i-16] + s0 + w[i-7] + s1;
+            }
+            uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+            uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+            for (size_t i = 0; i < 64; i++) {
+                uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+                uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+                h = g; g = f; f = e; e = d + t1;
+                d = c; c = b; b = a; a = t1 + t2;
+            }
+            state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+            state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+        }
+
+    public:
+        void update(const void* data, size_t len) {
+            const uint8_t* p = (const uint8_t*) data;
+            totalLen += len;
+            if (blockLen) {
+                size_t n = std::min(len, sizeof(block) - blockLen);
+                memcpy(block + blockLen, p, n);
+                blockLen += n;
+                p += n;
+                len -= n;
+                if (blockLen < sizeof(block)) return;
+                compress(block);
+                blockLen = 0;
+            }
+            for (; len >= sizeof(block); p += sizeof(block), len -= sizeof(block)) compress(p);
+            memcpy(block, p, len);
+            blockLen = len;
+        }
+
+        std::string hexDigest() {
+            uint64_t bitLen = totalLen * 8;
+            uint8_t pad[72] = {0x80};
+            size_t padLen = (blockLen < 56)? 56 - blockLen : 120 - blockLen;
+            for (size_t i = 0; i < 8; i++) pad[padLen + i] = bitLen >> (56 - 8*i);
+            update(pad, padLen + 8);
+            char buf[65];
+            for (size_t i = 0; i < 8; i++) snprintf(buf + 8*i, 9, "%08x", state[i]);
+            return buf;
+        }
+};
+
+}  // namespace
+
+std::string contentHash(const std::vector<std::string_view>& inputs) {
+    Sha256 sha;
+    for (auto input : inputs) {
+        uint64_t len = input.size();
+        sha.update(&len, sizeof(len));
+        sha.update(input.data(), input.size());
+    }
+    return sha.hexDigest();
+}
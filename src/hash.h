@@ -0,0 +1,31 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Content hashing for persistent caches (bsc results and parse trees). Keys
+// must not collide even on inputs built to collide, as a collision silently
+// restores the wrong results, so they use a cryptographic hash (SHA-256).
+
+// Returns the hex SHA-256 digest of all inputs. Each input is hashed along
+// with its length, so keys of different input lists never alias trivially.
+std::string contentHash(const std::vector<std::string_view>& inputs);
@@ -0,0 +1,155 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <filesystem>
+#include <sstream>
+#include <unordered_set>
+#include "bscoutput.h"
+#include "errors.h"
+#include "log.h"
+#include "minispec.h"
+#include "parse.h"
+#include "translate.h"
+
+namespace minispec {
+
+struct Compiler::State {
+    std::stringstream msgs;
+    std::string diagnostics;  // msgs so far
+    std::unique_ptr<Reporter> reporter;
+    // Declared before pkgs, whose source maps point into its parse trees
+    std::unique_ptr<Compilation> compilation;
+    TranslatedPackages pkgs;
+    std::string topLevel;
+    bool ok = false;
+
+    // Runs fn as msc would, but reporting to this compiler's Reporter and
+    // recording (rather than exiting on) fatal errors
+    template <typename F> void run(F fn) {
+        ReporterScope reporterScope(reporter.get());
+        ThrowFatalErrors throwFatalErrors;
+        try {
+            fn();
+            exitIfErrors();
+        } catch (FatalError& e) {
+            msgs << e.msg;
+            ok = false;
+        }
+        diagnostics = msgs.str();
+    }
+};
+
+Compiler::Compiler() : state(new State()) {}
+Compiler::~Compiler() {}
+
+bool Compiler::compile(const std::string& fileName, const CompileOptions& options) {
+    State& s = *state;
+    s.pkgs = TranslatedPackages();
+    s.compilation.reset(new Compilation());
+    // A host process must not crash if a source is truncated while compiled
+    s.compilation->setMapSources(false);
+    s.msgs.str("");
+    s.diagnostics.clear();
+    s.reporter.reset(new Reporter(s.msgs, s.msgs));
+    s.reporter->reportAllMsgs = options.reportAllErrors;
+    s.topLevel = options.topLevel;
+    s.ok = true;
+
+    // Same path as msc: the input file's directory, the given directories,
+    // and the current directory
+    std::vector<std::string> path;
+    std::unordered_set<std::string> pathDirs;
+    auto addDir = [&](const std::string& dir) {
+        if (pathDirs.insert(dir).second) path.push_back(dir);
+    };
+    addDir(std::filesystem::path(fileName).remove_filename());
+    for (auto& dir : options.path) addDir(dir);
+    addDir("");
+
+    TranslateOptions translateOptions;
+    translateOptions.separatePackages = options.separatePackages;
+    translateOptions.prune = options.prune;
+    translateOptions.elabThreads = std::max(options.elabThreads, 1u);
+    translateOptions.maxElabSteps = options.maxElabSteps;
+    translateOptions.maxElabDepth = options.maxElabDepth;
+
+    s.run([&]() {
+        auto parsedTrees = parseFileAndImports(*s.compilation, fileName, path, std::max(options.jobs, 1u));
+        s.pkgs = translateFiles(*s.compilation, parsedTrees, s.topLevel, translateOptions);
+    });
+    return s.ok;
+}
+
+bool Compiler::ok() const { return state->ok; }
+const std::string& Compiler::diagnostics() const { return state->diagnostics; }
+
+size_t Compiler::numPackages() const { return state->pkgs.names.size(); }
+const std::string& Compiler::packageName(size_t i) const { return state->pkgs.names.at(i); }
+const std::string& Compiler::packageCode(size_t i) const { return state->pkgs.sourceMaps.at(i).getCode(); }
+const std::string& Compiler::topPackage() const { return state->pkgs.topPackage; }
+const std::string& Compiler::topModule() const { return state->pkgs.topModule; }
+
+bool Compiler::findSource(size_t pkg, size_t line, size_t lineChar, SourceLocation& res) const {
+    if (pkg >= numPackages() || line == 0 || lineChar == 0) return false;
+    const SourceMap& sourceMap = state->pkgs.sourceMaps[pkg];
+    auto ctx = sourceMap.find(line, lineChar);
+    if (!ctx) return false;
+    res.loc = getLoc(ctx);
+    res.context = contextStr(ctx);
+    return true;
+}
+
+std::string Compiler::translateBscOutput(const std::string& output, bool simOut) {
+    State& s = *state;
+    size_t start = s.diagnostics.size();
+    s.run([&]() { reportBluespecOutput(output, s.pkgs, s.topLevel, simOut); });
+    return s.diagnostics.substr(start);
+}
+
+}  // namespace minispec
+
+// C ABI
+struct minispec_compiler {
+    minispec::Compiler compiler;
+    std::string bscDiagnostics;
+};
+
+minispec_compiler* minispec_compile(const char* fileName, const char* path, const char* topLevel) {
+    minispec::CompileOptions options;
+    std::stringstream pathSs(path? path : "");
+    for (std::string dir; std::getline(pathSs, dir, ':'); ) options.path.push_back(dir);
+    if (topLevel) options.topLevel = topLevel;
+    minispec_compiler* c = new minispec_compiler();
+    c->compiler.compile(fileName, options);
+    return c;
+}
+
+int minispec_ok(const minispec_compiler* c) { return c->compiler.ok(); }
+const char* minispec_diagnostics(const minispec_compiler* c) { return c->compiler.diagnostics().c_str(); }
+size_t minispec_num_packages(const minispec_compiler* c) { return c->compiler.numPackages(); }
+const char* minispec_package_name(const minispec_compiler* c, size_t i) { return c->compiler.packageName(i).c_str(); }
+const char* minispec_package_code(const minispec_compiler* c, size_t i) { return c->compiler.packageCode(i).c_str(); }
+const char* minispec_top_package(const minispec_compiler* c) { return c->compiler.topPackage().c_str(); }
+const char* minispec_top_module(const minispec_compiler* c) { return c->compiler.topModule().c_str(); }
+
+const char* minispec_translate_bsc_output(minispec_compiler* c, const char* output, int simOut) {
+    c->bscDiagnostics = c->compiler.translateBscOutput(output, simOut);
+    return c->bscDiagnostics.c_str();
+}
+
+void minispec_free(minispec_compiler* c) { delete c; }
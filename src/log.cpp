@@ -17,6 +17,7 @@
  */
 
 #include "log.h"
+#include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -45,3 +46,29 @@ void InitLog(const char* header, const char* file) {
 // NOTE: These don't do anything b/c the compiler is single-threaded and I didn't want to bring in more zsim deps.
 void __log_lock() {}
 void __log_unlock() {}
+
+static thread_local bool throwFatal = false;
+
+ThrowFatalErrors::ThrowFatalErrors(bool enable) : prevThrow(throwFatal) { throwFatal = enable; }
+ThrowFatalErrors::~ThrowFatalErrors() { throwFatal = prevThrow; }
+
+bool fatalErrorsThrow() { return throwFatal; }
+
+void fatalExit(int exitCode, const std::string& msg) {
+    if (throwFatal) throw FatalError{exitCode, msg};
+    fputs(msg.c_str(), logFdErr);
+    fflush(logFdErr);
+    exit(exitCode);
+}
+
+std::string __log_format(const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    char* buf;
+    int len = vasprintf(&buf, fmt, ap);
+    va_end(ap);
+    if (len < 0) return fmt;
+    std::string res(buf, len);
+    free(buf);
+    return res;
+}
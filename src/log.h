@@ -24,6 +24,7 @@
 #include <sstream>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string>
 
 void __log_lock();
 void __log_unlock();
@@ -67,6 +68,28 @@ extern FILE* logFdErr;
  */
 void InitLog(const char* header, const char* file = NULL);
 
+/* Fatal errors (error() and panic()) print their message and exit. Code that
+ * compiles in-process (see minispec.h) must survive them instead: while a
+ * thread holds a ThrowFatalErrors object, its fatal errors throw a FatalError
+ * with the message they would have printed.
+ */
+struct FatalError {
+    int exitCode;
+    std::string msg;
+};
+
+class ThrowFatalErrors {
+    private:
+        bool prevThrow;
+    public:
+        ThrowFatalErrors(bool enable = true);
+        ~ThrowFatalErrors();
+};
+
+bool fatalErrorsThrow();
+[[noreturn]] void fatalExit(int exitCode, const std::string& msg = "");
+std::string __log_format(const char* fmt, ...) __attribute__((format(printf, 1, 2)));
+
 /* Helper class to print expression with values
  * Inpired by Phil Nash's CATCH, https://github.com/philsquared/Catch
  * const enough that asserts that use this are still optimized through
@@ -114,23 +137,13 @@ class PrintExpr {
 
 #define error(args...) \
 { \
-    fprintf(logFdErr, "%serror: ", logHeader); \
-    fprintf(logFdErr, args); \
-    fprintf(logFdErr, "\n"); \
-    fflush(logFdErr); \
-    /**reinterpret_cast<int*>(0L) = 42;*/ /*SIGSEGVs*/ \
-    exit(ERROR_EXIT_CODE); \
+    fatalExit(ERROR_EXIT_CODE, std::string(logHeader) + "error: " + __log_format(args) + "\n"); \
 }
 
 #define panic(args...) \
 { \
-    fprintf(logFdErr, "%sInternal compiler error on %s:%d: ", logHeader, __FILE__, __LINE__); \
-    fprintf(logFdErr, args); \
-    fprintf(logFdErr, "\n"); \
-    fprintf(logFdErr, "%sPlease report this error.\n", logHeader); \
-    fflush(logFdErr); \
-    /**reinterpret_cast<int*>(0L) = 42;*/ /*SIGSEGVs*/ \
-    exit(PANIC_EXIT_CODE); \
+    fatalExit(PANIC_EXIT_CODE, __log_format("%sInternal compiler error on %s:%d: ", logHeader, __FILE__, __LINE__) + \
+            __log_format(args) + "\n" + logHeader + "Please report this error.\n"); \
 }
 
 #define warn(args...) \
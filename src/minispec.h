@@ -0,0 +1,123 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// libminispec: in-process Minispec compilation, for tools that would
+// otherwise spawn msc for every request (e.g., the Jupyter kernel). Each
+// Compiler owns all the state of one compile, so several compilers may run
+// concurrently in a process. Diagnostics are formatted exactly as msc prints
+// them (including color codes), but are collected rather than printed, and
+// errors never exit the process.
+
+#ifdef __cplusplus
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace minispec {
+
+struct CompileOptions {
+    // Directories to search for imported files, after the input file's
+    // directory and before the current directory
+    std::vector<std::string> path;
+    std::string topLevel;  // optional, as in msc
+    bool separatePackages = false;  // one BSV package per Minispec file
+    bool prune = false;  // emit only what topLevel needs
+    bool reportAllErrors = false;
+    uint32_t jobs = 1;  // parsing threads
+    uint32_t elabThreads = 1;
+    uint64_t maxElabSteps = 50000;  // 0 disables the limit
+    uint64_t maxElabDepth = 1000;  // 0 disables the limit
+};
+
+struct SourceLocation {
+    std::string loc;  // file:line:char, as in diagnostics
+    std::string context;  // source excerpt, as in diagnostics
+};
+
+class Compiler {
+    public:
+        Compiler();
+        ~Compiler();
+        Compiler(const Compiler&) = delete;
+        Compiler& operator=(const Compiler&) = delete;
+
+        // Parses fileName and its imports and translates them to Bluespec.
+        // Returns true on success. Messages (errors and warnings) are
+        // available through diagnostics() either way. A compiler may be
+        // reused; each compile discards the previous one's results.
+        bool compile(const std::string& fileName, const CompileOptions& options = {});
+
+        bool ok() const;
+        const std::string& diagnostics() const;
+
+        // Translated BSV packages. The top package contains the top-level
+        // module (if any), and is the one to give to bsc.
+        size_t numPackages() const;
+        const std::string& packageName(size_t i) const;
+        const std::string& packageCode(size_t i) const;
+        const std::string& topPackage() const;
+        const std::string& topModule() const;
+
+        // Maps a position in a package's BSV code (1-based line and char) to
+        // the Minispec source it was translated from. Returns false if
+        // there is no such source.
+        bool findSource(size_t pkg, size_t line, size_t lineChar, SourceLocation& res) const;
+
+        // Translates bsc's output (for the translated packages) to Minispec
+        // diagnostics, as msc reports them. simOut must be set if bsc was
+        // building a simulator. Returns the diagnostics, which are also
+        // appended to diagnostics(); ok() becomes false if bsc reported errors.
+        std::string translateBscOutput(const std::string& output, bool simOut);
+
+    private:
+        struct State;
+        std::unique_ptr<State> state;
+};
+
+}  // namespace minispec
+
+extern "C" {
+#endif  // __cplusplus
+
+// C ABI. minispec_compile always returns a compiler (check minispec_ok), which
+// must be freed. Strings returned are owned by the compiler and remain valid
+// until the next call that modifies it or until it is freed. path is a
+// colon-separated list of directories, and may be null, as may topLevel.
+typedef struct minispec_compiler minispec_compiler;
+
+minispec_compiler* minispec_compile(const char* fileName, const char* path, const char* topLevel);
+int minispec_ok(const minispec_compiler* c);
+const char* minispec_diagnostics(const minispec_compiler* c);
+size_t minispec_num_packages(const minispec_compiler* c);
+const char* minispec_package_name(const minispec_compiler* c, size_t i);
+const char* minispec_package_code(const minispec_compiler* c, size_t i);
+const char* minispec_top_package(const minispec_compiler* c);
+const char* minispec_top_module(const minispec_compiler* c);
+// Returns the diagnostics for this output
+const char* minispec_translate_bsc_output(minispec_compiler* c, const char* output, int simOut);
+void minispec_free(minispec_compiler* c);
+
+#ifdef __cplusplus
+}  // extern "C"
+#endif
@@ -17,18 +17,27 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
 #include <iostream>
 #include <filesystem>
-#include <regex>
+#include <functional>
+#include <thread>
 #include <unordered_set>
 #include <variant>
 #include "antlr4-runtime.h"
 #include "argparse/argparse.hpp"
+#include "allocstats.h"
+#include "bscoutput.h"
+#include "cache.h"
 #include "errors.h"
 #include "log.h"
 #include "parse.h"
+#include "process.h"
+#include "server.h"
 #include "strutils.h"
+#include "timing.h"
 #include "translate.h"
 #include "version.h"
 #include "MinispecLexer.h"
@@ -36,337 +45,52 @@
 
 using namespace antlr4;
 
-// Bluespec errors
-typedef std::function<std::string(uint32_t, uint32_t)> TranslateLocFn;
-typedef std::function<std::string(uint32_t, uint32_t, const std::vector<std::string>&)> ContextStrFn;
-typedef std::function<tree::ParseTree*(uint32_t, uint32_t)> FindFn;
-
-void reportBluespecOutput(std::string str, const SourceMap& sm, const std::string& topLevel, bool simOut) {
-    typedef std::regex_iterator<std::string::const_iterator> regex_it;
-    const regex_it rend;
-
-    // C++ regexes suck... I want ECMAScript mode with multiline (it seems
-    // lookahead doesn't work with std::regex::extended), but
-    // std::regex:multiline is a C++17 feature, and isn't even in gcc 8.2! So
-    // substitute all newlines with a line termination token that doesn't show
-    // up in Bluespec output.
-    const char* lineTerm = " _@%@_ ";
-    replace(str, "\n", lineTerm);
-    std::regex evRegex("(Warning|Error): (.*?)(?=( _@%@_ Error:| _@%@_ Warning:|$))");
-
-    const std::string locRegexStr = "\"(\\S+)\",\\s+line\\s+(\\d+),\\s+column\\s+(\\d+)";
-    std::regex locRegex(locRegexStr);
-    std::regex hdrRegex(locRegexStr + ":\\s+\\((\\S+)\\)"); // include type
-
-    auto translateLoc = [&](uint32_t line, uint32_t lineChar) {
-        auto pt = sm.find(line, lineChar);
-        if (pt) return getLoc(pt);
-        else return "(translated bsv:" + std::to_string(line) + ":" + std::to_string(lineChar) + ")";
-    };
-
-    auto translateAllLocs = [&](std::string& msg) {
-        std::smatch locMatch;
-        std::unordered_map<std::string, std::tuple<uint32_t, uint32_t>> locToPos;
-        while (std::regex_search(msg, locMatch, locRegex)) {
-            std::string file = locMatch[1];
-            uint32_t line = atoi(locMatch[2].str().c_str());
-            uint32_t lineChar = atoi(locMatch[3].str().c_str());
-            std::string loc;
-            if (file == "Translated.bsv") {
-                loc = translateLoc(line, lineChar);
-            } else {
-                loc = file + ":" + std::to_string(line) + ":" + std::to_string(lineChar);
-            }
-            replace(msg, locMatch[0], hlColored(loc));
-            locToPos[hlColored(loc)] = std::tie(line, lineChar);
-        }
-        return locToPos;
-    };
-
-    auto contextStrFn = [&](uint32_t line, uint32_t lineChar,
-            const std::vector<std::string>& elems) -> std::string
-    {
-        tree::ParseTree* ctx = nullptr;
-        for (auto elem : elems) {
-            ctx = sm.find(line, lineChar, elem);
-            if (ctx) break;
-        }
-        if (!ctx) ctx = sm.find(line, lineChar);
-	if (ctx) return contextStr(ctx, {ctx});
-        return "";
-    };
-
-    auto reportUnknownMsg = [&](bool isError, std::string msg) {
-        replace(msg, lineTerm, "\n");
-        translateAllLocs(msg);
-        msg = (isError? errorColored("error:") : warnColored("warning:")) + " " + msg + "\n";
-        reportMsg(isError, msg);
-    };
-
-    for (regex_it rit(str.begin(), str.end(), evRegex); rit != rend; rit++) {
-        auto& m = *rit;
-        bool isError = std::string(m[1]) == "Error";
-        std::string msg = m[2];
-        std::smatch hdrMatch;
-        if (!std::regex_search(msg, hdrMatch, hdrRegex)) {
-            // Special-case not-found top-level error
-            if (msg.find("Command line:") != std::string::npos && msg.find("Unbound variable `mk") != std::string::npos) {
-                bool isModule = isupper(topLevel[0]);
-                msg = errorColored("error:") + " cannot find top-level " + (isModule? "module" : "function") + " " + errorColored("'" + topLevel + "'");
-                reportMsg(isError, msg);
-            } else {
-                reportUnknownMsg(isError, msg);
-            }
-            continue;
-        }
-        std::string file = hdrMatch[1];
-        uint32_t line = atoi(hdrMatch[2].str().c_str());
-        uint32_t lineChar = atoi(hdrMatch[3].str().c_str());
-        std::string code = hdrMatch[4];
-        std::string body = msg.substr(hdrMatch.length());
-        if (file != "Translated.bsv") {
-            reportUnknownMsg(isError, "in imported BSV file " + msg);
-            continue;
-        }
-
-        replace(body, lineTerm, " ");
-        replace(body, "  ", " ");
-        std::string loc = translateLoc(line, lineChar);
-        body = trim(body);
-        std::string unprocessedBody = body;
-        if (body.size()) body[0] = tolower(body[0]);
-        auto locToPos = translateAllLocs(body);
-
-        // Find and highlight syntax elements
-        std::vector<std::string> elems;
-        std::regex elemRegex("`(.*?)'");
-        std::smatch elemMatch;
-        while (std::regex_search(body, elemMatch, elemRegex)) {
-            std::string elem = elemMatch[1];
-            // Translate all module constructors back to the module name
-            if (elem.size() > 2 && elem.find("mk") == 0 && isupper(elem[2]))
-                elem = elem.substr(2);
-	    elems.push_back(elem);
-	    replace(body, elemMatch[0], errorColored("'" + elem + "'"));
-        }
-
-        // Special-case a few codes; these rewrite body on success, o/w they fall through the default code
-        if (code == "T0020" || code == "T0080") {
-            // NOTE: T0020 is for expressions and T0080 is for functions, but
-            // Bluespec seems to implement several constant as functions (e.g.,
-            // True and False). So, we output exactly the same error message
-            // for both
-            std::regex typeRegex((code == "T0020")? "type error at: (.*?) Expected type: (.*?) Inferred type: (.*?)$" : "type error at the use of the following function: (.*?) The expected return type of the function: (.*?) The return type according to the use: (.*?)$");
-            std::smatch match;
-            if (std::regex_search(body, match, typeRegex)) {
-                std::string elem = match[1];
-                std::string expectedType = match[2];
-                std::string type = match[3];
-                body = "expression " + errorColored("'" + elem + "'") + " has type " + hlColored(type) + ", but use requires type " + hlColored(expectedType);
-                elems.push_back(elem);
-            }
-        } else if (code == "T0031" || code == "T0032") {
-            // First, find if the compiler is pinpointing an expression.
-            // If so, use the expression loc as the loc, as that is,
-            // by observation, more accurate.
-            // NOTE: We used to do this only for T0032, where the default loc
-            // is always way off---the beginning of the offending module. But
-            // for some T0031s we've found the default loc to be bad too, so
-            // just do it always. If the location is perplexing in some cases,
-            // we could do more detailed analysis to see when the default loc
-            // is bad (e.g., it's untranslated)
-            std::regex exprRegex(" The proviso was implied by expressions at the following positions: (\\S+)");
-            std::smatch exprMatch;
-            if (std::regex_search(body, exprMatch, exprRegex)) {
-                std::string exprLoc = exprMatch[1];
-                bool isLoc = locToPos.find(exprLoc) != locToPos.end();
-                bool isMinispec = exprLoc.find("(translated") == std::string::npos;
-                if (isLoc && isMinispec) {
-                    loc = exprLoc;
-                    std::tie(line, lineChar) = locToPos[exprLoc];
-                    replace(body, exprMatch[0], "");  // take it out
-                }
-            }
-
-	    // Then, handle the actual proviso error
-	    std::regex provisoRegex((code == "T0031")?
-                        "no instances of the form:\\s+(\\S+?)#\\((.*)\\)" :
-                        "proviso which could not be resolved:\\s+(\\S+?)#\\((.*)\\)");
-            std::smatch match;
-            if (std::regex_search(body, match, provisoRegex)) {
-                std::string typeclass = match[1];
-                std::string type = match[2];
-                if (typeclass == "Arith") {
-                    body = "type " + hlColored(type) + " does not support arithmetic operations";
-                } else if (typeclass == "Ord") {
-                    body = "type " + hlColored(type) + " does not support comparison operations";
-                } else if (typeclass == "Literal") {
-                    body = "cannot convert literal to type " + hlColored(type);
-                } else if (typeclass == "FShow") {
-                    body = "cannot display value of type " + hlColored(type);
-                    if (type.find("function") == 0)
-                        body += " (this is a function, did you forget some/all the arguments?)";
-                } else if (typeclass == "Bits") {
-                    std::regex bitsRegex("(.*?), (\\S+)");
-                    std::smatch bitsMatch;
-                    if (std::regex_search(type, bitsMatch, bitsRegex)) {
-                        std::string badType = bitsMatch[1];
-                        std::string length = bitsMatch[2];
-                        body = "type " + errorColored("'" + badType + "'") + " cannot be used here";
-                        if (badType == "Integer") {
-                            body += " because Integer is a compile-time-only type with an unbounded number of bits, so it can't be synthesized to hardware";
-                        } else if (length == "a__") {
-                            // FIXME: This happens in Reg#(), but seems very tailored.
-                            body += " because this type is not synthesizable to bits, which is required by the use";
-                        } else {
-                            body += " because either this type is not synthesizable to bits, or it has a bit-width incompatible with its use";
-                        }
-                    }
-                } else if (typeclass == "Add") {
-                    body = "expression type has a number of bits or elements incompatible with its use";
-                    std::regex addRegex("(\\d+), (\\d+), (\\d+)");
-                    std::smatch addMatch;
-                    if (std::regex_search(type, addMatch, addRegex)) {
-                        std::string n1 = addMatch[1];
-                        std::string n2 = addMatch[2];
-                        std::string n3 = addMatch[3];
-                        body += " (for lengths to match, "  + n1 + " + " + n2 + " should equal " + n3 + ")";
-                    }
-                    // All the "overlength" expressions I've seen so far (e.g.,
-                    // concatenation) follow this format; if you see something
-                    // else, e.g., Add#(a__, 1, 0), generalize this regex.
-                    std::regex overRegex("(\\d+), (\\S+)_, 0");
-                    if (std::regex_search(type, addMatch, overRegex)) {
-                        std::string n1 = addMatch[1];
-                        body += " (expression has " + n1 + " more/fewer bits or elements than its use allows)";
+// Returns the contents of all BSV files imported by the parsed packages
+// (through bsvimport) that can be found in path. Used to key cached bsc
+// results.
+std::string getBsvImportsContents(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees,
+        const std::vector<std::string>& path) {
+    std::stringstream res;
+    for (auto tree : parsedTrees) {
+        for (auto stmt : tree->packageStmt()) {
+            if (!stmt->bsvImportDecl()) continue;
+            for (auto id : stmt->bsvImportDecl()->upperCaseIdentifier()) {
+                std::string fileName = id->getText() + ".bsv";
+                for (auto dir : path) {
+                    std::ifstream stream(std::filesystem::path(dir) / fileName);
+                    if (stream.good()) {
+                        res << fileName << "\n" << stream.rdbuf() << "\n";
+                        break;
                     }
                 }
             }
-	} else if (code == "T0003") {
-	    // I see these only on mistyped literals, but unbound constructor
-	    // is such a general message that who knows where else it may show
-	    // up. So leave the translated error general.
-	    replace(body, "unbound constructor", "undefined literal, type, or module");
-        } else if (code == "T0004") {
-	    replace(body, "unbound variable", "undefined variable or function");
-	} else if (code == "T0007") {
-	    replace(body, "unbound type constructor", "undefined type or module");
-        } else if (code == "T0016") {
-            // Error message is good, except when it's an input, so process only that
-            std::regex inputRegex("Field `(.*?)___input' is not in the type `(.*?)' which was derived for this expression");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, inputRegex)) {
-                std::string input = match[1];
-                std::string modType = match[2];
-                body = "module " + hlColored(modType) + " does not have an input named " + errorColored("'" + input + "'");
-            }
-        } else if (code == "T0081" || code == "T0083" || code == "T0084") {
-            // Errors related to using a function with the wrong number of arguments
-            // First, the expected/inferred type trailing info is more confusing then helpful (function type noise). So take that out.
-            std::string trailMarker = (code == "T0081")? " Expected type:" : " The expected type is:";
-            auto trailStart = body.find(trailMarker);
-            body = body.substr(0, trailStart);  // safe even if trail is string::npos
-            // Second, if the function is actually a module, don't call it a function :)
-            if (body.find(": mk") != std::string::npos) {
-                replace(body, ": mk", ": ");
-                replace(body, "function", "module");
-            }
-        } else if (code == "G0004") {
-            // Register double-writes and input/wire double-sets
-            std::regex conflictRegex("Rule `(.*?)' uses methods that conflict in parallel: (.*?)(\\S+) and (.*?)(\\S+) For the complete expressions");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, conflictRegex)) {
-                std::string rule = match[1];
-                // g1/g2 are the "guards" and may be empty; m1 and m2 are the methods
-                std::string g1 = match[2];
-                std::string m1 = match[3];
-                std::string g2 = match[4];
-                std::string m2 = match[5];
-                bool isWrite = m1.find(".write") != std::string::npos;
-                bool isWset = m1.find(".wset") != std::string::npos;
-                bool isWget2 = m2.find(".wget") != std::string::npos;
-                bool isWhas2 = m2.find(".whas") != std::string::npos;
-                std::string base1 = "'" + m1.substr(0, m1.find(".")) + "'";
-                std::string base2 = "'" + m2.substr(0, m1.find(".")) + "'";
-
-                body = "rule " + errorColored("'" + rule + "'") + " ";
-                if (m1 == m2 && (isWrite || isWset)) {
-                    if (isWrite) {
-                        body += "writes to register " + errorColored(base1) + " more than once, which is forbidden";
-                    } else {
-                        assert(isWset);
-                        body += "sets input or wire " + errorColored(base1) + " more than once, which is forbidden";
-                    }
-                    // Non-disjoint if statements are confusing, so clarify
-                    if (g1 == g2 || g1 == "if (...) ")
-                        body += "; these happen inside if statements that have overlapping predicates (make the if statements mutually exclusive, so that they never take effect on the same cycle)";
-                } else if (isWset && isWget2 && base1 == base2) {
-                    body += "both sets input or wire " + errorColored(base1) + ", and reads from it (perhaps through a method), which is forbidden";
-                } else if (isWset && isWhas2 && base1 == base2) {
-                    // NOTE(dsm): whas seems to always fire with wget; print them separately though, in case there's a wset/whas conflict but not wset/wget
-                    body += "both sets input or wire " + errorColored(base1) + " (which has a default value), and reads from it (perhaps through a method), which is forbidden";
-                } else {
-                    // Print a generic message, this must be interacting with Bluespec code
-                    body += "cannot call methods " + errorColored(m1) + " and " + errorColored(m2) + " because they conflict";
-                }
-            }
-        } else if (code == "G0005") {
-            // Minispec rules must fire every cycle
-            std::regex blockedRegex("The assertion `fire_when_enabled' failed for rule `(.*?)' because it is blocked by rule (.*?) in the scheduler");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, blockedRegex)) {
-                body = "rules " + errorColored(match[1]) + " and " + errorColored(match[2]) +
-                    " conflict and cannot both fire every cycle (e.g., they both try to set the same input of a shared module)";
-            }
-        } else if (code == "G0066") {
-            std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, unsetRegex)) {
-                std::string instance = match[1];
-                body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is never being set";
-            }
-        } else if (code == "G0015") {
-            std::regex unsetRegex("Instance `(.*?)' requires the following method to be always enabled, but the condition for executing the method could not be proven to be always True: _write");
-            std::smatch match;
-            if (std::regex_search(unprocessedBody, match, unsetRegex)) {
-                // This is a warning, but its gravity is context-dependent. If
-                // we're producing Verilog, then it should stay a warning (or
-                // go away); if this is simulation, then we must promote it to
-                // an error, as it'll actually cause things to misbehave.
-                isError = simOut;
-                std::string instance = match[1];
-                body = "input or wire " + errorColored("'" + instance + "'") + " has no default value, so it must be set every cycle, but it is being set only sometimes (at least, I cannot prove that a rule is setting it every cycle; simplify your control flow or add a default value); note: this warning is promoted to an error when producing simulation executables";
-            }
         }
+    }
+    return res.str();
+}
 
-        // Simplify bsc output: Translated::TypeName -> TypeName, etc.
-        replace(body, "Translated::", "");
-        replace(body, "Vector::Vector", "Vector");
-
-        std::stringstream ss;
-        ss << hlColored(loc + ":") << " " << (isError? errorColored("error:") : warnColored("warning:")) << " " << body << "\n";
-        ss << contextStrFn(line, lineChar, elems);
-        //ss << code;
-        reportMsg(isError, ss.str(), sm.getContextInfo(line, lineChar), sm.find(line, lineChar));
+// Returns a string that identifies the bsc executable in PATH (its location,
+// size, and modification time), so cached results are invalidated on upgrades
+std::string getBscIdentity() {
+    const char* pathEnv = getenv("PATH");
+    std::stringstream pathSs(pathEnv? pathEnv : "");
+    for (std::string dir; std::getline(pathSs, dir, ':'); ) {
+        auto bsc = std::filesystem::path(dir) / "bsc";
+        std::error_code ec;
+        if (std::filesystem::is_regular_file(bsc, ec)) {
+            std::stringstream ss;
+            ss << bsc.string() << ":" << std::filesystem::file_size(bsc, ec) << ":" <<
+                std::filesystem::last_write_time(bsc, ec).time_since_epoch().count();
+            return ss.str();
+        }
     }
+    return "";
 }
 
-struct RunResult {
-    std::string output;
-    int exitCode;
-};
-
-RunResult run(const std::string& cmd) {
-    FILE* pipe = popen(cmd.c_str(), "r");
-    if (!pipe) error("cannot invoke subprocess");
-    std::stringstream bscOutput;
-    size_t bufSize = 1024;
-    char buf[bufSize];
-    while (!feof(pipe)) if (fgets(buf, bufSize, pipe)) bscOutput << buf;
-    RunResult res;
-    res.output = bscOutput.str();
-    res.exitCode = pclose(pipe);
-    return res;
+static void printCacheStats() {
+    BscCacheStats stats = getBscCacheStats();
+    std::cout << "bsc cache: " << stats.hits << " hits, " << stats.misses << " misses, " <<
+        stats.evictions << " evictions\n";
 }
 
 static std::string tmpDirStr = "";
@@ -391,9 +115,7 @@ void cleanupTmpDir() {
     panic("uncaught exception: %s", exStr.c_str());
 }
 
-int main(int argc, const char* argv[]) {
-    std::set_terminate(uncaughtExceptionHandler);
-
+static int compile(int argc, const char* argv[]) {
     argparse::ArgumentParser args;
     args.add_argument("inputFile")
         .help("input file")
@@ -408,7 +130,7 @@ int main(int argc, const char* argv[]) {
         .help("path for source files (for multiple directories, use : as separator)")
         .default_value(std::string(""));
     args.add_argument("-b", "--bscOpts")
-        .help("extra options for the Bluespec compiler (use quotes for multiple options)")
+        .help("extra options for the Bluespec compiler (use quotes for multiple options); split on whitespace honoring single and double quotes, but without a shell, so there is no $VAR expansion and backslashes are not escapes")
         .default_value(std::string(""));
     args.add_argument("-v", "--version")
         .help("show version information")
@@ -422,6 +144,64 @@ int main(int argc, const char* argv[]) {
         .help("keep temporary files around (useful for compiler debugging)")
         .default_value(false)
         .implicit_value(true);
+    args.add_argument("-j", "--jobs")
+        .help("number of threads used to parse source files (0 uses all hardware threads)")
+        .default_value((uint64_t) 1)
+        .scan<'u', uint64_t>();
+    args.add_argument("--elab-jobs")
+        .help("number of threads used to elaborate parametric instances (0 uses all hardware threads); output does not depend on it")
+        .default_value((uint64_t) 1)
+        .scan<'u', uint64_t>();
+    args.add_argument("--parse-stats")
+        .help("print parsing statistics (files parsed, full-LL reparses, and parse tree cache hits)")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--time-report")
+        .help("print the wall and CPU time and peak memory of each compilation phase")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--time-report-json")
+        .help("also write the time report to this file, in JSON format (implies --time-report)")
+        .default_value(std::string(""));
+    args.add_argument("--elab-trace")
+        .help("write a trace of elaboration steps (parametric instantiations and for loop iterations) to this file, in Chrome trace format")
+        .default_value(std::string(""));
+    args.add_argument("--alloc-stats")
+        .help("print the number of heap allocations made while translating to Bluespec (needs an msc built with scons --alloc-stats)")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--bsc-timeout")
+        .help("kill the Bluespec compiler if a single invocation takes longer than this many seconds (0 for no limit)")
+        .default_value((uint64_t) 0)
+        .scan<'u', uint64_t>();
+    args.add_argument("--prune")
+        .help("translate only the definitions the top-level module or function uses (others are not checked)")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--replay-bsc-output")
+        .help("report the Bluespec compiler output stored in this file instead of running bsc (useful to test error translation)")
+        .default_value(std::string(""));
+    args.add_argument("--build-dir")
+        .help("compile each file to a separate Bluespec package in this persistent directory, so bsc only recompiles packages that changed")
+        .default_value(std::string(""));
+    args.add_argument("--no-cache")
+        .help("do not use the caches of Bluespec compiler results and parse trees")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--cache-dir")
+        .help("directory for the cache of Bluespec compiler results [default: ~/.cache/msc]")
+        .default_value(std::string(""));
+    args.add_argument("--cache-size")
+        .help("maximum size of the cache of Bluespec compiler results, in MB")
+        .default_value((uint64_t) 1024)
+        .scan<'u', uint64_t>();
+    args.add_argument("--cache-stats")
+        .help("print cache hits and misses")
+        .default_value(false)
+        .implicit_value(true);
+    args.add_argument("--server")
+        .help("run as a compile server listening on this Unix socket; msc invocations with MSC_SERVER=<socket> in their environment run on the server, reusing its parsed files")
+        .default_value(std::string(""));
     args.add_argument("--max-elab-steps")
         .help("maximum number of elaboration steps")
         .default_value((uint64_t) 50000)
@@ -443,6 +223,9 @@ int main(int argc, const char* argv[]) {
         exit(0);
     }
 
+    if (args.is_used("--server")) runServer(args.get<std::string>("--server"), compile);
+    killChildrenOnSignals();
+
     std::string inputFile = args.get<std::string>("inputFile");
     if (inputFile == "") error("no input file");
     std::string topLevel = args.get<std::string>("topLevel");
@@ -470,7 +253,28 @@ int main(int argc, const char* argv[]) {
 
     // Other options
     initReporting(args.get<bool>("--all-errors"));
-    setElabLimits(args.get<uint64_t>("--max-elab-steps"), args.get<uint64_t>("--max-elab-depth"));
+    if (args.is_used("--elab-trace")) {
+        enableElabTrace(args.get<std::string>("--elab-trace"));
+        atexit(writeElabTrace);
+    }
+    // The build directory already keeps bsc results across runs
+    if (!args.get<bool>("--no-cache") && args.get<std::string>("--build-dir") == "") {
+        std::string cacheDir = args.get<std::string>("--cache-dir");
+        if (cacheDir == "") cacheDir = defaultBscCacheDir();
+        initBscCache(cacheDir, args.get<uint64_t>("--cache-size") << 20);
+    }
+    // Parse trees are cached even with a build directory. They live in a
+    // dotted subdirectory, which bsc cache eviction skips.
+    if (!args.get<bool>("--no-cache")) {
+        std::string cacheDir = args.get<std::string>("--cache-dir");
+        if (cacheDir == "") cacheDir = defaultBscCacheDir();
+        if (cacheDir != "") initParseTreeCache(cacheDir + "/.trees", getVersion());
+    }
+    if (args.get<bool>("--cache-stats")) atexit(printCacheStats);
+    if (args.get<bool>("--time-report") || args.is_used("--time-report-json")) {
+        enableTimeReport(args.get<std::string>("--time-report-json"));
+        atexit(finishTimeReport);
+    }
 
     // Construct the Minispec path, composed of: (1) the input file's
     // directory, (2) the directories in the --path flag, and (3) the current
@@ -494,51 +298,61 @@ int main(int argc, const char* argv[]) {
     };
     path = dedup(path);
 
-    // Parse all files. Exits on lexer/parser errors.
-    std::vector<MinispecParser::PackageDefContext*> parsedTrees =
-        parseFileAndImports(inputFile, path);
+    uint64_t jobs = args.get<uint64_t>("--jobs");
+    if (jobs == 0) jobs = std::max(1u, std::thread::hardware_concurrency());
 
-    // Translate files to Bluespec. Exits on elaboration errors.
-    SourceMap sm = translateFiles(parsedTrees, topLevel);
-
-    // Save translated code
-    char tmpDir[128];
-    sprintf(tmpDir, "tmp_msc_XXXXXX");
-    if (mkdtemp(tmpDir) != tmpDir) error("could not create temporary directory");
-    if (args.get<bool>("--keep-tmps")) {
-        std::cout << "storing temporary files in " << hlColored(std::string(tmpDir)) << "\n";
-    } else {
-        tmpDirStr = tmpDir;
-        atexit(cleanupTmpDir);
+    uint64_t elabJobs = args.get<uint64_t>("--elab-jobs");
+    if (elabJobs == 0) elabJobs = std::max(1u, std::thread::hardware_concurrency());
+
+    // Parse all files. Exits on lexer/parser errors. The compilation owns
+    // parse trees and elaboration state, and must outlive pkgs below.
+    Compilation compilation;
+    std::vector<MinispecParser::PackageDefContext*> parsedTrees =
+        parseFileAndImports(compilation, inputFile, path, jobs);
+    notifyServerParsedFiles();
+    if (args.get<bool>("--parse-stats")) {
+        ParseStats stats = getParseStats();
+        std::cout << "parsed " << stats.files << " files, " << stats.llFallbacks << " needed full-LL reparse, " <<
+            stats.treeCacheHits << " parse tree cache hits, " << stats.treeCacheMisses << " misses\n";
     }
-    std::string bsvFileName = tmpDir + std::string("/Translated.bsv");
-    std::ofstream stream(bsvFileName);
-    if (!stream.good()) error("Could not open output file %s", bsvFileName.c_str());
-    stream << sm.getCode() << "\n";
-    stream.close();
 
-    // bsc path is simply the path with a corrected base for relative dirs
-    std::stringstream bscPath;
-    for (std::string dir : path) {
-        auto path = std::filesystem::path(dir);
-        bscPath << (path.is_relative()? "'../" : "'") << dir << "':";
+    // Translate files to Bluespec. Exits on elaboration errors.
+    std::string buildDir = args.get<std::string>("--build-dir");
+    bool separatePackages = buildDir != "";
+    TranslateOptions translateOptions;
+    translateOptions.separatePackages = separatePackages;
+    translateOptions.prune = args.get<bool>("--prune");
+    translateOptions.elabThreads = elabJobs;
+    translateOptions.maxElabSteps = args.get<uint64_t>("--max-elab-steps");
+    translateOptions.maxElabDepth = args.get<uint64_t>("--max-elab-depth");
+    if (args.get<bool>("--alloc-stats") && !allocStatsEnabled())
+        error("this msc does not count allocations; build it with %s to use %s",
+                hlColored("scons --alloc-stats").c_str(), hlColored("--alloc-stats").c_str());
+    AllocStats allocsBefore = getAllocStats();
+    TranslatedPackages pkgs = [&]() {
+        PhaseTimer timer("translate");
+        return translateFiles(compilation, parsedTrees, topLevel, translateOptions);
+    }();
+    if (args.get<bool>("--alloc-stats")) {
+        AllocStats allocsAfter = getAllocStats();
+        std::cout << "translation made " << allocsAfter.allocs - allocsBefore.allocs << " allocations, "
+            << allocsAfter.bytes - allocsBefore.bytes << " bytes\n";
     }
-    bscPath << "%:+";
-    std::string bscOpts = "-p " + bscPath.str() + " " + args.get<std::string>("--bscOpts");
-    //std::cout << "BSC options: " << bscOpts << "\n";
-
-    // Invoke Bluespec compiler and check for type errors
-    auto runBscCmd = [&](const std::string& cmd) {
-        //std::cout << cmd << "\n";
-        auto compileRes = run(cmd);
-        reportBluespecOutput(compileRes.output, sm, topLevel, simOut);
-        exitIfErrors();
-	if (compileRes.exitCode != 0) {
-            // If we didn't parse any error but bsc failed, this is typically
-            // because bsc wasn't found. So print the output.
-            error("could not compile file: %s", compileRes.output.c_str());
+    std::string replayFile = args.get<std::string>("--replay-bsc-output");
+    if (replayFile != "") {
+        std::ifstream replayStream(replayFile);
+        if (!replayStream.good()) error("could not open bsc output file %s", replayFile.c_str());
+        std::stringstream replayOutput;
+        replayOutput << replayStream.rdbuf();
+        {
+            PhaseTimer timer("report bsc output");
+            reportBluespecOutput(replayOutput.str(), pkgs, topLevel, simOut);
         }
-    };
+        exitIfErrors();
+        return 0;
+    }
+    std::string allCode;
+    for (const auto& sm : pkgs.sourceMaps) allCode += sm.getCode();
 
     std::string outName = topLevel;
     if (outName == "") {
@@ -553,55 +367,274 @@ int main(int argc, const char* argv[]) {
         replace(outName, "'", "");
         replace(outName, "\t", "");
     }
-    bool typechecked = false;
-
-    if (simOut) {
-        if (topLevel.size() && isupper(topLevel[0])) {
-            std::stringstream cmd;
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -sim -g '" << sm.getTopModule() << "' -u Translated.bsv) 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
-            typechecked = true;
-
-            // Link simulation executable
-            cmd.str("");
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -sim -e '" <<  sm.getTopModule() << "' -o '../" << outName << "') 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
-            std::cout << "produced simulation executable " << hlColored(outName) << "\n";
-        } else if (!defaultOut) {
+
+    // The sim and Verilog flows are independent after translation. If both
+    // are needed, they run concurrently, each in its own subdirectory.
+    bool simFlow = simOut && topLevel.size() && isupper(topLevel[0]);
+    bool verilogFlow = verilogOut && topLevel.size();
+    bool concurrentFlows = simFlow && verilogFlow;
+
+    // Save translated code. In separate-packages mode, use the persistent
+    // build directory (with a subdirectory per flow, as flows compile
+    // packages differently), and write only packages that changed, so bsc -u
+    // can reuse up-to-date .bo files.
+    std::string workDir;
+    if (separatePackages) {
+        workDir = buildDir;
+    } else {
+        char tmpDir[128];
+        sprintf(tmpDir, "tmp_msc_XXXXXX");
+        if (mkdtemp(tmpDir) != tmpDir) error("could not create temporary directory");
+        if (args.get<bool>("--keep-tmps")) {
+            std::cout << "storing temporary files in " << hlColored(std::string(tmpDir)) << "\n";
+        } else {
+            tmpDirStr = tmpDir;
+            atexit(cleanupTmpDir);
+        }
+        workDir = tmpDir;
+    }
+    auto getFlowDir = [&](const std::string& flow) {
+        return (separatePackages || concurrentFlows)? workDir + "/" + flow : workDir;
+    };
+    std::string simDir = getFlowDir("sim");
+    std::string verilogDir = getFlowDir("verilog");
+    std::string checkDir = getFlowDir("check");
+    std::vector<std::string> flowDirs;
+    if (simFlow) flowDirs.push_back(simDir);
+    if (verilogFlow) flowDirs.push_back(verilogDir);
+    if (flowDirs.empty()) flowDirs.push_back(checkDir);
+    {
+        PhaseTimer timer("write bsv files");
+        for (const auto& dir : flowDirs) {
+            std::error_code ec;
+            std::filesystem::create_directories(dir, ec);
+            if (ec) error("could not create directory %s", dir.c_str());
+            for (size_t i = 0; i < pkgs.names.size(); i++) {
+                std::string bsvFileName = dir + "/" + pkgs.names[i] + ".bsv";
+                std::string contents = pkgs.sourceMaps[i].getCode() + "\n";
+                if (separatePackages) {
+                    std::ifstream oldStream(bsvFileName);
+                    std::stringstream oldContents;
+                    oldContents << oldStream.rdbuf();
+                    if (oldStream.good() && oldContents.str() == contents) continue;
+                }
+                std::ofstream stream(bsvFileName);
+                if (!stream.good()) error("Could not open output file %s", bsvFileName.c_str());
+                stream << contents;
+                stream.close();
+            }
+        }
+    }
+    std::string topFile = pkgs.topPackage + ".bsv";
+
+    // bsc path is simply the path with a corrected base for relative dirs
+    // (bsc runs in a subdirectory of the current directory, or in the build
+    // directory)
+    auto fixRelativePath = [&](const std::string& p, const std::string& dir) {
+        if (!std::filesystem::path(p).is_relative()) return p;
+        if (separatePackages) return std::filesystem::absolute(p).string();
+        std::string prefix;
+        for (auto it = std::filesystem::path(dir).begin(); it != std::filesystem::path(dir).end(); it++) prefix += "../";
+        return prefix + p;
+    };
+    std::vector<std::string> userBscOpts;
+    if (!splitArgs(args.get<std::string>("--bscOpts"), userBscOpts))
+        error("unbalanced quotes in --bscOpts: %s", args.get<std::string>("--bscOpts").c_str());
+    // With absolutePaths, path dirs are spelled independently of dir (for
+    // cache keys)
+    auto getBscOpts = [&](const std::string& dir, bool absolutePaths = false) {
+        std::string bscPath;
+        for (std::string pathDir : path) {
+            bscPath += (absolutePaths? std::filesystem::absolute(pathDir).string() : fixRelativePath(pathDir, dir)) + ":";
+        }
+        bscPath += "%:+";
+        std::vector<std::string> opts = {"-p", bscPath};
+        opts.insert(opts.end(), userBscOpts.begin(), userBscOpts.end());
+        return opts;
+    };
+
+    // Each bsc invocation is cached, keyed by all its inputs: the translated
+    // code, bsc options, bsc version, and imported BSV files. Keys for
+    // later steps include the keys of the steps they depend on. Keys do not
+    // depend on the flow directory, so a step hits whether or not flows run
+    // concurrently (e.g., -o sim after -o sim,verilog).
+    std::string baseCacheKey = bscCacheEnabled()?
+        bscCacheKey({getVersion(), allCode, getBscIdentity(), getBsvImportsContents(parsedTrees, path)}) : "";
+    auto getCacheKey = [&](std::vector<std::string> inputs) {
+        if (!bscCacheEnabled()) return std::string("");
+        std::vector<std::string> opts = getBscOpts("", /*absolutePaths=*/true);
+        inputs.insert(inputs.begin(), opts.begin(), opts.end());
+        inputs.insert(inputs.begin(), baseCacheKey);
+        return bscCacheKey(inputs);
+    };
+
+    struct BscStep {
+        std::string name;  // for the time report
+        std::vector<std::string> argv;
+        std::string dir;
+        std::string cacheKey;
+        std::vector<std::string> outFiles;  // outputs outside dir (to cache)
+        ProcessResult res;  // diagnostics are in res.err
+        bool cached;
+    };
+    auto makeBscStep = [&](const std::string& dir, const std::vector<std::string>& bscArgs,
+            const std::string& cacheKey, const std::vector<std::string>& outFiles) {
+        std::vector<std::string> argv = {"bsc"};
+        for (const auto& opts : {getBscOpts(dir), bscArgs}) argv.insert(argv.end(), opts.begin(), opts.end());
+        std::string name = "bsc";
+        for (const auto& arg : bscArgs) name += " " + arg;
+        return BscStep{name, argv, dir, cacheKey, outFiles, {"", "", 0, false, false, 0.0, 0}, false};
+    };
+
+    // With concurrent flows, a failing sim flow cancels the Verilog flow's
+    // bsc invocations, since its failure is reported first and the Verilog
+    // results would not be used. The Verilog flow never cancels the sim
+    // flow, so reports do not depend on which flow fails first.
+    uint64_t bscTimeout = args.get<uint64_t>("--bsc-timeout");
+    std::atomic<bool> cancelVerilog(false);
+
+    // Invoke Bluespec compiler, or on a cache hit, restore the files bsc
+    // produced and its output. Does not report anything, so multiple steps
+    // can run concurrently. Setting *cancel kills bsc.
+    auto runBscStep = [&](BscStep& step, const std::atomic<bool>* cancel = nullptr) {
+        auto start = std::chrono::steady_clock::now();
+        std::string cachedOutput;
+        if (step.cacheKey.size() && lookupBscCache(step.cacheKey, step.dir, step.outFiles, cachedOutput)) {
+            step.res = {"", cachedOutput, 0, false, false, 0.0, 0};
+            step.cached = true;
+        } else {
+            step.res = runProcess(step.argv, step.dir, bscTimeout, cancel);
+        }
+        std::chrono::duration<double> wall = std::chrono::steady_clock::now() - start;
+        recordPhase(step.cached? step.name + " (cached)" : step.name, wall.count(), step.res.cpuSecs, step.res.maxRssKB);
+    };
+
+    // Report bsc output and check for type errors. Caches successful steps.
+    auto reportBscStep = [&](BscStep& step) {
+        if (step.res.timedOut) error("Bluespec compiler did not finish within %lu seconds (see --bsc-timeout)", bscTimeout);
+        {
+            PhaseTimer timer("report bsc output");
+            reportBluespecOutput(step.res.err, pkgs, topLevel, simOut);
+        }
+        exitIfErrors();
+	if (step.res.exitCode != 0) {
+            // If we didn't parse any error but bsc failed, this is typically
+            // because bsc wasn't found. So print the output.
+            error("could not compile file: %s", step.res.err.c_str());
+        }
+        if (!step.cached && step.cacheKey.size())
+            storeBscCache(step.cacheKey, step.dir, topFile, step.outFiles, step.res.err);
+    };
+
+    auto runBscCmd = [&](BscStep step) {
+        runBscStep(step);
+        reportBscStep(step);
+    };
+
+    if (separatePackages) {
+        // bsc -u skips up-to-date packages, but the top-level package must be
+        // recompiled to generate code for the top-level module
+        for (const auto& dir : flowDirs) {
+            std::error_code ec;
+            std::filesystem::remove(std::filesystem::path(dir) / (pkgs.topPackage + ".bo"), ec);
+        }
+        // The input file's package imports all others; if the top-level
+        // module is elsewhere, compiling its package alone would miss some
+        if (pkgs.topPackage != pkgs.names.back() && (simFlow || verilogFlow)) {
+            runBscCmd(makeBscStep(flowDirs[0], {"-u", pkgs.names.back() + ".bsv"}, "", {}));
+        }
+    }
+
+    // Each flow calls stepDone after each step, and stops if it returns false
+    typedef std::function<bool(BscStep&)> StepDoneFn;
+    auto reportNow = [&](BscStep& step) { reportBscStep(step); return true; };
+    auto reportSimLater = [&](BscStep& step) {
+        if (step.res.exitCode == 0) return true;
+        cancelVerilog = true;
+        return false;
+    };
+    auto reportVerilogLater = [&](BscStep& step) { return step.res.exitCode == 0; };
+
+    // With concurrent flows, the sim flow links the executable in its own
+    // directory, and we move it once all diagnostics are reported
+    std::string simOutName = concurrentFlows? simDir + "/" + outName : outName;
+    auto runSimFlow = [&](std::vector<BscStep>& steps, StepDoneFn stepDone) {
+        std::string simCacheKey = getCacheKey({"sim", pkgs.topModule});
+        steps.push_back(makeBscStep(simDir, {"-sim", "-g", pkgs.topModule, "-u", topFile}, simCacheKey, {}));
+        runBscStep(steps.back());
+        if (!stepDone(steps.back())) return;
+
+        // Link simulation executable
+        steps.push_back(makeBscStep(simDir, {"-sim", "-e", pkgs.topModule, "-o", fixRelativePath(simOutName, simDir)},
+                    getCacheKey({"sim-link", pkgs.topModule, outName, simCacheKey}), {simOutName, simOutName + ".so"}));
+        runBscStep(steps.back());
+        stepDone(steps.back());
+    };
+    auto finishSimFlow = [&]() {
+        if (simOutName != outName) {
+            for (std::string suffix : {"", ".so"}) {
+                std::error_code ec;
+                std::filesystem::rename(simOutName + suffix, outName + suffix, ec);
+                if (ec) error("could not move simulation executable %s", (simOutName + suffix).c_str());
+            }
+        }
+        std::cout << "produced simulation executable " << hlColored(outName) << "\n";
+    };
+
+    auto runVerilogFlow = [&](std::vector<BscStep>& steps, StepDoneFn stepDone) {
+        steps.push_back(makeBscStep(verilogDir, {"-verilog", "-D", "__VERILOG__", "-g", pkgs.topModule, "-u", topFile},
+                    getCacheKey({"verilog", pkgs.topModule}), {}));
+        runBscStep(steps.back(), &cancelVerilog);
+        stepDone(steps.back());
+    };
+    auto finishVerilogFlow = [&]() {
+        if (!fastCopyFile(verilogDir + "/" + pkgs.topModule + ".v", outName + ".v"))
+            error("could not copy verilog file");
+        std::cout << "produced verilog output " << hlColored(outName + ".v") << "\n";
+    };
+
+    std::vector<BscStep> simSteps;
+    std::vector<BscStep> verilogSteps;
+    if (concurrentFlows) {
+        std::thread verilogThread([&]() { runVerilogFlow(verilogSteps, reportVerilogLater); });
+        runSimFlow(simSteps, reportSimLater);
+        verilogThread.join();
+
+        // Report in a deterministic order, as serial flows would: sim flow
+        // (which exits on a failure, so cancelled Verilog steps are never
+        // reported), then Verilog flow
+        for (auto& step : simSteps) reportBscStep(step);
+        finishSimFlow();
+        for (auto& step : verilogSteps) reportBscStep(step);
+        finishVerilogFlow();
+    } else {
+        if (simFlow) {
+            runSimFlow(simSteps, reportNow);
+            finishSimFlow();
+        } else if (simOut && !defaultOut) {
             const char* problem = (topLevel == "")?
                 "did not provide a top-level module" :
                 "specified a top-level function, which can't be simulated";
             warn("you asked for sim output but %s, so not producing simulation executable", problem);
         }
-    }
 
-    if (verilogOut) {
-        if (topLevel.size()) {
-            std::stringstream cmd;
-            cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -verilog -D __VERILOG__ -g '" << sm.getTopModule() << "' -u Translated.bsv) 2>&1 >/dev/null";
-            runBscCmd(cmd.str());
-            typechecked = true;
-
-            cmd.str("");
-            cmd << "cp '" << tmpDir << "/" << sm.getTopModule() << ".v' '" << outName << ".v'";
-            run(cmd.str());
-            std::cout << "produced verilog output " << hlColored(outName + ".v") << "\n";
-        } else if (!defaultOut) {
+        if (verilogFlow) {
+            runVerilogFlow(verilogSteps, reportNow);
+            finishVerilogFlow();
+        } else if (verilogOut && !defaultOut) {
             warn("you asked for verilog output but did not provide a top-level module or function, so not producing verilog");
         }
     }
 
-    if (!typechecked) {
-        std::stringstream cmd;
-        cmd << "(cd " << tmpDir << " && bsc " << bscOpts << " -u Translated.bsv) 2>&1 >/dev/null";
-        runBscCmd(cmd.str());
-        typechecked = true;
+    if (!simFlow && !verilogFlow) {
+        runBscCmd(makeBscStep(checkDir, {"-u", topFile}, getCacheKey({"typecheck"}), {}));
         std::cout << "no errors found on " << hlColored(inputFile) << "\n";
     }
 
-    if (bsvOut) {
-        auto cpRes = run("cp " + std::string(tmpDir) + "/Translated.bsv '" + outName + ".bsv'");
-        if (cpRes.exitCode != 0) {
+    if (bsvOut && separatePackages) {
+        std::cout << "produced bsv packages in " << hlColored(flowDirs[0]) << "\n";
+    } else if (bsvOut) {
+        if (!fastCopyFile(flowDirs[0] + "/Translated.bsv", outName + ".bsv")) {
             error("could not copy bsv file");
         }
         std::cout << "produced bsv output " << hlColored(outName + ".bsv") << "\n";
@@ -609,3 +642,17 @@ int main(int argc, const char* argv[]) {
 
     return 0;
 }
+
+int main(int argc, const char* argv[]) {
+    std::set_terminate(uncaughtExceptionHandler);
+
+    // Thin client mode: run on the compile server if there is one
+    const char* serverSocket = getenv("MSC_SERVER");
+    bool isServer = std::find_if(argv + 1, argv + argc,
+            [](const char* arg) { return std::string(arg) == "--server"; }) != argv + argc;
+    if (serverSocket && serverSocket[0] && !isServer) {
+        int exitCode;
+        if (runOnServer(serverSocket, argc, argv, exitCode)) return exitCode;
+    }
+    return compile(argc, argv);
+}
@@ -16,13 +16,30 @@
  * this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <filesystem>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <unistd.h>
 #include "antlr4-runtime.h"
+#include "errors.h"
+#include "hash.h"
 #include "log.h"
 #include "parse.h"
 #include "strutils.h"
+#include "timing.h"
 #include "MinispecLexer.h"
 #include "MinispecParser.h"
 
@@ -82,14 +99,32 @@ static std::string formatExpectedTokens(misc::IntervalSet tokens, const dfa::Voc
     }
 }
 
+// Serializes error reporting when files are parsed concurrently. Errors exit,
+// so the lock is never released after an error is printed; this keeps other
+// threads from interleaving their own errors with the first one. (When fatal
+// errors throw, the lock is released as the exception unwinds.)
+static std::mutex errorReportMutex;
+
+// Reports the first syntax error only; others are often confusing. The
+// parser must then be stopped with fail() (see below).
 class ErrorListener : public BaseErrorListener {
     public:
         typedef std::function<std::string_view(uint32_t)> GetLineFn;
         ErrorListener(GetLineFn getLine) : getLine(getLine) {}
 
+        bool hasErrors() const { return reportLock.owns_lock(); }
+
+        [[noreturn]] void fail(const std::string& sourceName) {
+            assert(hasErrors());
+            error("could not parse file %s", sourceName.c_str());
+        }
+
         virtual void syntaxError(Recognizer *recognizer, Token *offendingSymbol,
                                  size_t line, size_t charPositionInLine,
                                  const std::string &msg, std::exception_ptr e) override {
+            if (hasErrors()) return;
+            reportLock = std::unique_lock<std::mutex>(errorReportMutex);
+            std::ostream& err = currentReporter().err;
             std::stringstream errLoc;
             errLoc << recognizer->getInputStream()->getSourceName() << ":" << line << ":" << charPositionInLine + 1;
 
@@ -118,7 +153,7 @@ class ErrorListener : public BaseErrorListener {
                 }
             }
 
-            std::cerr << hlColored(errLoc.str()) << ": " << errorColored("error: ") << errMsg << "\n";
+            err << hlColored(errLoc.str()) << ": " << errorColored("error: ") << errMsg << "\n";
 
             // Print preceding context if this is the first token in the line
             if (offendingSymbol && offendingSymbol->getTokenIndex() > 0) {
@@ -128,7 +163,7 @@ class ErrorListener : public BaseErrorListener {
                 size_t prevLine = prevToken->getLine();
                 if (prevLine < line && (line - prevLine) < 5) {
                     for (size_t i = prevLine; i < line; i++)
-                        std::cerr << "    " << getLine(i) << "\n";
+                        err << "    " << getLine(i) << "\n";
                 }
             }
 
@@ -139,25 +174,22 @@ class ErrorListener : public BaseErrorListener {
                 errToken.size()? errToken.size() : 0;
             symbolLen = std::min(symbolLen, lineStr.size() - symbolStart);
             size_t symbolEnd = symbolStart + symbolLen;
-            std::cerr << "    " << lineStr.substr(0, symbolStart) <<
+            err << "    " << lineStr.substr(0, symbolStart) <<
                 errorColored(lineStr.substr(symbolStart, symbolLen)) <<
                 lineStr.substr(symbolEnd) << "\n";
 
-#if 0
-            // Until we refine recovery, bail on first error; others are often confusing
-            throw ParseCancellationException();
-#else
-            // Due to an open bug in ANTLR, this throw causes a SIGSEGV
+            // Ideally we'd bail here by throwing ParseCancellationException,
+            // but due to an open bug in ANTLR, this throw causes a SIGSEGV
             // if the exception comes from reportNoViableAlternative
             // Bug: https://github.com/antlr/antlr4/issues/2550
             // Open PR: https://github.com/antlr/antlr4/pull/2501
-            // Instead, for now exit directly
-            error("could not parse file %s", recognizer->getInputStream()->getSourceName().c_str());
-#endif
+            // Exiting directly would not let in-process compilations recover,
+            // so instead the parser recovers silently and we fail afterwards.
         }
 
     private:
         GetLineFn getLine;
+        std::unique_lock<std::mutex> reportLock;  // held from the first error on
 };
 
 std::string getContextName(RuleContext* ctx) {
@@ -252,82 +284,614 @@ class ErrorStrategy : public DefaultErrorStrategy {
         }
 };
 
-struct ParsedFile {
-    const std::string data;
-    const std::vector<std::string_view> lines;
-    std::vector<ParsedFile*> imports;
+// Contents of a source file. Memory-mapped, so even very large files are not
+// copied; falls back to reading the file if it can't be mapped (e.g., pipes).
+// Files kept across compilations (see enableParseCache()), and those of
+// compilations that disable mapping (see Compilation::setMapSources()), must
+// be read, as truncating a mapped file makes later accesses fault.
+class SourceData {
+    public:
+        SourceData() {}
+        SourceData(const SourceData&) = delete;
+        SourceData& operator=(const SourceData&) = delete;
+        ~SourceData() {
+            if (mapped) munmap((void*) ptr, len);
+        }
+
+        // Returns false if the file can't be read
+        bool load(const std::string& fileName, bool map) {
+            int fd = open(fileName.c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd == -1) return false;
+            struct stat st;
+            if (map && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+                void* p = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                if (p != MAP_FAILED) {
+                    ptr = (const char*) p;
+                    len = st.st_size;
+                    mapped = true;
+                    close(fd);
+                    return true;
+                }
+            }
+            char chunk[65536];
+            ssize_t bytes;
+            while ((bytes = read(fd, chunk, sizeof(chunk))) > 0) buf.append(chunk, bytes);
+            close(fd);
+            if (bytes < 0) return false;
+            ptr = buf.data();
+            len = buf.size();
+            return true;
+        }
+
+        std::string_view view() const { return std::string_view(ptr, len); }
+
+    private:
+        const char* ptr = "";
+        size_t len = 0;
+        bool mapped = false;
+        std::string buf;
+};
 
-    // Used by the constructor
-    static std::vector<std::string_view> getLines(const std::string& str) {
-        std::vector<std::string_view> res;
-        const char* cStr = str.c_str();
-        size_t lastPos = 0;
-        for (auto pos = str.find("\n"); pos != std::string::npos; pos = str.find("\n", pos + 1)) {
-            res.push_back(std::string_view(cStr + lastPos, pos - lastPos));
-            lastPos = pos + 1;
+// CharStream over the bytes of a source file. Replaces ANTLRInputStream,
+// which decodes its input into a UTF-32 copy. The grammar is ASCII-only, so
+// symbols are bytes (non-ASCII bytes can only appear in comments and
+// strings), and character positions are byte offsets.
+class ByteCharStream : public CharStream {
+    public:
+        std::string name;
+
+        ByteCharStream(std::string_view data) : data(data) {}
+
+        void reset() { p = 0; }
+
+        virtual void consume() override {
+            if (p >= data.size()) {
+                assert(LA(1) == IntStream::EOF);
+                throw IllegalStateException("cannot consume EOF");
+            }
+            p++;
         }
-        // Edge case: catch last line if file has no newline at end
-        if (str.size() > lastPos) {
-            res.push_back(std::string_view(cStr + lastPos, str.size() - lastPos));
+
+        virtual size_t LA(ssize_t i) override {
+            if (i == 0) return 0;  // undefined
+            ssize_t pos = (ssize_t) p + ((i < 0)? i : i - 1);
+            if (pos < 0 || pos >= (ssize_t) data.size()) return IntStream::EOF;
+            return (uint8_t) data[pos];
         }
-        //for (auto x : res) info("|%s|", std::string(x).c_str());
-        return res;
+
+        // Marks are unneeded, since all input is kept around
+        virtual ssize_t mark() override { return -1; }
+        virtual void release(ssize_t marker) override {}
+
+        virtual size_t index() override { return p; }
+        virtual void seek(size_t index) override { p = std::min(index, data.size()); }
+        virtual size_t size() override { return data.size(); }
+
+        virtual std::string getSourceName() const override {
+            return name.empty()? IntStream::UNKNOWN_SOURCE_NAME : name;
+        }
+
+        virtual std::string getText(const misc::Interval& interval) override {
+            if (interval.a < 0 || interval.b < interval.a || (size_t) interval.a >= data.size()) return "";
+            size_t start = interval.a;
+            size_t stop = std::min((size_t) interval.b, data.size() - 1);
+            return std::string(data.substr(start, stop - start + 1));
+        }
+
+        virtual std::string toString() const override { return std::string(data); }
+
+    private:
+        std::string_view data;
+        size_t p = 0;
+};
+
+// On-disk parse tree cache (see initParseTreeCache()). An entry stores a
+// file's tokens and the alternative the parser predicted at each adaptive
+// decision, which is much more compact than the tree itself. Replaying the
+// predictions rebuilds exactly the same tree (with the usual context types,
+// so it needs no special handling) while skipping lexing and prediction,
+// which dominate parsing time.
+static std::string treeCacheDir = "";
+static std::string treeCacheVersion = "";
+static const char treeCacheMagic[] = "mstree1\n";
+
+// ParserATNSimulator that can record its predictions, or replay recorded ones
+class DecisionSimulator : public atn::ParserATNSimulator {
+    public:
+        using ParserATNSimulator::ParserATNSimulator;
+
+        enum Mode {PREDICT, RECORD, REPLAY};
+        void setMode(Mode m) { mode = m; decisions.clear(); nextDecision = 0; }
+        void setMode(Mode m, std::vector<uint32_t>&& replayDecisions) {
+            setMode(m);
+            decisions = std::move(replayDecisions);
+        }
+        const std::vector<uint32_t>& getDecisions() const { return decisions; }
+        bool replayedAll() const { return nextDecision == decisions.size(); }
+
+        virtual size_t adaptivePredict(TokenStream* input, size_t decision, ParserRuleContext* outerContext) override {
+            if (mode == REPLAY) {
+                // A stale or corrupted entry; the parser bails out and the file is reparsed
+                if (nextDecision >= decisions.size()) throw ParseCancellationException("cached decisions exhausted");
+                return decisions[nextDecision++];
+            }
+            size_t alt = ParserATNSimulator::adaptivePredict(input, decision, outerContext);
+            if (mode == RECORD) decisions.push_back(alt);
+            return alt;
+        }
+
+    private:
+        Mode mode = PREDICT;
+        std::vector<uint32_t> decisions;
+        size_t nextDecision = 0;
+};
+
+class ReplayableParser : public MinispecParser {
+    public:
+        ReplayableParser(TokenStream* input) : MinispecParser(input) {
+            auto sim = getInterpreter<atn::ParserATNSimulator>();
+            decisionSim = new DecisionSimulator(this, sim->atn, sim->decisionToDFA, sim->getSharedContextCache());
+            delete _interpreter;
+            _interpreter = decisionSim;  // deleted by ~MinispecParser()
+        }
+
+        DecisionSimulator* getDecisionSimulator() { return decisionSim; }
+
+    private:
+        DecisionSimulator* decisionSim;
+};
+
+// Token sources of parsed files (their lexer, or the tokens of a tree cache
+// entry) point back to their file, so each token leads to its file without
+// a global registry
+struct ParsedFileSource {
+    ParsedFile* const parsedFile;
+    ParsedFileSource(ParsedFile* parsedFile) : parsedFile(parsedFile) {}
+};
+
+class FileLexer : public MinispecLexer, public ParsedFileSource {
+    public:
+        FileLexer(CharStream* input, ParsedFile* parsedFile) : MinispecLexer(input), ParsedFileSource(parsedFile) {}
+};
+
+// Replays the tokens of a cache entry
+class CachedTokenSource : public TokenSource, public ParsedFileSource {
+    public:
+        struct CachedToken {
+            size_t type, channel, start, stop, line, charPositionInLine;
+        };
+        std::vector<CachedToken> tokens;  // the last one must be EOF
+
+        CachedTokenSource(CharStream* input, ParsedFile* parsedFile) : ParsedFileSource(parsedFile), input(input) {}
+
+        virtual std::unique_ptr<Token> nextToken() override {
+            const CachedToken& t = tokens[std::min(next++, tokens.size() - 1)];
+            auto token = std::make_unique<CommonToken>(std::make_pair((TokenSource*) this, input),
+                    t.type, t.channel, t.start, t.stop);
+            token->setLine(t.line);
+            token->setCharPositionInLine(t.charPositionInLine);
+            line = t.line;
+            charPositionInLine = t.charPositionInLine;
+            return token;
+        }
+
+        virtual size_t getLine() const override { return line; }
+        virtual size_t getCharPositionInLine() override { return charPositionInLine; }
+        virtual CharStream* getInputStream() override { return input; }
+        virtual std::string getSourceName() override { return input->getSourceName(); }
+        virtual Ref<TokenFactory<CommonToken>> getTokenFactory() override { return CommonTokenFactory::DEFAULT; }
+
+    private:
+        CharStream* input;
+        size_t next = 0;
+        size_t line = 1;
+        size_t charPositionInLine = 0;
+};
+
+// Entries are named by a hash of the cache version and the contents
+static std::string treeCacheKey(std::string_view data) {
+    return contentHash({treeCacheVersion, data});
+}
+
+static void putVarint(std::string& buf, uint64_t v) {
+    while (v >= 0x80) {
+        buf.push_back((char) (v | 0x80));
+        v >>= 7;
+    }
+    buf.push_back((char) v);
+}
+
+static bool getVarint(std::string_view& buf, uint64_t& v) {
+    v = 0;
+    for (uint32_t shift = 0; shift < 64 && !buf.empty(); shift += 7) {
+        uint8_t b = buf[0];
+        buf.remove_prefix(1);
+        v |= (uint64_t) (b & 0x7f) << shift;
+        if (!(b & 0x80)) return true;
     }
+    return false;
+}
+
+// Token fields are delta-encoded (tokens are in input order), and EOF's
+// type and stop index (both -1 as size_t) wrap around to 0
+static std::string serializeTree(const std::vector<Token*>& tokens, const std::vector<uint32_t>& decisions) {
+    std::string buf = treeCacheMagic;
+    putVarint(buf, tokens.size());
+    size_t prevStart = 0, prevLine = 0;
+    for (auto t : tokens) {
+        putVarint(buf, t->getType() + 1);
+        putVarint(buf, t->getChannel());
+        putVarint(buf, t->getStartIndex() - prevStart);
+        putVarint(buf, t->getStopIndex() + 1 - t->getStartIndex());
+        putVarint(buf, t->getLine() - prevLine);
+        putVarint(buf, t->getCharPositionInLine());
+        prevStart = t->getStartIndex();
+        prevLine = t->getLine();
+    }
+    putVarint(buf, decisions.size());
+    for (auto d : decisions) putVarint(buf, d);
+    return buf;
+}
+
+static bool deserializeTree(std::string_view buf, std::vector<CachedTokenSource::CachedToken>& tokens,
+        std::vector<uint32_t>& decisions) {
+    if (buf.substr(0, strlen(treeCacheMagic)) != treeCacheMagic) return false;
+    buf.remove_prefix(strlen(treeCacheMagic));
+    uint64_t numTokens, numDecisions, v[6];
+    if (!getVarint(buf, numTokens) || numTokens == 0 || numTokens > buf.size()) return false;
+    tokens.resize(numTokens);
+    size_t prevStart = 0, prevLine = 0;
+    for (auto& t : tokens) {
+        for (auto& f : v) if (!getVarint(buf, f)) return false;
+        t.type = v[0] - 1;
+        t.channel = v[1];
+        t.start = prevStart + v[2];
+        t.stop = t.start + v[3] - 1;
+        t.line = prevLine + v[4];
+        t.charPositionInLine = v[5];
+        prevStart = t.start;
+        prevLine = t.line;
+    }
+    if (tokens.back().type != Token::EOF) return false;
+    if (!getVarint(buf, numDecisions) || numDecisions > buf.size()) return false;
+    decisions.resize(numDecisions);
+    for (auto& d : decisions) {
+        uint64_t alt;
+        if (!getVarint(buf, alt)) return false;
+        d = alt;
+    }
+    return buf.empty();
+}
+
+static bool loadTreeCacheEntry(const std::string& key, std::vector<CachedTokenSource::CachedToken>& tokens,
+        std::vector<uint32_t>& decisions) {
+    std::string path = treeCacheDir + "/" + key;
+    SourceData entry;
+    if (!entry.load(path, /*map=*/false) || !deserializeTree(entry.view(), tokens, decisions)) return false;
+    // Track recent uses through the entry's modification time (see initParseTreeCache())
+    utimensat(AT_FDCWD, path.c_str(), nullptr, 0);
+    return true;
+}
+
+// Writes to a temporary file and renames it into place, so concurrent msc
+// processes never see partial entries
+static void storeTreeCacheEntry(const std::string& key, const std::string& buf) {
+    std::string path = treeCacheDir + "/" + key;
+    std::string tmpPath = path + ".tmp" + std::to_string(getpid()) + "." +
+        std::to_string(std::hash<std::thread::id>()(std::this_thread::get_id()));
+    int fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) return;
+    bool ok = write(fd, buf.data(), buf.size()) == (ssize_t) buf.size();
+    ok &= close(fd) == 0;
+    if (!ok || rename(tmpPath.c_str(), path.c_str()) != 0) unlink(tmpPath.c_str());
+}
+
+struct ParsedFile {
+    const std::unique_ptr<SourceData> source;
+    const std::string_view data;
+    std::vector<ParsedFile*> imports;
 
     std::string_view getLine(uint32_t line) {
         assert(line > 0);  // line is 1-based
-        return (line <= lines.size())? lines[line-1] : "";
+        // Most files never need lines (only for error messages), so build
+        // the line index on first use
+        std::call_once(newlinesFlag, [this]() {
+            for (const char* p = data.data(); (p = (const char*) memchr(p, '\n', data.data() + data.size() - p)); p++)
+                newlines.push_back(p - data.data());
+        });
+        // Edge case: the last line may not end in a newline
+        size_t numLines = newlines.size() + ((data.size() > (newlines.empty()? 0 : newlines.back() + 1))? 1 : 0);
+        if (line > numLines) return "";
+        size_t start = (line == 1)? 0 : newlines[line - 2] + 1;
+        size_t end = (line <= newlines.size())? newlines[line - 1] : data.size();
+        return data.substr(start, end - start);
     }
 
-    ANTLRInputStream input;
-    MinispecLexer lexer;
+    ByteCharStream input;
+    FileLexer lexer;
+    CachedTokenSource cachedTokens;  // replaces lexer on tree cache hits
     CommonTokenStream tokenStream;
-    MinispecParser parser;
+    ReplayableParser parser;
     ErrorListener errorListener;
     MinispecParser::PackageDefContext* tree;
 
-    ParsedFile(const std::string& fileName, std::ifstream& stream) :
-        data(std::istreambuf_iterator<char>(stream), {}), lines(getLines(data)),
-        input(data), lexer(&input), tokenStream(&lexer), parser(&tokenStream),
+    ParsedFile(const std::string& fileName, std::unique_ptr<SourceData> fileSource) :
+        source(std::move(fileSource)), data(source->view()),
+        input(data), lexer(&input, this), cachedTokens(&input, this), tokenStream(&lexer), parser(&tokenStream),
         errorListener([&] (uint32_t line) { return this->getLine(line); }) {
             input.name = fileName;
+            parsedFiles++;
+
+            std::string cacheKey = (treeCacheDir != "")? treeCacheKey(data) : "";
+            if (cacheKey != "" && replayCachedTree(cacheKey)) {
+                treeCacheHits++;
+                addReportCount("parse tree cache hits");
+            } else {
+                if (cacheKey != "") {
+                    treeCacheMisses++;
+                    addReportCount("parse tree cache misses");
+                }
+                parse(/*record=*/cacheKey != "");
+                if (cacheKey != "") {
+                    tokenStream.fill();
+                    storeTreeCacheEntry(cacheKey, serializeTree(tokenStream.getTokens(),
+                                parser.getDecisionSimulator()->getDecisions()));
+                    parser.getDecisionSimulator()->setMode(DecisionSimulator::PREDICT);
+                }
+            }
+    }
+
+    static ParsedFile* Get(TokenSource* tokenSource) {
+        auto source = dynamic_cast<ParsedFileSource*>(tokenSource);
+        return source? source->parsedFile : nullptr;
+    }
+
+    static std::atomic<uint64_t> parsedFiles;
+    static std::atomic<uint64_t> llFallbacks;
+    static std::atomic<uint64_t> treeCacheHits;
+    static std::atomic<uint64_t> treeCacheMisses;
+
+    private:
+        // Parses from the source (exits on syntax errors). With record,
+        // records the parser's predictions for the tree cache.
+        void parse(bool record) {
+            // Two-stage parsing: First try the much faster SLL prediction
+            // mode, bailing out on the first error. Nearly all files parse
+            // fine this way. If SLL fails (due to a syntax error or an input
+            // that SLL can't handle), reparse from scratch with full LL and
+            // our ErrorStrategy, which produces exactly the same errors as
+            // an LL-only parse. Lexer errors are only recorded in the first
+            // pass, as reporting them could interleave differently with
+            // parser errors.
+            RecordingErrorListener sllLexerListener;
             lexer.removeErrorListeners();
-            lexer.addErrorListener(&errorListener);
+            lexer.addErrorListener(&sllLexerListener);
             parser.removeErrorListeners();
+            parser.setErrorHandler(std::make_shared<BailErrorStrategy>());
+            parser.getInterpreter<atn::ParserATNSimulator>()->setPredictionMode(atn::PredictionMode::SLL);
+            auto decisionSim = parser.getDecisionSimulator();
+            decisionSim->setMode(record? DecisionSimulator::RECORD : DecisionSimulator::PREDICT);
+            try {
+                tree = parser.packageDef();
+                if (!sllLexerListener.hasErrors()) return;
+            } catch (ParseCancellationException& e) {
+            } catch (RecognitionException& e) {
+            }
+
+            llFallbacks++;
+            decisionSim->setMode(record? DecisionSimulator::RECORD : DecisionSimulator::PREDICT);
+            input.reset();
+            lexer.reset();
+            lexer.removeErrorListeners();
+            lexer.addErrorListener(&errorListener);
+            tokenStream.setTokenSource(&lexer);
+            parser.reset();
             parser.addErrorListener(&errorListener);
             parser.setErrorHandler(std::make_shared<ErrorStrategy>());
-            ParsedFiles[tokenStream.getTokenSource()] = this;
+            parser.getInterpreter<atn::ParserATNSimulator>()->setPredictionMode(atn::PredictionMode::LL);
             tree = parser.packageDef();
-    }
+            if (errorListener.hasErrors()) errorListener.fail(input.getSourceName());
+        }
 
-    static ParsedFile* Get(TokenSource* tokenSource) { return ParsedFiles[tokenSource]; }
+        // Rebuilds the tree from a cache entry. Returns false (leaving the
+        // parser ready to parse from the source) if the entry is missing or
+        // does not match the source.
+        bool replayCachedTree(const std::string& key) {
+            std::vector<uint32_t> decisions;
+            if (!loadTreeCacheEntry(key, cachedTokens.tokens, decisions)) return false;
+            tokenStream.setTokenSource(&cachedTokens);
+            parser.removeErrorListeners();
+            parser.setErrorHandler(std::make_shared<BailErrorStrategy>());
+            auto decisionSim = parser.getDecisionSimulator();
+            decisionSim->setMode(DecisionSimulator::REPLAY, std::move(decisions));
+            bool ok = false;
+            try {
+                tree = parser.packageDef();
+                ok = decisionSim->replayedAll();
+            } catch (ParseCancellationException& e) {
+            } catch (RecognitionException& e) {
+            }
+            decisionSim->setMode(DecisionSimulator::PREDICT);
+            if (!ok) {
+                tokenStream.setTokenSource(&lexer);
+                parser.reset();
+            }
+            return ok;
+        }
 
-    private:
-        static std::unordered_map<TokenSource*, ParsedFile*> ParsedFiles;
+        std::once_flag newlinesFlag;
+        std::vector<uint32_t> newlines;  // offsets of all newlines in data
+
+        // Used in the SLL parsing stage to detect lexer errors without reporting them
+        class RecordingErrorListener : public BaseErrorListener {
+            public:
+                virtual void syntaxError(Recognizer *recognizer, Token *offendingSymbol,
+                                         size_t line, size_t charPositionInLine,
+                                         const std::string &msg, std::exception_ptr e) override {
+                    errors = true;
+                }
+                bool hasErrors() const { return errors; }
+            private:
+                bool errors = false;
+        };
 };
 
-std::unordered_map<TokenSource*, ParsedFile*> ParsedFile::ParsedFiles;
+std::atomic<uint64_t> ParsedFile::parsedFiles = 0;
+std::atomic<uint64_t> ParsedFile::llFallbacks = 0;
+std::atomic<uint64_t> ParsedFile::treeCacheHits = 0;
+std::atomic<uint64_t> ParsedFile::treeCacheMisses = 0;
+
+ParseStats getParseStats() {
+    return ParseStats{ParsedFile::parsedFiles, ParsedFile::llFallbacks,
+        ParsedFile::treeCacheHits, ParsedFile::treeCacheMisses};
+}
 
 TokenStream* getTokenStream(ParserRuleContext* ctx) {
     return &ParsedFile::Get(ctx->start->getTokenSource())->tokenStream;
 }
 
-ParsedFile* parseFile(const std::string& fileName) {
-    std::ifstream stream;
-    // We generate the stream here due to RAII restrictions (lexing and parsing
+// Parse cache (see enableParseCache()). Entries are keyed by absolute path
+// and name, as the name is used in error messages.
+struct CachedParsedFile {
+    std::shared_ptr<ParsedFile> parsedFile;
+    std::filesystem::file_time_type mtime;
+    size_t hash;
+};
+static bool parseCacheEnabled = false;
+static std::unordered_map<std::string, CachedParsedFile> parseCache;
+static ParsedFileList newlyParsedFiles;
+static std::mutex parseCacheMutex;
+
+static std::string getParseCacheKey(const std::filesystem::path& absPath, const std::string& fileName) {
+    return absPath.string() + "\n" + fileName;
+}
+
+// The parsed file is owned by compilation (and shared with the parse cache,
+// if enabled)
+ParsedFile* parseFile(Compilation& compilation, const std::string& fileName) {
+    // We load the source here due to RAII restrictions (lexing and parsing
     // are done in ParsedFile's constructor).
-    stream.open(fileName);
-    if (!stream.good()) error("Could not read source file %s", fileName.c_str());
+    auto source = std::make_unique<SourceData>();
+    if (!source->load(fileName, /*map=*/!parseCacheEnabled && compilation.mapSources)) {
+        std::lock_guard<std::mutex> lock(errorReportMutex);
+        error("Could not read source file %s", fileName.c_str());
+    }
+
+    std::string cacheKey;
+    std::filesystem::file_time_type mtime;
+    if (parseCacheEnabled) {
+        std::error_code ec;
+        cacheKey = getParseCacheKey(std::filesystem::absolute(fileName, ec), fileName);
+        mtime = std::filesystem::last_write_time(fileName, ec);
+        std::lock_guard<std::mutex> lock(parseCacheMutex);
+        auto it = parseCache.find(cacheKey);
+        if (it != parseCache.end() && it->second.mtime == mtime) {
+            it->second.parsedFile->imports.clear();
+            std::lock_guard<std::mutex> compilationLock(compilation.mutex);
+            compilation.files.push_back(it->second.parsedFile);
+            return it->second.parsedFile.get();
+        }
+    }
+
+    size_t hash = std::hash<std::string_view>()(source->view());
+    if (parseCacheEnabled) {
+        std::lock_guard<std::mutex> lock(parseCacheMutex);
+        auto it = parseCache.find(cacheKey);
+        if (it != parseCache.end() && it->second.hash == hash) {
+            // Touched but unchanged
+            it->second.mtime = mtime;
+            it->second.parsedFile->imports.clear();
+            std::lock_guard<std::mutex> compilationLock(compilation.mutex);
+            compilation.files.push_back(it->second.parsedFile);
+            return it->second.parsedFile.get();
+        }
+    }
+
     try {
-        auto parsedFile = new ParsedFile(fileName, stream);
-        return parsedFile;
+        PhaseTimer timer("parse ", fileName);
+        auto parsedFile = std::make_shared<ParsedFile>(fileName, std::move(source));
+        if (parseCacheEnabled) {
+            std::lock_guard<std::mutex> lock(parseCacheMutex);
+            parseCache[cacheKey] = {parsedFile, mtime, hash};
+            newlyParsedFiles.push_back({fileName, hash});
+        }
+        std::lock_guard<std::mutex> compilationLock(compilation.mutex);
+        compilation.files.push_back(parsedFile);
+        return parsedFile.get();
     } catch (ParseCancellationException& p) {
         // NOTE: Probably not called at all, due to fix sidestepping antlr bug
-        // See code & comment around "throw ParseCancellationException" above
+        // See code & comment around "throwing ParseCancellationException" above
+        std::lock_guard<std::mutex> lock(errorReportMutex);
         error("could not parse file %s", fileName.c_str());
     }
 }
 
+void initParseTreeCache(const std::string& dir, const std::string& version) {
+    namespace fs = std::filesystem;
+    treeCacheDir = dir;
+    treeCacheVersion = version;
+    if (treeCacheDir == "") return;
+    std::error_code ec;
+    fs::create_directories(treeCacheDir, ec);
+    if (ec) {
+        warn("could not create parse tree cache directory %s (%s), disabling it", treeCacheDir.c_str(), ec.message().c_str());
+        treeCacheDir = "";
+        return;
+    }
+
+    // Entries are small, but every edit of a file adds one. About once a
+    // day, remove the entries unused for a month.
+    auto now = fs::file_time_type::clock::now();
+    fs::path stamp = fs::path(treeCacheDir) / ".pruned";
+    auto lastPruned = fs::last_write_time(stamp, ec);
+    if (!ec && now - lastPruned < std::chrono::hours(24)) return;
+    { std::ofstream touch(stamp); }
+    fs::last_write_time(stamp, now, ec);
+    for (auto& e : fs::directory_iterator(treeCacheDir, ec)) {
+        if (e.path().filename().string()[0] == '.') continue;
+        auto lastUse = fs::last_write_time(e.path(), ec);
+        if (!ec && now - lastUse > std::chrono::hours(24 * 30)) fs::remove(e.path(), ec);
+    }
+}
+
+void enableParseCache() {
+    parseCacheEnabled = true;
+}
+
+ParsedFileList getNewlyParsedFiles() {
+    std::lock_guard<std::mutex> lock(parseCacheMutex);
+    return newlyParsedFiles;
+}
+
+void warmParseCache(const std::string& dir, const ParsedFileList& files) {
+    ParseStats stats = getParseStats();
+    for (const auto& [fileName, hash] : files) {
+        std::filesystem::path absPath = std::filesystem::path(dir) / fileName;
+        auto source = std::make_unique<SourceData>();
+        if (!source->load(absPath, /*map=*/false)) continue;
+        // Skip files modified since they were parsed, as they may have errors
+        if (std::hash<std::string_view>()(source->view()) != hash) continue;
+
+        std::error_code ec;
+        auto mtime = std::filesystem::last_write_time(absPath, ec);
+        std::string cacheKey = getParseCacheKey(absPath, fileName);
+        auto it = parseCache.find(cacheKey);
+        if (it != parseCache.end()) {
+            if (it->second.hash == hash) {
+                it->second.mtime = mtime;
+                continue;
+            }
+        }
+        parseCache[cacheKey] = {std::make_shared<ParsedFile>(fileName, std::move(source)), mtime, hash};
+    }
+    newlyParsedFiles.clear();
+    // Warming is not parsing on behalf of any compilation
+    ParsedFile::parsedFiles = stats.files;
+    ParsedFile::llFallbacks = stats.llFallbacks;
+    ParsedFile::treeCacheHits = stats.treeCacheHits;
+    ParsedFile::treeCacheMisses = stats.treeCacheMisses;
+}
+
 std::string findImportedFile(MinispecParser::IdentifierContext* importItem, ParsedFile* parsedFile, const std::vector<std::string>& path) {
     std::string fileName = importItem->getText() + ".ms";
     struct stat sb;
@@ -335,25 +899,26 @@ std::string findImportedFile(MinispecParser::IdentifierContext* importItem, Pars
         std::string fullName = std::filesystem::path(dir) / fileName;
         if (stat(fullName.c_str(), &sb) == 0) return fullName;
     }
+    std::lock_guard<std::mutex> lock(errorReportMutex);
     error("Could not find import %s from parsed file %s", fileName.c_str(),
             parsedFile->tokenStream.getSourceName().c_str());
 }
 
-ParsedFile* parseFileAndImports(std::unordered_map<std::string, ParsedFile*>& parsedFiles,
+ParsedFile* parseFileAndImports(Compilation& compilation, std::unordered_map<std::string, ParsedFile*>& parsedFiles,
         const std::string& fileName, const std::vector<std::string>& path) {
     auto it = parsedFiles.find(fileName);
     if (it != parsedFiles.end()) {
         // Already parsed
         return it->second;
     } else {
-        auto parsedFile = parseFile(fileName);
+        auto parsedFile = parseFile(compilation, fileName);
         parsedFiles[fileName] = parsedFile;
 
         for (auto stmt : parsedFile->tree->packageStmt()) {
             if (auto importDecl = stmt->importDecl()) {
                 for (auto importItem : importDecl->identifier()) {
                     std::string importFile = findImportedFile(importItem, parsedFile, path);
-                    auto parsedImport = parseFileAndImports(parsedFiles, importFile, path);
+                    auto parsedImport = parseFileAndImports(compilation, parsedFiles, importFile, path);
                     parsedFile->imports.push_back(parsedImport);
                 }
             }
@@ -362,9 +927,140 @@ ParsedFile* parseFileAndImports(std::unordered_map<std::string, ParsedFile*>& pa
     }
 }
 
-std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::string& fileName, const std::vector<std::string>& path) {
+// Parallel version of parseFileAndImports. Files are parsed by a pool of
+// worker threads; each file's imports are found and queued as soon as the
+// file is parsed, so independent files are parsed concurrently. Import lists
+// are filled in once all files are parsed, in the same order as the
+// sequential version, so the topological sort is unaffected. So are errors.
+ParsedFile* parseFileAndImportsParallel(Compilation& compilation, std::unordered_map<std::string, ParsedFile*>& parsedFiles,
+        const std::string& fileName, const std::vector<std::string>& path, uint32_t jobs) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::string> pending;
+    std::unordered_set<std::string> queued;
+    std::unordered_map<std::string, std::vector<std::string>> importFiles;
+    uint32_t inFlight = 0;
+
+    // Must be called with mutex held
+    auto enqueue = [&](const std::string& file) {
+        if (queued.insert(file).second) {
+            pending.push_back(file);
+            cv.notify_one();
+        }
+    };
+
+    // Workers always throw fatal errors, and report into per-file buffers.
+    // A failure does not stop them, as a sequential parse may reach other
+    // errors first. Once all files are parsed, the calling thread reports
+    // the buffers and raises the first failure in the order of the
+    // sequential (depth-first) parse, so errors do not depend on timing.
+    Reporter* reporter = &currentReporter();
+    std::unordered_map<std::string, std::string> fileOutputs;
+    std::unordered_map<std::string, std::exception_ptr> parseFailures, importFailures;
+
+    auto worker = [&]() {
+        ThrowFatalErrors throwFatalErrors;
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [&]() { return !pending.empty() || inFlight == 0; });
+            if (pending.empty()) break;  // no pending or in-flight files, we're done
+            std::string file = pending.front();
+            pending.pop_front();
+            inFlight++;
+            lock.unlock();
+
+            std::stringstream output;
+            Reporter fileReporter(output, output);
+            fileReporter.reportAllMsgs = reporter->reportAllMsgs;
+            ParsedFile* parsedFile = nullptr;
+            std::vector<std::string> imports;  // found before any import failure
+            std::exception_ptr parseFailure, importFailure;
+            {
+                ReporterScope reporterScope(&fileReporter);
+                try {
+                    parsedFile = parseFile(compilation, file);
+                    for (auto stmt : parsedFile->tree->packageStmt()) {
+                        if (auto importDecl = stmt->importDecl()) {
+                            for (auto importItem : importDecl->identifier())
+                                imports.push_back(findImportedFile(importItem, parsedFile, path));
+                        }
+                    }
+                } catch (FatalError&) {
+                    (parsedFile? importFailure : parseFailure) = std::current_exception();
+                }
+            }
+
+            lock.lock();
+            fileOutputs[file] = output.str();
+            if (parsedFile) parsedFiles[file] = parsedFile;
+            if (parseFailure) parseFailures[file] = parseFailure;
+            if (importFailure) importFailures[file] = importFailure;
+            for (const auto& importFile : imports) enqueue(importFile);
+            importFiles[file] = std::move(imports);
+            inFlight--;
+            if (inFlight == 0 && pending.empty()) cv.notify_all();
+        }
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        enqueue(fileName);
+    }
+    std::vector<std::thread> threads;
+    for (uint32_t i = 1; i < jobs; i++) threads.emplace_back(worker);
+    worker();
+    for (auto& t : threads) t.join();
+
+    auto raise = [](std::exception_ptr failure) {
+        try {
+            std::rethrow_exception(failure);
+        } catch (FatalError& e) {
+            fatalExit(e.exitCode, e.msg);
+        }
+    };
+    std::unordered_set<std::string> visited;
+    std::function<void(const std::string&)> visit = [&](const std::string& file) {
+        if (!visited.insert(file).second) return;
+        reporter->err << fileOutputs[file];
+        if (parseFailures.count(file)) raise(parseFailures[file]);
+        for (const auto& importFile : importFiles[file]) visit(importFile);
+        if (importFailures.count(file)) raise(importFailures[file]);
+    };
+    visit(fileName);
+
+    for (auto& [file, parsedFile] : parsedFiles) {
+        for (const auto& importFile : importFiles[file])
+            parsedFile->imports.push_back(parsedFiles[importFile]);
+    }
+    return parsedFiles[fileName];
+}
+
+std::pmr::memory_resource* Compilation::newArena() {
+    std::lock_guard<std::mutex> lock(mutex);
+    arenas.push_back(std::make_unique<std::pmr::synchronized_pool_resource>());
+    return arenas.back().get();
+}
+
+const std::string* Compilation::intern(const std::string& str) {
+    std::lock_guard<std::mutex> lock(internMutex);
+    return &*internedStrings.insert(str).first;
+}
+
+// Numbers all rule contexts in the tree densely, in preorder
+void Compilation::numberParseTree(tree::ParseTree* pt) {
+    auto ctx = asRuleContext(pt);
+    if (!ctx) return;
+    ctx->nodeId = nextNodeId++;
+    for (auto child : ctx->children) numberParseTree(child);
+    ctx->lastNodeId = nextNodeId - 1;
+}
+
+std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(Compilation& compilation,
+        const std::string& fileName, const std::vector<std::string>& path, uint32_t jobs) {
     std::unordered_map<std::string, ParsedFile*> parsedFilesMap;
-    ParsedFile* parsedFile = parseFileAndImports(parsedFilesMap, fileName, path);
+    ParsedFile* parsedFile = (jobs > 1)?
+        parseFileAndImportsParallel(compilation, parsedFilesMap, fileName, path, jobs) :
+        parseFileAndImports(compilation, parsedFilesMap, fileName, path);
 
     // Topologically sort files and detect import cycles
     struct TopoSort {
@@ -387,11 +1083,14 @@ std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::s
     };
     std::vector<MinispecParser::PackageDefContext*> sortedTrees;
     TopoSort().topoSort(parsedFile, sortedTrees);
+    for (auto tree : sortedTrees) compilation.numberParseTree(tree);
     return sortedTrees;
 }
 
-MinispecParser::PackageDefContext* parseSingleFile(const std::string& fileName) {
-    return parseFile(fileName)->tree;
+MinispecParser::PackageDefContext* parseSingleFile(Compilation& compilation, const std::string& fileName) {
+    auto tree = parseFile(compilation, fileName)->tree;
+    compilation.numberParseTree(tree);
+    return tree;
 }
 
 std::string contextStr(tree::ParseTree* pt, std::vector<tree::ParseTree*> highlights) {
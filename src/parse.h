@@ -17,16 +17,110 @@
  */
 
 #pragma once
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <string>
+#include <unordered_set>
 #include <vector>
 #include "antlr4-runtime.h"
 #include "MinispecParser.h"
 
+struct ParsedFile;
+
+// All the state of a single compile: the files it parses (with their
+// sources, tokens, and parse trees) and the arenas its elaboration objects
+// are allocated from. Destroying a Compilation frees all of it, so
+// long-running processes can compile repeatedly without leaking. Files
+// shared with the parsed-file cache (see enableParseCache()) stay alive
+// until they leave the cache.
+class Compilation {
+    public:
+        Compilation() {}
+        Compilation(const Compilation&) = delete;
+        Compilation& operator=(const Compilation&) = delete;
+
+        // Returns a new arena. It pools freed blocks by size, so memory freed
+        // during elaboration is reused, and releases the memory it holds when
+        // the compilation is destroyed (chunk by chunk, and after the
+        // objects in it have been destroyed). Arenas are thread-safe, as
+        // objects allocated by one thread may be freed by another, but each
+        // thread should allocate from its own to avoid contention.
+        std::pmr::memory_resource* newArena();
+
+        // Returns a copy of str that lives as long as the compilation, shared
+        // by all equal strings (e.g., source map context infos, which repeat
+        // a lot). Thread-safe.
+        const std::string* intern(const std::string& str);
+
+        // Sources are mapped by default, which avoids copying them. Processes
+        // that must survive a source being truncated while they compile it
+        // (which makes accesses to the mapping fault), such as hosts of
+        // libminispec, should read them into memory instead.
+        void setMapSources(bool map) { mapSources = map; }
+
+        // Parse trees are numbered densely (see parsetree.h). Returns one
+        // more than the largest node id so far, i.e., the size of arrays
+        // indexed by node id.
+        uint32_t getNodeIdBound() const { return nextNodeId; }
+
+    private:
+        std::mutex mutex;  // files and arenas are added by multiple threads
+        std::vector<std::shared_ptr<ParsedFile>> files;
+        std::vector<std::unique_ptr<std::pmr::synchronized_pool_resource>> arenas;
+        uint32_t nextNodeId = 1;  // ids start at 1, as 0 means unnumbered
+        bool mapSources = true;
+        std::unordered_set<std::string> internedStrings;
+        std::mutex internMutex;
+
+        void numberParseTree(antlr4::tree::ParseTree* pt);
+
+        friend ParsedFile* parseFile(Compilation& compilation, const std::string& fileName);
+        friend std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(Compilation& compilation,
+                const std::string& fileName, const std::vector<std::string>& path, uint32_t jobs);
+        friend MinispecParser::PackageDefContext* parseSingleFile(Compilation& compilation, const std::string& fileName);
+};
+
 // Parses file and all imported files. Returns parse trees sorted in
-// topological order. Exits on lexer or parser errors
-std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(const std::string& fileName, const std::vector<std::string>& path);
+// topological order. Exits on lexer or parser errors. If jobs > 1, parses
+// files concurrently using up to jobs threads.
+std::vector<MinispecParser::PackageDefContext*> parseFileAndImports(Compilation& compilation,
+        const std::string& fileName, const std::vector<std::string>& path, uint32_t jobs = 1);
 
 // Parse a single file without following imports. Returns file's parse tree.
-MinispecParser::PackageDefContext* parseSingleFile(const std::string& fileName);
+MinispecParser::PackageDefContext* parseSingleFile(Compilation& compilation, const std::string& fileName);
+
+// Parsing statistics. Files are first parsed with fast SLL prediction, and
+// reparsed with full LL prediction only if that fails (llFallbacks).
+struct ParseStats {
+    uint64_t files;
+    uint64_t llFallbacks;
+    uint64_t treeCacheHits;
+    uint64_t treeCacheMisses;
+};
+ParseStats getParseStats();
+
+// On-disk parse tree cache, shared by all msc processes. Entries are keyed by
+// a hash of version and each file's contents, so version must change
+// whenever the grammar may have changed. Files found in the cache are neither
+// lexed nor parsed. An empty dir disables the cache.
+void initParseTreeCache(const std::string& dir, const std::string& version);
+
+// Parsed-file cache for long-running processes (msc --server). Once enabled,
+// parsed files are kept and reused as long as their modification time or
+// contents do not change.
+void enableParseCache();
+
+// Files parsed from scratch (i.e., not found in the cache) by this process,
+// as (name, content hash) pairs
+typedef std::vector<std::pair<std::string, size_t>> ParsedFileList;
+ParsedFileList getNewlyParsedFiles();
+
+// Parses and caches files with names relative to dir, skipping any whose
+// contents no longer match their hash. Files must have parsed successfully
+// before (e.g., as reported by getNewlyParsedFiles() in a child process), so
+// this never exits on syntax errors.
+void warmParseCache(const std::string& dir, const ParsedFileList& files);
 
 antlr4::TokenStream* getTokenStream(antlr4::ParserRuleContext* ctx);
 
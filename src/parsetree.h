@@ -0,0 +1,43 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include "antlr4-runtime.h"
+
+// Base class of all Minispec parser rule contexts (set through the grammar's
+// contextSuperClass option). After parsing, rule contexts are numbered
+// densely in preorder (see parse.h), so the nodes of a subtree have ids in
+// [nodeId, lastNodeId]. This lets passes such as elaboration keep per-node
+// data in flat arrays instead of hash maps keyed by node pointer. Id 0 means
+// unnumbered; terminal nodes are never numbered.
+class MinispecRuleContext : public antlr4::ParserRuleContext {
+    public:
+        using antlr4::ParserRuleContext::ParserRuleContext;
+
+        uint32_t nodeId = 0;
+        uint32_t lastNodeId = 0;
+};
+
+// Cheaper than dynamic_cast<MinispecRuleContext*> on hot paths: only rule
+// contexts have children, so only childless nodes need the RTTI check.
+inline MinispecRuleContext* asRuleContext(antlr4::tree::ParseTree* pt) {
+    if (!pt->children.empty()) return static_cast<MinispecRuleContext*>(pt);
+    return dynamic_cast<MinispecRuleContext*>(pt);
+}
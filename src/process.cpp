@@ -0,0 +1,217 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "process.h"
+
+extern char** environ;
+
+// Poll period while waiting on a process with a timeout or cancellation flag
+static const int pollPeriodMs = 50;
+
+// Process groups of running children, so killChildrenOnSignals's handler can
+// kill them. A fixed table of atomics, as the handler must be
+// async-signal-safe; children beyond its capacity are not tracked.
+static const size_t maxLiveGroups = 256;
+static std::atomic<pid_t> liveGroups[maxLiveGroups];
+
+static void trackGroup(pid_t pgid) {
+    for (auto& g : liveGroups) {
+        pid_t free = 0;
+        if (g.compare_exchange_strong(free, pgid)) return;
+    }
+}
+
+static void untrackGroup(pid_t pgid) {
+    for (auto& g : liveGroups) {
+        pid_t tracked = pgid;
+        if (g.compare_exchange_strong(tracked, 0)) return;
+    }
+}
+
+static void killChildrenAndExit(int sig) {
+    for (auto& g : liveGroups) {
+        pid_t pgid = g.load();
+        if (pgid > 0) kill(-pgid, SIGTERM);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void killChildrenOnSignals() {
+    struct sigaction sa = {};
+    sa.sa_handler = killChildrenAndExit;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+}
+
+ProcessResult runProcess(const std::vector<std::string>& argv, const std::string& dir,
+        double timeoutSecs, const std::atomic<bool>* cancel) {
+    ProcessResult res = {"", "", 0, false, false, 0.0, 0};
+    // O_CLOEXEC, so concurrently spawned processes do not inherit our pipes
+    // (which would keep them open and hang the reads below)
+    int outPipe[2], errPipe[2];
+    if (pipe2(outPipe, O_CLOEXEC) != 0) {
+        res = {"", std::string("cannot create pipe: ") + strerror(errno), 127, false, false, 0.0, 0};
+        return res;
+    }
+    if (pipe2(errPipe, O_CLOEXEC) != 0) {
+        close(outPipe[0]);
+        close(outPipe[1]);
+        res = {"", std::string("cannot create pipe: ") + strerror(errno), 127, false, false, 0.0, 0};
+        return res;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, outPipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, errPipe[1], STDERR_FILENO);
+    if (dir != "") posix_spawn_file_actions_addchdir_np(&actions, dir.c_str());
+    // Run in a new process group, so a timeout kills all of its children
+    // (e.g., the C++ compiler bsc invokes to link simulators). The group does
+    // not get the terminal's Ctrl-C, so it is tracked for
+    // killChildrenOnSignals.
+    posix_spawnattr_t attr;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attr, 0);
+
+    std::vector<char*> cargv;
+    for (const auto& arg : argv) cargv.push_back(const_cast<char*>(arg.c_str()));
+    cargv.push_back(nullptr);
+    pid_t pid;
+    int spawnErr = posix_spawnp(&pid, cargv[0], &actions, &attr, cargv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if (!spawnErr) trackGroup(pid);
+    close(outPipe[1]);
+    close(errPipe[1]);
+    if (spawnErr) {
+        close(outPipe[0]);
+        close(errPipe[0]);
+        res.err = "cannot execute " + argv[0] + ": " + strerror(spawnErr);
+        res.exitCode = 127;
+        return res;
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSecs);
+    bool killed = false;
+    struct pollfd fds[2] = {{outPipe[0], POLLIN, 0}, {errPipe[0], POLLIN, 0}};
+    std::string* bufs[2] = {&res.out, &res.err};
+    int openFds = 2;
+    const size_t bufSize = 64 * 1024;
+    std::vector<char> buf(bufSize);
+    while (openFds) {
+        bool waitsForEvent = timeoutSecs > 0.0 || cancel;
+        int ready = poll(fds, 2, waitsForEvent? pollPeriodMs : -1);
+        if (ready < 0 && errno != EINTR) break;
+        for (auto& fd : fds) {
+            if (fd.fd < 0 || !(fd.revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            ssize_t bytes = read(fd.fd, buf.data(), bufSize);
+            if (bytes > 0) {
+                bufs[&fd - fds]->append(buf.data(), bytes);
+            } else if (bytes == 0 || errno != EINTR) {
+                close(fd.fd);
+                fd.fd = -1;  // poll ignores negative fds
+                openFds--;
+            }
+        }
+        if (!killed) {
+            if (timeoutSecs > 0.0 && std::chrono::steady_clock::now() >= deadline) res.timedOut = true;
+            if (cancel && cancel->load()) res.cancelled = true;
+            if (res.timedOut || res.cancelled) {
+                kill(-pid, SIGKILL);
+                killed = true;
+            }
+        }
+    }
+    for (auto& fd : fds) if (fd.fd >= 0) close(fd.fd);
+
+    // Stop tracking the group once the process exits, but before reaping it,
+    // so its pid (and group id) cannot be reused while tracked
+    siginfo_t info;
+    while (waitid(P_PID, pid, &info, WEXITED | WNOWAIT) < 0 && errno == EINTR);
+    untrackGroup(pid);
+    int status;
+    struct rusage ru;
+    while (wait4(pid, &status, 0, &ru) < 0 && errno == EINTR);
+    res.exitCode = WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    // Includes the process's waited-for children (e.g., bsc's backend)
+    res.cpuSecs = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec * 1e-6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec * 1e-6;
+    res.maxRssKB = ru.ru_maxrss;
+    return res;
+}
+
+bool fastCopyFile(const std::string& src, const std::string& dst) {
+    int srcFd = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+    if (srcFd < 0) return false;
+    struct stat st;
+    if (fstat(srcFd, &st) != 0) {
+        close(srcFd);
+        return false;
+    }
+    int dstFd = open(dst.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777);
+    if (dstFd < 0) {
+        close(srcFd);
+        return false;
+    }
+
+    bool ok = true;
+    if (ioctl(dstFd, FICLONE, srcFd) != 0) {
+        off_t left = st.st_size;
+        bool useCopyRange = true;
+        std::vector<char> buf;
+        while (left > 0) {
+            ssize_t bytes = -1;
+            if (useCopyRange) {
+                bytes = copy_file_range(srcFd, nullptr, dstFd, nullptr, left, 0);
+                // Not supported across these filesystems; fall back to read/write
+                if (bytes < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP)) {
+                    useCopyRange = false;
+                    buf.resize(64 * 1024);
+                    continue;
+                }
+            } else {
+                bytes = read(srcFd, buf.data(), buf.size());
+                if (bytes > 0 && write(dstFd, buf.data(), bytes) != bytes) bytes = -1;
+            }
+            if (bytes < 0 && errno == EINTR) continue;
+            if (bytes <= 0) {
+                ok = bytes == 0;  // file shrank while copying
+                break;
+            }
+            left -= bytes;
+        }
+    }
+    // open() does not change the mode of existing files
+    ok &= fchmod(dstFd, st.st_mode & 07777) == 0;
+    ok &= close(dstFd) == 0;
+    close(srcFd);
+    return ok;
+}
@@ -0,0 +1,53 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+// Subprocess runner. Processes are spawned directly (no shell), with
+// explicit argv, and stdout and stderr are read through separate pipes.
+
+struct ProcessResult {
+    std::string out;
+    std::string err;
+    int exitCode;  // exit status, or 128 + signal if killed
+    bool timedOut;
+    bool cancelled;
+    double cpuSecs;  // user + system time of the process and its children
+    uint64_t maxRssKB;  // peak RSS of the largest process
+};
+
+// Runs argv[0] (searched in PATH) in dir, and waits for it to finish. A
+// non-zero timeoutSecs kills the process (and all its children) after that
+// many seconds; so does setting *cancel from another thread. If the program
+// cannot be started, returns exit code 127 with the reason in err.
+ProcessResult runProcess(const std::vector<std::string>& argv, const std::string& dir,
+        double timeoutSecs = 0.0, const std::atomic<bool>* cancel = nullptr);
+
+// Makes SIGINT and SIGTERM kill the process groups of running children (with
+// SIGTERM) before terminating msc. Children run in their own process groups,
+// so they would not get a Ctrl-C from the terminal otherwise.
+void killChildrenOnSignals();
+
+// Copies src to dst (overwriting it) in-process, preserving permissions.
+// Uses a reflink when the filesystem supports them, and copy_file_range
+// otherwise, so file data need not go through user space.
+bool fastCopyFile(const std::string& src, const std::string& dst);
@@ -0,0 +1,417 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "log.h"
+#include "parse.h"
+#include "server.h"
+#include "strutils.h"
+
+extern char** environ;
+
+// Protocol: The client sends a 4-byte payload size, along with its stdin,
+// stdout, and stderr file descriptors (as SCM_RIGHTS ancillary data), then
+// the payload, a sequence of NUL-terminated strings: working directory,
+// argc, argv[0..argc), and all environment variables. Once the compilation
+// finishes, the server replies with its 4-byte exit code.
+
+static bool sendAll(int fd, const void* buf, size_t len) {
+    const char* p = (const char*) buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buf, size_t len) {
+    char* p = (char*) buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool getSockAddr(const std::string& socketPath, sockaddr_un& addr) {
+    if (socketPath.size() >= sizeof(addr.sun_path)) return false;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    return true;
+}
+
+// Servers run commands as their own user on behalf of clients, and clients
+// hand over their standard streams, so both ends only talk to peers of the
+// same user
+static bool peerIsSameUser(int fd) {
+    ucred cred;
+    socklen_t len = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0 || len != sizeof(cred)) return false;
+    return cred.uid == geteuid();
+}
+
+static int connectToServer(const std::string& socketPath) {
+    sockaddr_un addr;
+    if (!getSockAddr(socketPath, addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (sockaddr*) &addr, sizeof(addr)) != 0 || !peerIsSameUser(fd)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Client */
+
+bool runOnServer(const std::string& socketPath, int argc, const char* argv[], int& exitCode) {
+    int fd = connectToServer(socketPath);
+    if (fd < 0) return false;
+
+    std::error_code ec;
+    std::string payload = std::filesystem::current_path(ec).string();
+    payload += '\0' + std::to_string(argc) + '\0';
+    for (int i = 0; i < argc; i++) payload += std::string(argv[i]) + '\0';
+    for (char** e = environ; *e; e++) payload += std::string(*e) + '\0';
+
+    uint32_t size = payload.size();
+    iovec iov = {&size, sizeof(size)};
+    int stdioFds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(stdioFds))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(stdioFds));
+    memcpy(CMSG_DATA(cmsg), stdioFds, sizeof(stdioFds));
+    ssize_t sent;
+    do sent = sendmsg(fd, &msg, MSG_NOSIGNAL); while (sent < 0 && errno == EINTR);
+    if (sent != sizeof(size)) {
+        // Nothing ran on the server, so the caller can still compile locally
+        close(fd);
+        return false;
+    }
+
+    int32_t code;
+    if (!sendAll(fd, payload.data(), payload.size()) || !readAll(fd, &code, sizeof(code)))
+        error("lost connection to msc server at %s", socketPath.c_str());
+    close(fd);
+    exitCode = code;
+    return true;
+}
+
+/* Server */
+
+// In server children, write end of the pipe used to report parsed files
+static int parsedFilesFd = -1;
+
+void notifyServerParsedFiles() {
+    if (parsedFilesFd < 0) return;
+    std::stringstream ss;
+    for (const auto& [fileName, hash] : getNewlyParsedFiles()) ss << hash << " " << fileName << "\n";
+    std::string report = ss.str();
+    const char* p = report.c_str();
+    size_t len = report.size();
+    while (len) {
+        ssize_t n = write(parsedFilesFd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        p += n;
+        len -= n;
+    }
+    // Keep the pipe open: the server detects our exit when it's closed
+}
+
+struct Request {
+    int conn;  // connection to the client
+    pid_t pid;  // compilation process
+    int reportFd;  // read end of the compilation's parsed-files pipe
+    std::string cwd;
+    std::string report;  // parsed-files report, read so far
+    bool killed;
+};
+
+// Receives a request (see protocol above). On success, returns true with
+// stdioFds set to the client's standard streams.
+static bool receiveRequest(int conn, std::string& cwd, std::vector<std::string>& args,
+        std::vector<std::string>& env, int stdioFds[3]) {
+    uint32_t size;
+    iovec iov = {&size, sizeof(size)};
+    alignas(cmsghdr) char control[CMSG_SPACE(3 * sizeof(int))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t n;
+    do n = recvmsg(conn, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL); while (n < 0 && errno == EINTR);
+    cmsghdr* cmsg = (n > 0)? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) return false;
+    size_t numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int fds[3];
+    memcpy(fds, CMSG_DATA(cmsg), std::min(numFds, (size_t) 3) * sizeof(int));
+    if (numFds != 3 || n != sizeof(size) || (msg.msg_flags & MSG_CTRUNC)) {
+        for (size_t i = 0; i < std::min(numFds, (size_t) 3); i++) close(fds[i]);
+        return false;
+    }
+
+    std::string payload(size, '\0');
+    std::vector<std::string> strs;
+    if (readAll(conn, payload.data(), size)) {
+        for (size_t pos = 0; pos < payload.size(); ) {
+            size_t end = payload.find('\0', pos);
+            if (end == std::string::npos) break;
+            strs.push_back(payload.substr(pos, end - pos));
+            pos = end + 1;
+        }
+    }
+    size_t argc = (strs.size() >= 2)? strtoul(strs[1].c_str(), nullptr, 10) : 0;
+    if (argc == 0 || strs.size() < 2 + argc) {
+        for (int i = 0; i < 3; i++) close(fds[i]);
+        return false;
+    }
+    cwd = strs[0];
+    args.assign(strs.begin() + 2, strs.begin() + 2 + argc);
+    env.assign(strs.begin() + 2 + argc, strs.end());
+    memcpy(stdioFds, fds, sizeof(fds));
+    return true;
+}
+
+static volatile sig_atomic_t stopServer = 0;
+static void handleStopSignal(int) { stopServer = 1; }
+
+// The parse cache is warmed with the files that compilations parsed by a
+// background thread, so new clients are not stalled behind re-parses. The
+// thread holds warmMutex while it parses, and the server forks while holding
+// it too, so compilations never inherit a half-built cache entry or a lock
+// held by the thread.
+static std::mutex warmMutex;
+static std::condition_variable warmCv;
+static std::deque<std::pair<std::string, ParsedFileList>> warmQueue;
+static bool warmStop = false;
+
+static void warmParseCacheThread() {
+    std::unique_lock<std::mutex> lock(warmMutex);
+    while (true) {
+        warmCv.wait(lock, []() { return warmStop || !warmQueue.empty(); });
+        if (warmStop) return;
+        auto [dir, files] = std::move(warmQueue.front());
+        warmQueue.pop_front();
+        for (const auto& file : files) {
+            warmParseCache(dir, {file});
+            // Let the server fork between files
+            lock.unlock();
+            lock.lock();
+            if (warmStop) return;
+        }
+    }
+}
+
+void runServer(const std::string& socketPath, CompileFn compile) {
+    sockaddr_un addr;
+    if (!getSockAddr(socketPath, addr)) error("socket path %s is too long", socketPath.c_str());
+    int listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) error("could not create socket: %s", strerror(errno));
+    // Only our user may connect (the socket is created with mode 0600; peers
+    // are also checked on every connection)
+    mode_t prevUmask = umask(0077);
+    if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) != 0) {
+        // Reuse the socket of a server that is no longer running
+        int fd = (errno == EADDRINUSE)? connectToServer(socketPath) : -1;
+        if (fd >= 0) error("an msc server is already listening on %s", socketPath.c_str());
+        unlink(socketPath.c_str());
+        if (bind(listenFd, (sockaddr*) &addr, sizeof(addr)) != 0)
+            error("could not bind to socket %s: %s", socketPath.c_str(), strerror(errno));
+    }
+    umask(prevUmask);
+    if (chmod(socketPath.c_str(), 0600) != 0)
+        error("could not set permissions of socket %s: %s", socketPath.c_str(), strerror(errno));
+    if (listen(listenFd, 64) != 0) error("could not listen on socket %s: %s", socketPath.c_str(), strerror(errno));
+    // Used to detect when our socket is removed or replaced
+    struct stat socketStat;
+    if (stat(socketPath.c_str(), &socketStat) != 0) error("could not stat socket %s", socketPath.c_str());
+
+    struct sigaction sa = {};
+    sa.sa_handler = handleStopSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    enableParseCache();
+    std::thread warmThread(warmParseCacheThread);
+    std::cout << "msc server listening on " << hlColored(socketPath) << std::endl;
+
+    std::vector<Request> requests;
+    while (!stopServer) {
+        // Poll for new connections, compilation reports and exits, and
+        // clients that went away (they send nothing after the request, so
+        // their connection becomes readable only when closed)
+        std::vector<pollfd> pfds = {{listenFd, POLLIN, 0}};
+        for (const auto& r : requests) {
+            pfds.push_back({r.reportFd, POLLIN, 0});
+            pfds.push_back({r.killed? -1 : r.conn, POLLIN, 0});
+        }
+        int res = poll(pfds.data(), pfds.size(), 1000);
+        if (res < 0 && errno != EINTR) error("poll failed: %s", strerror(errno));
+        struct stat st;
+        if (stat(socketPath.c_str(), &st) != 0 || st.st_ino != socketStat.st_ino || st.st_dev != socketStat.st_dev) break;
+        if (res <= 0) continue;
+
+        for (size_t i = requests.size(); i-- > 0; ) {
+            Request& r = requests[i];
+            if (pfds[2*i + 2].revents) {
+                kill(-r.pid, SIGTERM);
+                r.killed = true;
+            }
+            if (!pfds[2*i + 1].revents) continue;
+            char buf[4096];
+            ssize_t n = read(r.reportFd, buf, sizeof(buf));
+            if (n > 0) r.report.append(buf, n);
+            if (n != 0) continue;
+
+            // Compilation finished
+            int status;
+            while (waitpid(r.pid, &status, 0) < 0 && errno == EINTR);
+            int32_t exitCode = WIFEXITED(status)? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            sendAll(r.conn, &exitCode, sizeof(exitCode));
+            close(r.conn);
+            close(r.reportFd);
+
+            ParsedFileList files;
+            std::istringstream reportSs(r.report);
+            size_t hash;
+            std::string fileName;
+            while (reportSs >> hash && reportSs.get() == ' ' && std::getline(reportSs, fileName))
+                files.push_back({fileName, hash});
+            if (!files.empty()) {
+                std::lock_guard<std::mutex> lock(warmMutex);
+                warmQueue.push_back({r.cwd, std::move(files)});
+                warmCv.notify_one();
+            }
+            requests.erase(requests.begin() + i);
+        }
+
+        if (!(pfds[0].revents & POLLIN)) continue;
+        int conn = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (conn < 0) continue;
+        if (!peerIsSameUser(conn)) {
+            close(conn);
+            continue;
+        }
+        // Don't let a stuck client block the server
+        timeval timeout = {5, 0};
+        setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        std::string cwd;
+        std::vector<std::string> args, env;
+        int stdioFds[3];
+        int reportPipe[2];
+        if (!receiveRequest(conn, cwd, args, env, stdioFds)) {
+            close(conn);
+            continue;
+        }
+        if (pipe2(reportPipe, O_CLOEXEC) != 0) error("could not create pipe: %s", strerror(errno));
+
+        std::cout.flush();
+        fflush(stdout);
+        fflush(stderr);
+        std::unique_lock<std::mutex> warmLock(warmMutex);
+        pid_t pid = fork();
+        if (pid == 0) {
+            // Compilation process: take over the client's streams, directory,
+            // and environment, and run in our own process group so the
+            // server can kill us and our bsc subprocesses
+            setpgid(0, 0);
+            signal(SIGINT, SIG_DFL);
+            signal(SIGTERM, SIG_DFL);
+            signal(SIGPIPE, SIG_DFL);
+            close(listenFd);
+            close(conn);
+            close(reportPipe[0]);
+            for (const auto& r : requests) {
+                close(r.conn);
+                close(r.reportFd);
+            }
+            for (int fd = 0; fd < 3; fd++) {
+                dup2(stdioFds[fd], fd);
+                close(stdioFds[fd]);
+            }
+            if (chdir(cwd.c_str()) != 0) error("could not change to directory %s", cwd.c_str());
+            clearenv();
+            for (const auto& e : env) putenv(strdup(e.c_str()));
+            parsedFilesFd = reportPipe[1];
+
+            std::vector<const char*> argv;
+            for (const auto& a : args) argv.push_back(a.c_str());
+            argv.push_back(nullptr);
+            exit(compile(args.size(), argv.data()));
+        }
+        warmLock.unlock();
+        for (int fd = 0; fd < 3; fd++) close(stdioFds[fd]);
+        close(reportPipe[1]);
+        if (pid > 0) setpgid(pid, pid);  // avoid racing with the child's setpgid
+        if (pid < 0) {
+            warn("could not fork compilation process: %s", strerror(errno));
+            int32_t exitCode = -1;
+            sendAll(conn, &exitCode, sizeof(exitCode));
+            close(conn);
+            close(reportPipe[0]);
+            continue;
+        }
+        requests.push_back({conn, pid, reportPipe[0], cwd, "", false});
+    }
+
+    for (const auto& r : requests) kill(-r.pid, SIGTERM);
+    {
+        std::lock_guard<std::mutex> lock(warmMutex);
+        warmStop = true;
+        warmCv.notify_one();
+    }
+    warmThread.join();
+    struct stat st;
+    if (stat(socketPath.c_str(), &st) == 0 && st.st_ino == socketStat.st_ino && st.st_dev == socketStat.st_dev)
+        unlink(socketPath.c_str());
+    exit(0);
+}
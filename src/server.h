@@ -0,0 +1,45 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <functional>
+#include <string>
+
+// Compile server. A long-running msc process (msc --server <socket>) listens
+// on a Unix domain socket and runs compilations on behalf of clients, which
+// forward their arguments, working directory, environment, and standard
+// streams. Each compilation runs in a forked child, so it sees the server's
+// warm state (e.g., the parse cache) and can exit on errors as usual. The
+// client exits with the compilation's exit code. Elaboration runs in the
+// children, so its results are not kept across compilations; bsc results
+// are, through the bsc cache (see cache.h). Only the server's user may
+// connect.
+
+typedef std::function<int(int argc, const char* argv[])> CompileFn;
+
+// Serves requests until interrupted or until socketPath is removed.
+[[noreturn]] void runServer(const std::string& socketPath, CompileFn compile);
+
+// Runs this invocation on the server listening on socketPath. Returns false
+// if no server is listening, so the caller can compile locally instead.
+bool runOnServer(const std::string& socketPath, int argc, const char* argv[], int& exitCode);
+
+// Called by compilations after parsing. In server children, tells the server
+// which files were parsed, so it caches them for later compilations.
+void notifyServerParsedFiles();
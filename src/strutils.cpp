@@ -56,3 +56,45 @@ std::string trim(const std::string& s) {
     // https://stackoverflow.com/a/21815483
     return std::regex_replace(s, std::regex("^ +| +$|( ) +"), "$1");
 }
+
+bool splitArgs(const std::string& s, std::vector<std::string>& args) {
+    std::string arg;
+    bool inArg = false;
+    char quote = 0;
+    for (char c : s) {
+        if (quote) {
+            if (c == quote) quote = 0;
+            else arg += c;
+        } else if (c == '\'' || c == '"') {
+            quote = c;
+            inArg = true;
+        } else if (isspace(c)) {
+            if (inArg) args.push_back(arg);
+            arg.clear();
+            inArg = false;
+        } else {
+            arg += c;
+            inArg = true;
+        }
+    }
+    if (quote) return false;
+    if (inArg) args.push_back(arg);
+    return true;
+}
+
+std::string jsonEscape(const std::string& s) {
+    std::string res;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            res += '\\';
+            res += c;
+        } else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            res += buf;
+        } else {
+            res += c;
+        }
+    }
+    return res;
+}
@@ -19,6 +19,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 
 // String coloring
 std::string errorColored(const std::string& str);
@@ -30,3 +31,9 @@ std::string hlColored(const std::string& str);
 // String manipulation
 void replace(std::string& s, const std::string& sub, const std::string& repl);
 std::string trim(const std::string& s);
+// Splits a command line into arguments (appended to args) like a shell would,
+// honoring single and double quotes (but no escapes or expansions). Returns
+// false if a quote is not closed.
+bool splitArgs(const std::string& s, std::vector<std::string>& args);
+// Escapes s for use within a JSON string
+std::string jsonEscape(const std::string& s);
@@ -0,0 +1,168 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <sys/resource.h>
+#include <time.h>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include "log.h"
+#include "strutils.h"
+#include "timing.h"
+
+struct Phase {
+    std::string name;
+    uint32_t depth;
+    uint64_t count;
+    double wallSecs, cpuSecs;
+    uint64_t peakRssKB;
+};
+
+static bool reportEnabled = false;
+static std::string jsonFile = "";
+static std::vector<Phase> phases;  // in order of first occurrence
+static std::unordered_map<std::string, size_t> phaseIdxs;
+static std::vector<std::tuple<std::string, uint64_t>> counts;  // in order of first occurrence
+static std::mutex phasesMutex;
+static thread_local uint32_t curDepth = 0;
+
+static double getTime(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static uint64_t getPeakRssKB() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;  // KB on Linux
+}
+
+void enableTimeReport(const std::string& file) {
+    reportEnabled = true;
+    jsonFile = file;
+}
+
+bool timeReportEnabled() { return reportEnabled; }
+
+// Returns the index of the phase, creating it if needed. Must hold phasesMutex.
+static size_t getPhaseIdx(const std::string& name, uint32_t depth) {
+    std::string key = std::to_string(depth) + ":" + name;
+    auto it = phaseIdxs.find(key);
+    if (it != phaseIdxs.end()) return it->second;
+    phaseIdxs[key] = phases.size();
+    phases.push_back({name, depth, 0, 0.0, 0.0, 0});
+    return phases.size() - 1;
+}
+
+static void record(size_t idx, double wallSecs, double cpuSecs, uint64_t peakRssKB) {
+    std::lock_guard<std::mutex> lock(phasesMutex);
+    Phase& phase = phases[idx];
+    phase.count++;
+    phase.wallSecs += wallSecs;
+    phase.cpuSecs += cpuSecs;
+    phase.peakRssKB = std::max(phase.peakRssKB, peakRssKB);
+}
+
+PhaseTimer::PhaseTimer(const char* prefix, const std::string& phaseName) : enabled(reportEnabled) {
+    if (!enabled) return;
+    {
+        // Create the phase now, so phases are reported in start order
+        // (i.e., enclosing phases before the phases they contain)
+        std::lock_guard<std::mutex> lock(phasesMutex);
+        idx = getPhaseIdx(prefix + phaseName, curDepth++);
+    }
+    startWall = getTime(CLOCK_MONOTONIC);
+    startCpu = getTime(CLOCK_THREAD_CPUTIME_ID);
+}
+
+PhaseTimer::~PhaseTimer() {
+    if (!enabled) return;
+    curDepth--;
+    record(idx, getTime(CLOCK_MONOTONIC) - startWall,
+            getTime(CLOCK_THREAD_CPUTIME_ID) - startCpu, getPeakRssKB());
+}
+
+uint32_t phaseDepth() { return curDepth; }
+
+PhaseNesting::PhaseNesting(uint32_t depth) : prevDepth(curDepth) { curDepth = depth; }
+PhaseNesting::~PhaseNesting() { curDepth = prevDepth; }
+
+void recordPhase(const std::string& name, double wallSecs, double cpuSecs, uint64_t peakRssKB) {
+    if (!reportEnabled) return;
+    size_t idx;
+    {
+        std::lock_guard<std::mutex> lock(phasesMutex);
+        idx = getPhaseIdx(name, curDepth);
+    }
+    record(idx, wallSecs, cpuSecs, peakRssKB);
+}
+
+void addReportCount(const std::string& name, uint64_t n) {
+    if (!reportEnabled) return;
+    std::lock_guard<std::mutex> lock(phasesMutex);
+    for (auto& [countName, value] : counts) {
+        if (countName == name) {
+            value += n;
+            return;
+        }
+    }
+    counts.push_back(std::make_tuple(name, n));
+}
+
+void finishTimeReport() {
+    if (!reportEnabled) return;
+    std::lock_guard<std::mutex> lock(phasesMutex);
+    std::cout << "time report:\n";
+    std::cout << "  " << std::left << std::setw(48) << "phase" << std::right << std::setw(8) << "count"
+        << std::setw(12) << "wall (s)" << std::setw(12) << "cpu (s)" << std::setw(14) << "peak RSS (MB)" << "\n";
+    for (const auto& phase : phases) {
+        std::string name = std::string(2 * phase.depth, ' ') + phase.name;
+        std::cout << "  " << std::left << std::setw(48) << name << std::right << std::setw(8) << phase.count
+            << std::fixed << std::setprecision(4) << std::setw(12) << phase.wallSecs << std::setw(12) << phase.cpuSecs
+            << std::setprecision(1) << std::setw(14) << phase.peakRssKB / 1024.0 << "\n";
+    }
+    std::cout << std::defaultfloat;
+    for (const auto& [name, value] : counts)
+        std::cout << "  " << std::left << std::setw(48) << name << std::right << std::setw(8) << value << "\n";
+
+    if (jsonFile == "") return;
+    std::ofstream json(jsonFile);
+    if (!json.good()) {
+        warn("could not write time report to %s", jsonFile.c_str());
+        return;
+    }
+    json << "{\"phases\": [";
+    for (size_t i = 0; i < phases.size(); i++) {
+        const auto& phase = phases[i];
+        json << (i? ",\n  " : "\n  ") << "{\"name\": \"" << jsonEscape(phase.name) << "\", \"depth\": " << phase.depth
+            << ", \"count\": " << phase.count << ", \"wallSecs\": " << phase.wallSecs
+            << ", \"cpuSecs\": " << phase.cpuSecs << ", \"peakRssKB\": " << phase.peakRssKB << "}";
+    }
+    json << "\n], \"counts\": {";
+    for (size_t i = 0; i < counts.size(); i++) {
+        const auto& [name, value] = counts[i];
+        json << (i? ", " : "") << "\"" << jsonEscape(name) << "\": " << value;
+    }
+    json << "}}\n";
+}
@@ -0,0 +1,66 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+
+// Phase timing for --time-report. Phases nest (e.g., each parametric's
+// elaboration within its elaboration depth level), and phases with the same
+// name and nesting level are aggregated. All functions are thread-safe.
+
+void enableTimeReport(const std::string& jsonFile);
+bool timeReportEnabled();
+
+// Times the enclosing scope as phase "<prefix><name>": wall and CPU time
+// (of the calling thread), and the process's peak RSS when it ends. Does
+// nothing (and does not build the name) if the report is disabled.
+class PhaseTimer {
+    public:
+        explicit PhaseTimer(const char* prefix, const std::string& name = "");
+        ~PhaseTimer();
+    private:
+        bool enabled;
+        size_t idx;
+        double startWall, startCpu;
+};
+
+// Phases nest per thread. Worker threads doing part of another thread's phase
+// hold a PhaseNesting with that thread's phaseDepth(), so their phases nest
+// under it rather than at the top level.
+uint32_t phaseDepth();
+
+class PhaseNesting {
+    public:
+        explicit PhaseNesting(uint32_t depth);
+        ~PhaseNesting();
+    private:
+        uint32_t prevDepth;
+};
+
+// Records an externally measured phase (e.g., a subprocess) at the current
+// nesting level
+void recordPhase(const std::string& name, double wallSecs, double cpuSecs, uint64_t peakRssKB);
+
+// Adds n to a named count (e.g., cache hits) shown after the phases
+void addReportCount(const std::string& name, uint64_t n = 1);
+
+// Prints the report, and writes it as JSON if a file was given
+void finishTimeReport();
@@ -17,8 +17,17 @@
  */
 
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
 #include <iostream>
+#include <memory_resource>
+#include <mutex>
+#include <set>
+#include <thread>
 #include <unordered_set>
 #include <variant>
 #include "antlr4-runtime.h"
@@ -26,6 +35,7 @@
 #include "log.h"
 #include "parse.h"
 #include "strutils.h"
+#include "timing.h"
 #include "translate.h"
 #include "version.h"
 #include "MinispecLexer.h"
@@ -33,167 +43,414 @@
 #include "MinispecBaseListener.h"
 
 using namespace antlr4;
-using antlrcpp::Any;
 using misc::Interval;
 using std::string;
 using std::stringstream;
 
+struct ParametricUse;
+typedef const ParametricUse* ParametricUsePtr;
+class TranslatedCode;
+typedef std::shared_ptr<TranslatedCode> TranslatedCodePtr;
+class BasicError;
+typedef std::shared_ptr<BasicError> BasicErrorPtr;
+class SubErrors;
+typedef std::shared_ptr<SubErrors> SubErrorsPtr;
+
+struct Skip {};
+
+// Elaboration objects (translated code, errors, Integer data) are allocated
+// from the arenas of the current compilation, one per elaborating thread
+// (see ElabThreadScope). Arenas pool freed objects by size, so the many
+// temporaries of elaboration reuse memory. Outside of elaboration, they use
+// the default heap.
+static thread_local std::pmr::memory_resource* elabArena = std::pmr::get_default_resource();
+
+template <typename T, typename... Args>
+static std::shared_ptr<T> makeElabShared(Args&&... args) {
+    return std::allocate_shared<T>(std::pmr::polymorphic_allocator<T>(elabArena), std::forward<Args>(args)...);
+}
+
+// Elaboration value of a parse tree node: null (not elaborated), an Integer
+// or Bool, code that replaces the node (a string, parametric use, or
+// translated code), Skip (emit nothing), or elaboration errors. Values are
+// stored inline, so Integers and Bools need no heap allocations, and type
+// checks compare the variant index instead of using RTTI.
+class ElabValue {
+    public:
+        typedef std::variant<std::monostate, int64_t, bool, const char*, ParametricUsePtr,
+                TranslatedCodePtr, Skip, BasicErrorPtr, SubErrorsPtr> Variant;
+
+    private:
+        Variant value;
+
+    public:
+        ElabValue() {}
+        ElabValue(std::nullptr_t) {}
+        ElabValue(int64_t v) : value(v) {}
+        ElabValue(int v) : value((int64_t) v) {}  // int literals are Integers too
+        ElabValue(bool v) : value(v) {}
+        ElabValue(const char* v) : value(v) {}
+        ElabValue(ParametricUsePtr v) : value(v) {}
+        ElabValue(const TranslatedCodePtr& v) : value(v) {}
+        ElabValue(Skip v) : value(v) {}
+        ElabValue(const BasicErrorPtr& v) : value(v) {}
+        ElabValue(const SubErrorsPtr& v) : value(v) {}
+        template <typename T> ElabValue(T*) = delete;  // would silently become a bool
+
+        bool isNull() const { return std::holds_alternative<std::monostate>(value); }
+        template <typename T> bool is() const { return std::holds_alternative<T>(value); }
+        template <typename T> const T& as() const { return std::get<T>(value); }
+
+        // Calls vis with the stored value (std::monostate if null)
+        template <typename Visitor> decltype(auto) visit(Visitor&& vis) const {
+            return std::visit(std::forward<Visitor>(vis), value);
+        }
+};
+
+// Parametric uses are hash-consed: each distinct (name, escape, params)
+// combination is interned and exists exactly once, so ParametricUsePtrs can
+// be compared and hashed by address, and params compare shallowly (nested
+// uses are interned too). Interned uses are immutable, and are owned by the
+// ParametricUseTable of the translateFiles() call that interned them: they
+// are destroyed when it returns, so they must not be kept across calls
+// (e.g., by libminispec or msc --server, which compile repeatedly).
 struct ParametricUse {
-    std::string name;
-    bool escape;
-    std::vector<Any> params; // Each param may be an int64_t or a ParametricUsePtr
-
-    bool operator==(const ParametricUse& other) const {
-        if (name != other.name) return false;
-        if (params.size() != other.params.size()) return false;
-        for (uint32_t i = 0; i < params.size(); i++) {
-            Any p1 = params[i];
-            Any p2 = other.params[i];
-            if (p1.is<int64_t>()) {
-                if (!p2.is<int64_t>()) return false;
-                if (p1.as<int64_t>() != p2.as<int64_t>()) return false;
-            } else {
-                assert(p1.is<std::shared_ptr<ParametricUse>>());
-                if (!p2.is<std::shared_ptr<ParametricUse>>()) return false;
-                if (!(*p1.as<std::shared_ptr<ParametricUse>>() == *p2.as<std::shared_ptr<ParametricUse>>())) return false;
+    const std::string name;
+    const bool escape;
+    const std::vector<ElabValue> params; // Each param may be an int64_t or a ParametricUsePtr
+    const uint64_t hash;
+
+    // Returns the unique interned use with these fields
+    static ParametricUsePtr get(const std::string& name, bool escape, std::vector<ElabValue>&& params);
+
+    // Bluespec name, escaped if needed (e.g., \add#(8) ) unless the use is
+    // nested in an already-escaped name. Computed once, on interning.
+    const std::string& str(bool alreadyEscaped = false) const { return strs[alreadyEscaped]; }
+
+    private:
+        std::string strs[2];
+
+        ParametricUse(const std::string& name, bool escape, std::vector<ElabValue>&& params, uint64_t hash) :
+            name(name), escape(escape), params(std::move(params)), hash(hash)
+        {
+            for (bool alreadyEscaped : {false, true}) {
+                std::stringstream ss;
+                bool shouldEscape = escape && !alreadyEscaped;
+                if (shouldEscape) ss << "\\";
+                ss << name;
+                if (this->params.size()) ss << "#(";
+                for (size_t i = 0; i < this->params.size(); i++) {
+                    const ElabValue& p = this->params[i];
+                    if (p.is<int64_t>()) ss << p.as<int64_t>();
+                    else ss << p.as<ParametricUsePtr>()->str(alreadyEscaped || shouldEscape);
+                    ss << ((i == this->params.size() - 1)? ")" : ",");
+                }
+                if (shouldEscape) ss << " ";
+                strs[alreadyEscaped] = ss.str();
             }
         }
-        return true;
-    }
 
-    std::string str(bool alreadyEscaped = false) const {
-        std::stringstream ss;
-        bool shouldEscape = escape && !alreadyEscaped;
-        if (shouldEscape) {
-            ss << "\\";
-            alreadyEscaped = true;
-        }
-        ss << name;
-        if (params.size()) ss << "#(";
-        for (size_t i = 0; i < params.size(); i++) {
-            Any p = params[i];
-            if (p.is<int64_t>()) ss << p.as<int64_t>();
-            else ss << p.as<std::shared_ptr<ParametricUse>>()->str(alreadyEscaped);
-            ss << ((i == params.size() - 1)? ")" : ",");
-        }
-        if (shouldEscape) ss << " ";
-        return ss.str();
-    }
+        bool sameFields(const std::string& n, bool e, const std::vector<ElabValue>& ps) const {
+            if (escape != e || name != n || params.size() != ps.size()) return false;
+            for (size_t i = 0; i < params.size(); i++) {
+                const ElabValue& p1 = params[i];
+                const ElabValue& p2 = ps[i];
+                if (p1.is<int64_t>()) {
+                    if (!p2.is<int64_t>() || p1.as<int64_t>() != p2.as<int64_t>()) return false;
+                } else {
+                    if (!p2.is<ParametricUsePtr>() || p1.as<ParametricUsePtr>() != p2.as<ParametricUsePtr>()) return false;
+                }
+            }
+            return true;
+        }
 };
 
-typedef std::shared_ptr<ParametricUse> ParametricUsePtr;
+// splitmix64 finalizer; mixes all input bits into all output bits
+static inline uint64_t mixHash(uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    x ^= x >> 31;
+    return x;
+}
+
+// Interned parametric uses of a translateFiles() call. They are allocated
+// from an arena of its compilation, and destroyed along with the table.
+struct ParametricUseTable {
+    std::unordered_multimap<uint64_t, ParametricUse*> uses;
+    std::pmr::memory_resource* const arena;
+    std::mutex mutex;  // for parallel elaboration
+
+    ParametricUseTable(std::pmr::memory_resource* arena) : arena(arena) {}
+    ~ParametricUseTable() { for (auto& [hash, pu] : uses) pu->~ParametricUse(); }
+};
+static thread_local ParametricUseTable* parametricUses = nullptr;
+
+ParametricUsePtr ParametricUse::get(const std::string& name, bool escape, std::vector<ElabValue>&& params) {
+    uint64_t h = mixHash(std::hash<std::string>()(name) + escape);
+    for (const ElabValue& p : params) {
+        assert(p.is<int64_t>() || p.is<ParametricUsePtr>());
+        // Tag Integers and types differently so Foo#(n) and Foo#(T) never alias
+        uint64_t ph = p.is<int64_t>()? mixHash(p.as<int64_t>()) : ~p.as<ParametricUsePtr>()->hash;
+        h = mixHash(h ^ (ph + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2)));
+    }
+
+    assert(parametricUses);
+    ParametricUseTable& table = *parametricUses;
+    std::lock_guard<std::mutex> lock(table.mutex);
+    auto range = table.uses.equal_range(h);
+    for (auto it = range.first; it != range.second; it++) {
+        if (it->second->sameFields(name, escape, params)) return it->second;
+    }
+    void* buf = table.arena->allocate(sizeof(ParametricUse), alignof(ParametricUse));
+    auto pu = new (buf) ParametricUse(name, escape, std::move(params), h);
+    table.uses.insert({h, pu});
+    return pu;
+}
 
 class Elaborator;
 typedef std::unordered_map<std::string, std::vector<ParserRuleContext*>> ParametricsMap;
 
-namespace std {
-    template<> struct hash<ParametricUse> {
-        size_t operator()(const ParametricUse& pu) const noexcept {
-            std::hash<std::string> strHash;
-            size_t res = strHash(pu.name);
-            for (Any p : pu.params) {
-                size_t h;
-                if (p.is<int64_t>()) h = (size_t) p.as<int64_t>();
-                else h = operator()(*p.as<ParametricUsePtr>());
-                res = ((res << 63) | (res >> 1)) ^ h;
-            }
-            return res;
-        }
+typedef std::function<ElabValue(tree::ParseTree*)> GetValueFn;
+
+SourceMap::SourceMap(std::vector<SrcEntry>&& srcs, std::vector<InfoEntry>&& infos,
+        std::string&& code, const std::string& topModule) :
+    srcs(std::move(srcs)), infos(std::move(infos)), code(std::move(code)), topModule(topModule)
+{
+    // Sort by range, keeping only the last-inserted entry of each range
+    auto sortAndDedup = [](auto& entries) {
+        std::stable_sort(entries.begin(), entries.end(),
+                [](const auto& e1, const auto& e2) { return e1.range < e2.range; });
+        size_t n = 0;
+        for (size_t i = 0; i < entries.size(); i++) {
+            if (i + 1 < entries.size() && entries[i].range == entries[i + 1].range) continue;
+            entries[n++] = entries[i];
+        }
+        entries.resize(n);
+        entries.shrink_to_fit();
     };
+    sortAndDedup(this->srcs);
+    sortAndDedup(this->infos);
+
+    if (!this->infos.empty()) {
+        infoMaxEnd.resize(4 * this->infos.size());
+        buildInfoIndex(1, 0, this->infos.size());
+    }
+
+    lineToPos.push_back(0);
+    for (size_t p = 0; p < this->code.size(); p++) {
+        if (this->code[p] == '\n') lineToPos.push_back(p + 1);
+    }
 }
 
-typedef std::function<Any(tree::ParseTree*)> GetValueFn;
+ssize_t SourceMap::buildInfoIndex(size_t node, size_t lo, size_t hi) {
+    if (hi - lo == 1) return infoMaxEnd[node] = std::get<1>(infos[lo].range);
+    size_t mid = (lo + hi) / 2;
+    ssize_t l = buildInfoIndex(2 * node, lo, mid);
+    ssize_t r = buildInfoIndex(2 * node + 1, mid, hi);
+    return infoMaxEnd[node] = std::max(l, r);
+}
 
-struct Skip {};
+// Appends the infos in [lo, min(hi, limit)) whose range ends at or after pos,
+// in order. Since infos are sorted by start, limit excludes those that start
+// after pos.
+void SourceMap::findInfos(size_t node, size_t lo, size_t hi, size_t limit, ssize_t pos,
+        std::vector<const std::string*>& res) const {
+    if (lo >= limit || infoMaxEnd[node] < pos) return;
+    if (hi - lo == 1) {
+        res.push_back(infos[lo].info);
+        return;
+    }
+    size_t mid = (lo + hi) / 2;
+    findInfos(2 * node, lo, mid, limit, pos, res);
+    findInfos(2 * node + 1, mid, hi, limit, pos, res);
+}
 
-class TranslatedCode;
-typedef std::shared_ptr<TranslatedCode> TranslatedCodePtr;
+tree::ParseTree* SourceMap::find(size_t line, size_t lineChar) const {
+    ssize_t pos = getPos(line, lineChar);
+    Range range = std::make_tuple(pos, pos);
+    auto it = std::lower_bound(srcs.begin(), srcs.end(), range,
+            [](const SrcEntry& e, const Range& r) { return e.range < r; });
+    if (it == srcs.end()) return nullptr;
+    if (std::get<0>(it->range) != pos) return nullptr;
+    return it->ctx;
+}
+
+tree::ParseTree* SourceMap::find(size_t line, size_t lineChar, std::string_view sv) const {
+    ssize_t pos = getPos(line, lineChar);
+    Range range = std::make_tuple(pos, pos + sv.size());
+    auto it = std::lower_bound(srcs.begin(), srcs.end(), range,
+            [](const SrcEntry& e, const Range& r) { return e.range < r; });
+    if (it == srcs.end() || it->range != range) return nullptr;
+    if (getCode().substr(pos, sv.size()) != sv) return nullptr;
+    return it->ctx;
+}
+
+std::string SourceMap::getContextInfo(size_t line, size_t lineChar) const {
+    if (infos.empty()) return "";
+    ssize_t pos = getPos(line, lineChar);
+    // Only infos that start at or before pos can include it
+    size_t limit = std::upper_bound(infos.begin(), infos.end(), pos,
+            [](ssize_t p, const InfoEntry& e) { return p < std::get<0>(e.range); }) - infos.begin();
+    std::vector<const std::string*> res;
+    findInfos(1, 0, infos.size(), limit, pos, res);
+    std::stringstream ss;
+    for (auto info : res) ss << "In " << *info << "\n";
+    return ss.str();
+}
+
+// Compilation being translated (see ElabThreadScope)
+static thread_local Compilation* elabCompilation = nullptr;
+
+// Context infos repeat a lot (e.g., all uses of a parametric instance), so
+// they are interned in the compilation, which outlives its source maps
+static const std::string* internContextInfo(const std::string& info) {
+    assert(elabCompilation);
+    return elabCompilation->intern(info);
+}
 
 class TranslatedCode {
     private:
         GetValueFn getValue;
         const bool skipSpaces;
+        const bool textOnly;  // if set, do not track source map data or parametric uses
 
+        // Code is stored as a rope: our own text, plus references to the
+        // codes merged into ours, so nested merges never copy code. Source
+        // map ranges are relative to the start of this code, and become
+        // absolute only in getSourceMap(). Merged codes must not change.
         typedef SourceMap::Range Range;
-        std::map<Range, tree::ParseTree*> dstToSrc;
-        std::map<Range, std::string> dstToInfo;
-        std::stringstream code;
+        struct RangeEntry {
+            Range range;
+            tree::ParseTree* ctx;
+            const std::string* info;  // interned, nullptr if none
+        };
+        struct MergeEntry {
+            TranslatedCodePtr code;
+            size_t textPos;  // position in our text where it was merged
+        };
+
+    public:
+        typedef std::tuple<ParametricUsePtr, tree::ParseTree*> ParametricUseInfo;
+
+    private:
+        // Ranges, merges, and parametric uses, in emission order (this
+        // order determines which range wins when several map to the same
+        // destination, and the order of parametric uses)
+        typedef std::variant<RangeEntry, MergeEntry, ParametricUseInfo> Entry;
+        std::vector<Entry> entries;
+        size_t firstPendingUse = 0;  // uses in earlier entries were dequeued
+        std::string text;
+        ssize_t length = 0;  // including merged codes
         std::vector<std::tuple<tree::ParseTree*, ssize_t>> emitStack;
 
-        typedef std::tuple<ParametricUse, tree::ParseTree*> ParametricUseInfo;
-        std::vector<ParametricUseInfo> parametricUsesEmitted;
+        ssize_t pos() const { return length; }
+
+        void append(std::string_view sv) {
+            text.append(sv);
+            length += sv.size();
+        }
+
+        // Appends our code, and our ranges (unless srcs and infos are null)
+        void materialize(std::string& code, std::vector<SourceMap::SrcEntry>* srcs,
+                std::vector<SourceMap::InfoEntry>* infos) const {
+            ssize_t base = code.size();
+            size_t textPos = 0;
+            for (const Entry& entry : entries) {
+                if (auto re = std::get_if<RangeEntry>(&entry)) {
+                    if (!srcs) continue;
+                    auto& [start, end] = re->range;
+                    Range range = std::make_tuple(start + base, end + base);
+                    srcs->push_back({range, re->ctx});
+                    if (re->info) infos->push_back({range, re->info});
+                } else if (auto me = std::get_if<MergeEntry>(&entry)) {
+                    code.append(text, textPos, me->textPos - textPos);
+                    textPos = me->textPos;
+                    me->code->materialize(code, srcs, infos);
+                }
+            }
+            code.append(text, textPos, std::string::npos);
+            assert((ssize_t) code.size() == base + length);
+        }
 
-        ssize_t pos() {
-            ssize_t wrPos = code.tellp();  // returns -1 if empty
-            return (wrPos == -1)? 0 : wrPos;
+        void collectUses(size_t firstEntry, std::vector<ParametricUseInfo>& uses) const {
+            for (size_t i = firstEntry; i < entries.size(); i++) {
+                if (auto pui = std::get_if<ParametricUseInfo>(&entries[i])) {
+                    uses.push_back(*pui);
+                } else if (auto me = std::get_if<MergeEntry>(&entries[i])) {
+                    me->code->collectUses(me->code->firstPendingUse, uses);
+                }
+            }
         }
 
     public:
-        TranslatedCode(GetValueFn getValue, bool skipSpaces = false)
-            : getValue(getValue), skipSpaces(skipSpaces) {}
+        TranslatedCode(GetValueFn getValue, bool skipSpaces = false, bool textOnly = false)
+            : getValue(getValue), skipSpaces(skipSpaces), textOnly(textOnly) {}
 
         // Build SourceMap data from ctx, emitting all children and (1)
         // patching with elaborated values, (2) integrating internally
         // elaborated sourcemaps.
         void emit(tree::ParseTree* ctx) {
             if (!ctx) return;
-            ParserRuleContext* prCtx = dynamic_cast<ParserRuleContext*>(ctx);
             emitStart(ctx);
-            Any value = getValue(ctx);
-            if (value.is<int64_t>()) {
-                code << value.as<int64_t>();
-            } else if (value.is<bool>()) {
-                code << (value.as<bool>()? "True" : "False");
-            } else if (value.is<const char*>()) {
-                code << value.as<const char*>();
-            } else if (value.is<ParametricUsePtr>()) {
-                auto v = value.as<ParametricUsePtr>();
-                emit(v->str());
-                parametricUsesEmitted.push_back(std::make_tuple(*v, ctx));
-            } else if (value.is<Skip>()) {
-                // Emit nothing
-            } else if (value.is<TranslatedCodePtr>()) {
-                const TranslatedCode& tc = *value.as<TranslatedCodePtr>();
-                assert(tc.emitStack.empty());
-                // Merge with ours
-                ssize_t offset = pos();
-                for (const auto& [range, srcCtx] : tc.dstToSrc) {
-                    auto& [start, end] = range;
-                    dstToSrc[std::make_tuple(start + offset, end + offset)] = srcCtx;
-                }
-                for (const auto& [range, info] : tc.dstToInfo) {
-                    auto& [start, end] = range;
-                    dstToInfo[std::make_tuple(start + offset, end + offset)] = info;
-                }
-                for (const auto& pui : tc.parametricUsesEmitted) {
-                    parametricUsesEmitted.push_back(pui);
-                }
-                code << tc.code.str();
-            } else if (prCtx) {
-                auto tokenStream = getTokenStream(prCtx);
-                for (uint32_t i = 0; i < prCtx->children.size(); i++) {
-                    // Print inter-ctx whitespace
-                    if (!skipSpaces && i > 0) {
-                        Interval prev = prCtx->children[i-1]->getSourceInterval();
-                        Interval cur = prCtx->children[i]->getSourceInterval();
-                        if (prev.b + 1 < cur.a) {
-                            std::string s = tokenStream->getText(Interval(prev.b + 1, cur.a -1));
-                            // bsc treats tabs as multiple spaces, so avoid tabs altogether
-                            replace(s, "\t", " ");
-                            code << s;
-                        }
-                    }
-                    emit(ctx->children[i]);
+            getValue(ctx).visit([&](const auto& value) {
+                typedef std::decay_t<decltype(value)> T;
+                if constexpr (std::is_same_v<T, int64_t>) {
+                    append(std::to_string(value));
+                } else if constexpr (std::is_same_v<T, bool>) {
+                    append(value? "True" : "False");
+                } else if constexpr (std::is_same_v<T, const char*>) {
+                    append(value);
+                } else if constexpr (std::is_same_v<T, ParametricUsePtr>) {
+                    append(value->str());
+                    if (!textOnly) entries.push_back(std::make_tuple(value, ctx));
+                } else if constexpr (std::is_same_v<T, Skip>) {
+                    // Emit nothing
+                } else if constexpr (std::is_same_v<T, TranslatedCodePtr>) {
+                    emit(value);
+                } else {
+                    // Not elaborated (or elaboration errors): emit the source
+                    emitChildren(ctx);
                 }
-            } else {
+            });
+            emitEnd();
+        }
+
+        void emitChildren(tree::ParseTree* ctx) {
+            ParserRuleContext* prCtx = dynamic_cast<ParserRuleContext*>(ctx);
+            if (!prCtx) {
                 emit(ctx->getText());
+                return;
             }
-            emitEnd();
+            auto tokenStream = getTokenStream(prCtx);
+            for (uint32_t i = 0; i < prCtx->children.size(); i++) {
+                // Print inter-ctx whitespace
+                if (!skipSpaces && i > 0) {
+                    Interval prev = prCtx->children[i-1]->getSourceInterval();
+                    Interval cur = prCtx->children[i]->getSourceInterval();
+                    if (prev.b + 1 < cur.a) {
+                        std::string s = tokenStream->getText(Interval(prev.b + 1, cur.a -1));
+                        // bsc treats tabs as multiple spaces, so avoid tabs altogether
+                        replace(s, "\t", " ");
+                        append(s);
+                    }
+                }
+                emit(ctx->children[i]);
+            }
+        }
+
+        // Merge a separately translated piece of code (and its source map)
+        // with ours. tc is referenced, not copied, so it must not change.
+        void emit(const TranslatedCodePtr& tc) {
+            assert(tc->emitStack.empty());
+            entries.push_back(MergeEntry{tc, text.size()});
+            length += tc->length;
         }
 
         // Templated emit() for text or text + parse trees
         void emit(std::string_view sv) {
-            code << sv;
+            append(sv);
         }
 
         // emit() is templated to take in any number of arguments, which
@@ -221,10 +478,12 @@ class TranslatedCode {
         template<typename... Args> void emitLine(Args... args) { emit(args...); emitLine(); }
 
         void emitStart(tree::ParseTree* ctx) {
+            if (textOnly) return;
             emitStack.push_back(std::make_tuple(ctx, pos()));
         }
 
         void emitEnd(const std::string& ctxInfo = "") {
+            if (textOnly) return;
             assert(!emitStack.empty());
             auto [ctx, startPos] = emitStack.back();
             emitStack.pop_back();
@@ -232,18 +491,36 @@ class TranslatedCode {
             ssize_t endPos = pos();
             if (startPos == endPos) return;
 
-            Range range = std::make_tuple(startPos, endPos);
-            dstToSrc[range] = ctx;
-            if (ctxInfo != "") dstToInfo[range] = ctxInfo;
+            entries.push_back(RangeEntry{std::make_tuple(startPos, endPos), ctx,
+                    (ctxInfo != "")? internContextInfo(ctxInfo) : nullptr});
         }
 
         SourceMap getSourceMap(const std::string& simModule = "") const {
-            return SourceMap(dstToSrc, dstToInfo, code.str(), simModule);
+            std::string code;
+            code.reserve(length);
+            std::vector<SourceMap::SrcEntry> srcs;
+            std::vector<SourceMap::InfoEntry> infos;
+            materialize(code, &srcs, &infos);
+            return SourceMap(std::move(srcs), std::move(infos), std::move(code), simModule);
+        }
+
+        // Length of the code emitted so far (including merged codes)
+        size_t size() const { return length; }
+
+        // Returns the code only, without building a SourceMap
+        std::string getCode() const {
+            std::string code;
+            code.reserve(length);
+            materialize(code, nullptr, nullptr);
+            return code;
         }
 
+        // Returns the parametric uses emitted (including those in merged
+        // codes) since the last call
         std::vector<ParametricUseInfo> dequeueParametricUsesEmitted() {
-            std::vector<ParametricUseInfo> res = std::move(parametricUsesEmitted);
-            parametricUsesEmitted.clear();  // needed, move-assignment leaves src container in unspecified state (jeez STL...)
+            std::vector<ParametricUseInfo> res;
+            collectUses(firstPendingUse, res);
+            firstPendingUse = entries.size();
             return res;
         }
 };
@@ -292,6 +569,15 @@ class IntegerContext {
             enterImmutableLevel();
         }
 
+        // Deep copy (copies share IntegerData otherwise), so parallel
+        // elaborators can each work on their own context
+        IntegerContext clone() const {
+            IntegerContext res(*this);
+            for (auto& level : res.levels)
+                for (auto& [name, data] : level.integers) data = makeElabShared<IntegerData>(*data);
+            return res;
+        }
+
         // Packages, modules
         void enterImmutableLevel() { levels.push_back({{}, {}, {}, false, false, false}); }
         // Functions, methods, begin/end blocks, for loops
@@ -308,7 +594,7 @@ class IntegerContext {
             if (curLevel.nonIntegers.count(name)) return false;
             if (curLevel.integers.find(name) != curLevel.integers.end()) return false;
             if (isInteger) {
-                auto idPtr = std::make_shared<IntegerData>();
+                auto idPtr = makeElabShared<IntegerData>();
                 idPtr->state = INVALID;
                 curLevel.integers[name] = idPtr;
             } else {
@@ -349,7 +635,7 @@ class IntegerContext {
 
             if (poisoningLevel) {
                 idPtr->state = POISONED;
-                idPtr = std::make_shared<IntegerData>();
+                idPtr = makeElabShared<IntegerData>();
                 poisoningLevel->integers[name] = idPtr;
             }
             *idPtr = {VALID, value};
@@ -402,6 +688,206 @@ int64_t parseUnsizedLiteral(MinispecParser::IntLiteralContext *ctx) {
     }
 }
 
+// Compiled Integer/Bool expressions. Loops re-evaluate their condition and
+// update expressions, and the right-hand sides of Integer assignments in
+// their bodies, on every iteration; when these consist only of unsized
+// literals, Integer variables, and operators, they are compiled once to
+// stack code and evaluated without walking (and clearing) their parse trees.
+// Evaluation mirrors the elaborator's operator semantics, and bails out on
+// anything it cannot produce a value for (e.g., a poisoned variable or a
+// type error), so the caller can walk the expression to report the error.
+class IntegerExprCode {
+    private:
+        enum OpCode : uint8_t { PUSH_INT, PUSH_BOOL, LOAD, BINOP, UNOP };
+        enum Op : uint8_t {
+            ADD, SUB, MUL, DIV, MOD, POW, SHL, SHR, AND, OR, XOR, XNOR,
+            LT, LE, GT, GE, EQ, NE, LAND, LOR,  // binary
+            NOT, NEG, PLUS, LNOT, RAND, RNAND, ROR, RNOR, RXOR, RXNOR  // unary
+        };
+        struct Instr {
+            OpCode opc;
+            Op op;
+            int64_t imm;  // PUSH_INT/PUSH_BOOL value, LOAD variable index
+        };
+        struct Value {
+            int64_t v;
+            bool isBool;
+        };
+
+        std::vector<Instr> code;
+        std::vector<std::string> vars;
+        mutable std::vector<Value> stack;
+
+        static bool getOp(const std::string& s, bool unary, Op& op) {
+            static const std::unordered_map<std::string, Op> binops = {
+                {"+", ADD}, {"-", SUB}, {"*", MUL}, {"/", DIV}, {"%", MOD}, {"**", POW},
+                {"<<", SHL}, {">>", SHR}, {"&", AND}, {"|", OR}, {"^", XOR}, {"^~", XNOR}, {"~^", XNOR},
+                {"<", LT}, {"<=", LE}, {">", GT}, {">=", GE}, {"==", EQ}, {"!=", NE},
+                {"&&", LAND}, {"||", LOR},
+            };
+            static const std::unordered_map<std::string, Op> unops = {
+                {"~", NOT}, {"-", NEG}, {"+", PLUS}, {"!", LNOT}, {"&", RAND}, {"~&", RNAND},
+                {"|", ROR}, {"~|", RNOR}, {"^", RXOR}, {"^~", RXNOR}, {"~^", RXNOR},
+            };
+            auto& ops = unary? unops : binops;
+            auto it = ops.find(s);
+            if (it == ops.end()) return false;
+            op = it->second;
+            return true;
+        }
+
+        void emit(OpCode opc, Op op = ADD, int64_t imm = 0) { code.push_back({opc, op, imm}); }
+
+        bool compile(MinispecParser::ExpressionContext* ctx) {
+            auto opCtx = dynamic_cast<MinispecParser::OperatorExprContext*>(ctx);
+            return opCtx && compile(opCtx->binopExpr());
+        }
+
+        bool compile(MinispecParser::BinopExprContext* ctx) {
+            if (ctx->unopExpr()) return compile(ctx->unopExpr());
+            Op op;
+            if (!getOp(ctx->op->getText(), false, op)) return false;
+            if (!compile(ctx->left) || !compile(ctx->right)) return false;
+            emit(BINOP, op);
+            return true;
+        }
+
+        bool compile(MinispecParser::UnopExprContext* ctx) {
+            if (!compile(ctx->exprPrimary())) return false;
+            if (ctx->op) {
+                Op op;
+                if (!getOp(ctx->op->getText(), true, op)) return false;
+                emit(UNOP, op);
+            }
+            return true;
+        }
+
+        bool compile(MinispecParser::ExprPrimaryContext* ctx) {
+            if (auto parenCtx = dynamic_cast<MinispecParser::ParenExprContext*>(ctx)) {
+                return compile(parenCtx->expression());
+            } else if (auto litCtx = dynamic_cast<MinispecParser::IntLiteralContext*>(ctx)) {
+                if (!isUnsizedLiteral(litCtx)) return false;
+                emit(PUSH_INT, ADD, parseUnsizedLiteral(litCtx));
+                return true;
+            } else if (auto varCtx = dynamic_cast<MinispecParser::VarExprContext*>(ctx)) {
+                if (varCtx->params()) return false;
+                auto varName = varCtx->var->getText();
+                if (varName == "True" || varName == "False") {
+                    emit(PUSH_BOOL, ADD, varName == "True");
+                } else {
+                    emit(LOAD, ADD, vars.size());
+                    vars.push_back(varName);
+                }
+                return true;
+            }
+            return false;
+        }
+
+        static bool evalBinop(Op op, Value l, Value r, Value& res) {
+            if (l.isBool != r.isBool) return false;
+            if (l.isBool) {
+                if (op == LAND) res = {l.v && r.v, true};
+                else if (op == LOR) res = {l.v || r.v, true};
+                else return false;
+                return true;
+            }
+            int64_t a = l.v;
+            int64_t b = r.v;
+            switch (op) {
+                case ADD: res = {a + b, false}; break;
+                case SUB: res = {a - b, false}; break;
+                case MUL: res = {a * b, false}; break;
+                case DIV: res = {b? (a / b) : 0, false}; break;
+                case MOD: res = {b? (a % b) : 0, false}; break;
+                case POW: {
+                    int64_t e = 1;
+                    while (b-- > 0) e *= a;
+                    res = {e, false};
+                    break;
+                }
+                case SHL: res = {a << b, false}; break;
+                case SHR: res = {a >> b, false}; break;
+                case AND: res = {a & b, false}; break;
+                case OR: res = {a | b, false}; break;
+                case XOR: res = {a ^ b, false}; break;
+                case XNOR: res = {~a ^ b, false}; break;
+                case LT: res = {a < b, true}; break;
+                case LE: res = {a <= b, true}; break;
+                case GT: res = {a > b, true}; break;
+                case GE: res = {a >= b, true}; break;
+                case EQ: res = {a == b, true}; break;
+                case NE: res = {a != b, true}; break;
+                default: return false;
+            }
+            return true;
+        }
+
+        static bool evalUnop(Op op, Value v, Value& res) {
+            if (v.isBool) {
+                if (op != LNOT) return false;
+                res = {!v.v, true};
+                return true;
+            }
+            int64_t a = v.v;
+            switch (op) {
+                case NOT: res = {~a, false}; break;
+                case NEG: res = {-a, false}; break;
+                case PLUS: res = {a, false}; break;
+                case RAND: res = {a == -1, false}; break;
+                case RNAND: res = {a != -1, false}; break;
+                case ROR: res = {a != 0, false}; break;
+                case RNOR: res = {a == 0, false}; break;
+                case RXOR: res = {__builtin_parityl(a), false}; break;
+                case RXNOR: res = {__builtin_parityl(a) == 0, false}; break;
+                default: return false;
+            }
+            return true;
+        }
+
+    public:
+        // Returns false (and leaves the code empty) if ctx is not compilable
+        bool compileExpr(MinispecParser::ExpressionContext* ctx) {
+            if (compile(ctx)) return true;
+            code.clear();
+            vars.clear();
+            return false;
+        }
+
+        // Variables (and True/False-like identifiers) the expression reads
+        const std::vector<std::string>& getVars() const { return vars; }
+
+        // Returns false if the code is empty or evaluation failed
+        bool eval(const IntegerContext& ic, ElabValue& res) const {
+            if (code.empty()) return false;
+            stack.clear();
+            for (const Instr& instr : code) {
+                switch (instr.opc) {
+                    case PUSH_INT: stack.push_back({instr.imm, false}); break;
+                    case PUSH_BOOL: stack.push_back({instr.imm, true}); break;
+                    case LOAD: {
+                        IntegerContext::IntegerData integerData;
+                        if (!ic.get(vars[instr.imm], integerData) || integerData.state != IntegerContext::VALID) return false;
+                        stack.push_back({integerData.value, false});
+                        break;
+                    }
+                    case BINOP: {
+                        Value r = stack.back();
+                        stack.pop_back();
+                        if (!evalBinop(instr.op, stack.back(), r, stack.back())) return false;
+                        break;
+                    }
+                    case UNOP:
+                        if (!evalUnop(instr.op, stack.back(), stack.back())) return false;
+                        break;
+                }
+            }
+            assert(stack.size() == 1);
+            Value v = stack.back();
+            res = v.isBool? ElabValue((bool) v.v) : ElabValue(v.v);
+            return true;
+        }
+};
+
 // Helper for post-parse error messages
 std::string quote(ParserRuleContext* ctx) {
     assert(ctx);
@@ -438,18 +924,14 @@ class BasicError : public SemanticError {
             return ss.str();
         }
 
-        static Any create(ParserRuleContext* ctx, const std::string& msg) {
-            return std::make_shared<BasicError>(ctx, msg);
+        static ElabValue create(ParserRuleContext* ctx, const std::string& msg) {
+            return makeElabShared<BasicError>(ctx, msg);
         }
 
         friend class SubErrors;
         friend class ElabError;
 };
 
-typedef std::shared_ptr<BasicError> BasicErrorPtr;
-class SubErrors;
-typedef std::shared_ptr<SubErrors> SubErrorsPtr;
-
 class SubErrors : public SemanticError {
     private:
         std::vector<BasicErrorPtr> errors;
@@ -457,14 +939,14 @@ class SubErrors : public SemanticError {
     public:
         SubErrors() {}
 
-        static Any create(Any val) {
+        static ElabValue create(ElabValue val) {
             if (val.is<SubErrorsPtr>()) return val;
             if (val.is<BasicErrorPtr>()) return val;
             return nullptr;
         }
 
-        static Any create(Any left, Any right) {
-            SubErrorsPtr res = std::make_shared<SubErrors>();
+        static ElabValue create(ElabValue left, ElabValue right) {
+            SubErrorsPtr res = makeElabShared<SubErrors>();
 
             if (left.is<SubErrorsPtr>()) for (auto e : left.as<SubErrorsPtr>()->errors) res->errors.push_back(e);
             else if (left.is<BasicErrorPtr>()) res->errors.push_back(left.as<BasicErrorPtr>());
@@ -477,9 +959,9 @@ class SubErrors : public SemanticError {
             else return res;
         }
 
-        static SubErrorsPtr wrap(Any val) {
-            if (val.is<SubErrorsPtr>()) return val;
-            SubErrorsPtr res = std::make_shared<SubErrors>();
+        static SubErrorsPtr wrap(ElabValue val) {
+            if (val.is<SubErrorsPtr>()) return val.as<SubErrorsPtr>();
+            SubErrorsPtr res = makeElabShared<SubErrors>();
             if (val.is<BasicErrorPtr>()) res->errors.push_back(val.as<BasicErrorPtr>());
             return res;
         }
@@ -503,7 +985,7 @@ class ElabError : public SemanticError {
         SubErrorsPtr subErrors;
         const char* msg;
     public:
-        ElabError(ParserRuleContext* ctx, Any exprVal, const char* msg = nullptr)
+        ElabError(ParserRuleContext* ctx, ElabValue exprVal, const char* msg = nullptr)
             : ctx(ctx), subErrors(SubErrors::wrap(exprVal)), msg(msg) {}
 
         ParserRuleContext* getCtx() const override { return ctx; }
@@ -528,35 +1010,58 @@ struct ForElabStep {
     MinispecParser::ForStmtContext* ctx;
     int64_t indVar;
 };
-typedef std::variant<ParametricUse, ForElabStep> ElabStep;
-static std::array<ElabStep, 16> elabStepBuf;
-static uint64_t numElabSteps = 0;
-static uint64_t maxElabSteps = 50000;
-static uint64_t maxElabDepth = 1000;
-
-void setElabLimits(uint64_t maxSteps, uint64_t maxDepth) {
-    maxElabSteps = maxSteps;
-    maxElabDepth = maxDepth;
-}
+typedef std::variant<ParametricUsePtr, ForElabStep> ElabStep;
+
+// Elaboration steps of a translateFiles() call, and their limits
+struct ElabSteps {
+    const uint64_t maxSteps;
+    const uint64_t maxDepth;
+    std::array<ElabStep, 16> buf;  // last steps
+    uint64_t num = 0;
+
+    ElabSteps(uint64_t maxSteps, uint64_t maxDepth) : maxSteps(maxSteps), maxDepth(maxDepth) {}
+};
+static thread_local ElabSteps* elabSteps = nullptr;
+
+// Steps a parallel elaboration worker takes on one parametric, each with the
+// number of reports deferred before it. Workers only log steps; they are
+// registered in serial order once workers finish, so limits trigger at the
+// same step, and with the same reports, as in serial elaboration.
+struct ElabStepLog {
+    std::vector<std::tuple<ElabStep, size_t>> steps;
+    const DeferredReports* reports;
+    uint64_t maxSteps;  // serial elaboration always stops before exceeding this
+    bool exceeded = false;
+};
+static thread_local ElabStepLog* elabStepLog = nullptr;
+struct ElabStepLogFull {};
 
 void registerElabStep(ElabStep es, uint64_t depth = 0) {
-    elabStepBuf[numElabSteps++ % elabStepBuf.size()] = es;
+    if (elabStepLog) {
+        elabStepLog->steps.push_back(std::make_tuple(es, elabStepLog->reports->size()));
+        if (elabStepLog->steps.size() > elabStepLog->maxSteps) throw ElabStepLogFull();
+        return;
+    }
+    assert(elabSteps);
+    ElabSteps& steps = *elabSteps;
+    steps.buf[steps.num++ % steps.buf.size()] = es;
     bool error = false;
+    std::ostream& out = currentReporter().out;
     // FIXME: Use error formatting helpers...
-    if (maxElabSteps && numElabSteps > maxElabSteps) {
+    if (steps.maxSteps && steps.num > steps.maxSteps) {
         error = true;
-        std::cout << errorColored("error: ") << "exceeded maximum number of elaboration steps (" << maxElabSteps << "). The design may have a non-terminating loop or sequence of parametric functions, modules, or types. Fix the design to avoid non-termination, or increase the maximum number of elaboration steps (with --max-elab-steps) if the design is correct.";
-    } else if (maxElabDepth && depth > maxElabDepth) {
+        out << errorColored("error: ") << "exceeded maximum number of elaboration steps (" << steps.maxSteps << "). The design may have a non-terminating loop or sequence of parametric functions, modules, or types. Fix the design to avoid non-termination, or increase the maximum number of elaboration steps (with --max-elab-steps) if the design is correct.";
+    } else if (steps.maxDepth && depth > steps.maxDepth) {
         error = true;
-        std::cout << errorColored("error: ") << "exceeded maximum elaboration depth (" << maxElabDepth << "). The design may have a non-terminating recursion of parametric functions, modules, or types. Fix the design to avoid non-termination, or increase the maximum elaboration depth (with --max-elab-depth) if the design is correct.";
+        out << errorColored("error: ") << "exceeded maximum elaboration depth (" << steps.maxDepth << "). The design may have a non-terminating recursion of parametric functions, modules, or types. Fix the design to avoid non-termination, or increase the maximum elaboration depth (with --max-elab-depth) if the design is correct.";
     }
     if (error) {
-        std::cout << "The last elaboration steps are:\n";
-        for (size_t i = 0; i < std::min(elabStepBuf.size(), numElabSteps); i++) {
-            auto elabStep = elabStepBuf[(numElabSteps - 1 - i) % elabStepBuf.size()];
+        out << "The last elaboration steps are:\n";
+        for (size_t i = 0; i < std::min(steps.buf.size(), steps.num); i++) {
+            auto elabStep = steps.buf[(steps.num - 1 - i) % steps.buf.size()];
             std::string stepStr;
-            if (std::holds_alternative<ParametricUse>(elabStep)) {
-                stepStr = std::get<ParametricUse>(elabStep).str(/*alreadyEscaped=*/true);
+            if (std::holds_alternative<ParametricUsePtr>(elabStep)) {
+                stepStr = std::get<ParametricUsePtr>(elabStep)->str(/*alreadyEscaped=*/true);
             } else {
                 auto forElabStep = std::get<ForElabStep>(elabStep);
                 std::stringstream ss;
@@ -564,10 +1069,146 @@ void registerElabStep(ElabStep es, uint64_t depth = 0) {
                 ss << ", iteration " << forElabStep.ctx->initVar->getText() << " = " << forElabStep.indVar;
                 stepStr = ss.str();
             }
-            info("    %12s: %s", hlColored(std::to_string(numElabSteps - i)).c_str(), stepStr.c_str());
+            out << "    " << std::setw(12) << hlColored(std::to_string(steps.num - i)) << ": " << stepStr << "\n";
+        }
+        out.flush();
+        fatalExit(-1);
+    }
+}
+
+// State of a translateFiles() call that its elaborating threads (the calling
+// thread and parallel elaboration workers) need. Each thread sets it during
+// an ElabThreadScope, with its own arena.
+struct ElabThreadState {
+    Compilation* compilation;
+    std::pmr::memory_resource* arena;
+    ParametricUseTable* parametricUses;
+    ElabSteps* steps;
+    Reporter* reporter;
+    bool throwFatalErrors;
+};
+
+class ElabThreadScope {
+    private:
+        Compilation* prevCompilation;
+        std::pmr::memory_resource* prevArena;
+        ParametricUseTable* prevParametricUses;
+        ElabSteps* prevSteps;
+        ReporterScope reporterScope;
+        ThrowFatalErrors throwFatalErrors;
+
+    public:
+        ElabThreadScope(const ElabThreadState& state) :
+            prevCompilation(elabCompilation), prevArena(elabArena),
+            prevParametricUses(parametricUses), prevSteps(elabSteps),
+            reporterScope(state.reporter), throwFatalErrors(state.throwFatalErrors)
+        {
+            elabCompilation = state.compilation;
+            elabArena = state.arena;
+            parametricUses = state.parametricUses;
+            elabSteps = state.steps;
+        }
+
+        ~ElabThreadScope() {
+            elabCompilation = prevCompilation;
+            elabArena = prevArena;
+            parametricUses = prevParametricUses;
+            elabSteps = prevSteps;
         }
-        exit(-1);
+};
+
+// Elaboration trace. Records the span of each elaboration step in Chrome's
+// trace-event format (viewable in Perfetto or chrome://tracing). Events only
+// hold pointers while elaborating; names and locations are produced when
+// translation finishes (parametric uses and parse trees may be gone by the
+// time the trace is written), or when the trace is written on errors.
+struct ElabTraceEvent {
+    ElabStep step;
+    tree::ParseTree* ctx;  // use of the parametric, or for loop
+    uint64_t elabDepth;  // parametrics only
+    uint32_t nesting;  // enclosing traced steps
+    uint32_t tid;  // elaborating thread
+    std::chrono::steady_clock::time_point start, end;
+    size_t codeSize;
+    bool ended;
+    std::string name, cat, loc;  // set by resolveElabTrace()
+};
+static std::string elabTraceFile = "";
+static std::vector<ElabTraceEvent> elabTraceEvents;
+static size_t elabTraceResolved = 0;  // events before this one are resolved
+static std::mutex elabTraceMutex;
+static std::atomic<uint32_t> elabTraceThreads(0);
+static thread_local uint32_t elabTraceNesting = 0;
+static thread_local uint32_t elabTraceTid = elabTraceThreads++;
+
+void enableElabTrace(const std::string& fileName) {
+    elabTraceFile = fileName;
+}
+
+// Returns an id to pass to endElabTrace
+static size_t beginElabTrace(ElabStep es, tree::ParseTree* ctx, uint64_t elabDepth = 0) {
+    if (elabTraceFile.empty()) return 0;
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(elabTraceMutex);
+    elabTraceEvents.push_back({es, ctx, elabDepth, elabTraceNesting++, elabTraceTid, now, now, 0, false});
+    return elabTraceEvents.size() - 1;
+}
+
+static void endElabTrace(size_t id, size_t codeSize) {
+    if (elabTraceFile.empty()) return;
+    auto now = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> lock(elabTraceMutex);
+    auto& event = elabTraceEvents[id];
+    event.end = now;
+    event.codeSize = codeSize;
+    event.ended = true;
+    elabTraceNesting--;
+}
+
+// Must be called with elabTraceMutex held
+static void resolveElabTrace() {
+    for (; elabTraceResolved < elabTraceEvents.size(); elabTraceResolved++) {
+        auto& event = elabTraceEvents[elabTraceResolved];
+        if (std::holds_alternative<ParametricUsePtr>(event.step)) {
+            event.name = std::get<ParametricUsePtr>(event.step)->str(/*alreadyEscaped=*/true);
+            event.cat = "parametric";
+        } else {
+            auto forElabStep = std::get<ForElabStep>(event.step);
+            event.name = "for " + forElabStep.ctx->initVar->getText() + " = " + std::to_string(forElabStep.indVar);
+            event.cat = "for";
+        }
+        event.loc = event.ctx? getLoc(event.ctx) : "command-line arg";
+    }
+}
+
+void writeElabTrace() {
+    if (elabTraceFile.empty()) return;
+    std::lock_guard<std::mutex> lock(elabTraceMutex);
+    resolveElabTrace();
+    std::ofstream traceStream(elabTraceFile);
+    if (!traceStream.good()) {
+        warn("could not write elaboration trace to %s", elabTraceFile.c_str());
+        return;
     }
+    // Steps still running (e.g., on elaboration errors) end now
+    auto now = std::chrono::steady_clock::now();
+    auto base = elabTraceEvents.empty()? now : elabTraceEvents[0].start;
+    auto usecs = [&](std::chrono::steady_clock::duration d) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+    };
+    traceStream << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [";
+    for (size_t i = 0; i < elabTraceEvents.size(); i++) {
+        const auto& event = elabTraceEvents[i];
+        traceStream << (i? ",\n  " : "\n  ") << "{\"name\": \"" << jsonEscape(event.name) << "\", \"cat\": \"" << event.cat
+            << "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << event.tid + 1 << ", \"ts\": " << usecs(event.start - base)
+            << ", \"dur\": " << usecs((event.ended? event.end : now) - event.start)
+            << ", \"args\": {\"loc\": \"" << jsonEscape(event.loc) << "\", \"nesting\": " << event.nesting;
+        if (event.cat == "parametric") traceStream << ", \"elabDepth\": " << event.elabDepth;
+        if (event.ended) traceStream << ", \"codeSize\": " << event.codeSize;
+        else traceStream << ", \"unfinished\": true";
+        traceStream << "}}";
+    }
+    traceStream << "\n]}\n";
 }
 
 // Keywords to check against. bsc checks against SystemVerilog keywords, but we'd get epic error messages if a BSV keyword was used as an identifier in Minispec...
@@ -575,119 +1216,241 @@ const std::unordered_set<std::string> svKeywords = {"alias", "always", "always_c
 
 const std::unordered_set<std::string> bsvKeywords = {"action", "endaction", "actionvalue", "endactionvalue", "ancestor", "deriving", "endinstance", "let", "match", "method", "endmethod", "par", "endpar", "powered_by", "provisos", "rule", "endrule", "rules", "endrules", "seq", "endseq", "schedule", "typeclass", "endtypeclass", "clock", "reset", "noreset", "no_reset", "valueof", "valueOf", "clocked_by", "reset_by", "default_clock", "default_reset", "output_clock", "output_reset", "input_clock", "input_reset", "same_family"};
 
+// Returns why a lowercase identifier is forbidden (empty if it is allowed)
+static std::vector<std::string> forbiddenIdentifierReasons(const std::string& id) {
+    std::vector<std::string> reasons;
+    if (id.find("mk") == 0) reasons.push_back("begins with " + hlColored("'mk'"));
+    if (id.find("___input") != -1ul) reasons.push_back("contains " + hlColored("'___input'"));
+    if (svKeywords.count(id)) reasons.push_back("is a SystemVerilog keyword");
+    if (bsvKeywords.count(id)) reasons.push_back("is a Bluespec (BSV) keyword");
+    return reasons;
+}
+
 class ElaboratorParseTreeWalker : public tree::ParseTreeWalker {
+    private:
+        // Stop the walk on nodes of certain types (the elaborator will
+        // walk subtrees manually). This is needed when the translated code
+        // doesn't follow the same structure as the original code. Uses rule
+        // indexes, as the elaborator walks subtrees many times and RTTI
+        // checks on every node add up.
+        static bool stopsWalk(MinispecRuleContext* ctx) {
+            switch (ctx->getRuleIndex()) {
+                case MinispecParser::RulePackageDef:
+                case MinispecParser::RuleModuleDef:
+                case MinispecParser::RuleForStmt:
+                case MinispecParser::RuleIfStmt:
+                case MinispecParser::RuleCaseStmt:
+                    return true;
+                default:
+                    return false;
+            }
+        }
+
     public:
+        // Same traversal as tree::ParseTreeWalker, without its per-node casts.
+        // There are no error nodes, since parsing stops on syntax errors.
         virtual void walk(tree::ParseTreeListener* listener, tree::ParseTree* t) const override {
-            // Stop the walk on nodes of certain types (the elaborator will
-            // walk subtrees manually). This is needed when the translated code
-            // doesn't follow the same structure as the original code.
-            bool stop = dynamic_cast<MinispecParser::PackageDefContext*>(t) ||
-                dynamic_cast<MinispecParser::ModuleDefContext*>(t) ||
-                dynamic_cast<MinispecParser::ForStmtContext*>(t) ||
-                dynamic_cast<MinispecParser::IfStmtContext*>(t) ||
-                dynamic_cast<MinispecParser::CaseStmtContext*>(t);
-            if (stop) {
-                enterRule(listener, t);
-                exitRule(listener, t);
-            } else {
-                tree::ParseTreeWalker::walk(listener, t);
+            auto ctx = asRuleContext(t);
+            if (!ctx) {
+                listener->visitTerminal(static_cast<tree::TerminalNode*>(t));
+                return;
             }
+            listener->enterEveryRule(ctx);
+            ctx->enterRule(listener);
+            if (!stopsWalk(ctx)) {
+                for (auto child : ctx->children) walk(listener, child);
+            }
+            ctx->exitRule(listener);
+            listener->exitEveryRule(ctx);
         }
 };
 
 static const ElaboratorParseTreeWalker elaboratorWalker;
 
+// Elaboration values of parse tree nodes, kept in flat arrays indexed by
+// node id (see parsetree.h). Elaboration often clears the values of a
+// subtree to re-elaborate it (e.g., on every loop iteration), so instead of
+// erasing values, each cleared subtree becomes a clear scope with an epoch.
+// A node's value is valid only if it was set no earlier than the epoch of
+// its innermost enclosing scope. Clearing a subtree bumps the epochs of its
+// scope and the scopes nested in it; only the first clear of each subtree
+// walks its nodes (to create the scope).
+class ElabValues {
+    private:
+        struct ClearScope {
+            uint32_t firstId;
+            uint32_t lastId;
+            uint32_t parent;
+            uint64_t epoch;
+            std::vector<uint32_t> children;
+        };
+
+        std::vector<ElabValue> values;
+        std::vector<uint64_t> setEpochs;  // epoch when each value was set
+        std::vector<uint32_t> nodeScopes;  // innermost scope of each node
+        std::vector<uint32_t> rootScopes;  // scope rooted at each node (0 if none)
+        std::vector<ClearScope> scopes;  // scopes[0] spans all nodes, never cleared
+        uint64_t epoch = 1;
+
+        // Terminal nodes are not numbered, and very few have values. They
+        // belong to their parent's scope.
+        std::unordered_map<tree::ParseTree*, std::tuple<ElabValue, uint64_t>> terminalValues;
+
+        bool isValid(uint32_t id, uint64_t setEpoch) const {
+            return setEpoch >= scopes[nodeScopes[id]].epoch;
+        }
+
+        uint32_t getId(MinispecRuleContext* ctx) const {
+            assert(ctx->nodeId && ctx->nodeId < values.size());
+            return ctx->nodeId;
+        }
+
+        void bumpEpoch(uint32_t scope) {
+            scopes[scope].epoch = epoch;
+            for (auto child : scopes[scope].children) bumpEpoch(child);
+        }
+
+    public:
+        ElabValues(uint32_t nodeIdBound) :
+            values(nodeIdBound), setEpochs(nodeIdBound, 0), nodeScopes(nodeIdBound, 0), rootScopes(nodeIdBound, 0) {
+            scopes.push_back({0, nodeIdBound, 0, epoch, {}});
+        }
+
+        ElabValue get(MinispecRuleContext* ctx) const {
+            uint32_t id = ctx->nodeId;
+            return (id && isValid(id, setEpochs[id]))? values[id] : ElabValue(nullptr);
+        }
+
+        ElabValue get(tree::ParseTree* pt) const {
+            if (auto ctx = asRuleContext(pt)) return get(ctx);
+            auto it = terminalValues.find(pt);
+            if (it == terminalValues.end()) return ElabValue(nullptr);
+            auto& [value, setEpoch] = it->second;
+            auto parent = pt->parent? asRuleContext(pt->parent) : nullptr;
+            return (parent && isValid(getId(parent), setEpoch))? value : ElabValue(nullptr);
+        }
+
+        void set(MinispecRuleContext* ctx, const ElabValue& value) {
+            uint32_t id = getId(ctx);
+            values[id] = value;
+            setEpochs[id] = epoch;
+        }
+
+        void set(tree::ParseTree* pt, const ElabValue& value) {
+            if (auto ctx = asRuleContext(pt)) return set(ctx, value);
+            terminalValues[pt] = std::make_tuple(value, epoch);
+        }
+
+        void clear(tree::ParseTree* pt) {
+            auto ctx = asRuleContext(pt);
+            if (!ctx) {
+                terminalValues.erase(pt);
+                return;
+            }
+            uint32_t id = getId(ctx);
+            uint32_t scope = rootScopes[id];
+            if (!scope) {
+                // First clear of this subtree: create its scope, and move
+                // the scopes and nodes of the enclosing scope into it
+                uint32_t parent = nodeScopes[id];
+                scope = scopes.size();
+                scopes.push_back({id, ctx->lastNodeId, parent, 0, {}});
+                auto& siblings = scopes[parent].children;
+                for (auto it = siblings.begin(); it != siblings.end(); ) {
+                    if (scopes[*it].firstId >= id && scopes[*it].lastId <= ctx->lastNodeId) {
+                        scopes[*it].parent = scope;
+                        scopes[scope].children.push_back(*it);
+                        it = siblings.erase(it);
+                    } else {
+                        it++;
+                    }
+                }
+                siblings.push_back(scope);
+                for (uint32_t i = id; i <= ctx->lastNodeId; i++)
+                    if (nodeScopes[i] == parent) nodeScopes[i] = scope;
+                rootScopes[id] = scope;
+            }
+            epoch++;
+            bumpEpoch(scope);
+        }
+};
+
 class Elaborator : public MinispecBaseListener {
     private:
         IntegerContext& ic;
         ParametricsMap& parametrics;
         const std::unordered_set<std::string>& localTypeNames;
         const ParametricUsePtr topLevelParametric;  // to elaborate function wrapper
-        std::unordered_set<ParametricUse> parametricsEmitted;
+        const std::unordered_set<tree::ParseTree*>* reachableStmts;  // if non-null, skip all other package stmts
+        std::unordered_set<ParametricUsePtr> parametricsEmitted;
 
-        std::unordered_map<tree::ParseTree*, Any> elabValues;
+        ElabValues elabValues;
         std::unordered_set<std::string> submoduleNames;
 
         void report(const SemanticError& error) {
             reportErr(error.str(), "", error.getCtx());
         }
 
+        bool escapeName(const std::string& name) const {
+            return islower(name[0]) || localTypeNames.count(name);
+        }
+
+        // Appends the elaborated value of param p (reports an error if it's
+        // not an Integer or a type)
+        void pushParam(MinispecParser::ParamContext* p, std::vector<ElabValue>& params) {
+            ElabValue val = getValue(p);
+            if (p->intParam) {
+                if (val.is<int64_t>()) {
+                    params.push_back(val);
+                } else {
+                    report(ElabError(p->intParam, nullptr));
+                }
+            } else {
+                if (val.is<ParametricUsePtr>()) {
+                    params.push_back(val);
+                } else {
+                    assert(val.isNull());
+                    params.push_back(createParametricUsePtr(p->type()->name->getText(), p->type()->params()));
+                }
+            }
+        }
+
     public:
-        ParametricUsePtr createParametricUsePtr(const std::string& name, MinispecParser::ParamsContext* params) {
-            auto res = std::make_shared<ParametricUse>();
-            res->name = name;
-            res->escape = islower(name[0]) || localTypeNames.count(name);
+        std::vector<ElabValue> getParamValues(MinispecParser::ParamsContext* params) {
+            std::vector<ElabValue> res;
             if (params) {
-                for (auto p : params->param()) {
-                    if (p->intParam) {
-                        Any val = getValue(p);
-                        if (val.is<int64_t>()) {
-                            res->params.push_back(val);
-                        } else {
-                            report(ElabError(p->intParam, res));
-                        }
-                    } else {
-                        Any val = getValue(p);
-                        if (val.is<ParametricUsePtr>()) {
-                            res->params.push_back(val);
-                        } else {
-                            assert(val.isNull());
-                            auto pu = createParametricUsePtr(p->type()->name->getText(), p->type()->params());
-                            res->params.push_back(pu);
-                        }
-                    }
-                }
+                for (auto p : params->param()) pushParam(p, res);
             }
             return res;
         }
 
+        ParametricUsePtr createParametricUsePtr(const std::string& name, MinispecParser::ParamsContext* params) {
+            return ParametricUse::get(name, escapeName(name), getParamValues(params));
+        }
+
         // For ELABORATED paramFormals (so we can use the same types for parametric uses and emitted parametrics)
         ParametricUsePtr createParametricUsePtr(const std::string& name, MinispecParser::ParamFormalsContext* paramFormals) {
-            auto res = std::make_shared<ParametricUse>();
-            res->name = name;
-            res->escape = islower(name[0]) || localTypeNames.count(name);
+            std::vector<ElabValue> params;
             if (paramFormals) {
                 checkElaboratedParams(paramFormals);
                 for (auto pf : paramFormals->paramFormal()) {
-                    Any val = getValue(pf);
+                    ElabValue val = getValue(pf);
                     if (val.is<int64_t>() || val.is<ParametricUsePtr>()) {
-                        res->params.push_back(val);
+                        params.push_back(val);
                     } else {
-                        auto p = pf->param();
-                        assert(p);
-                        // FIXME: Dedup with above
-                        if (p->intParam) {
-                            Any val = getValue(p);
-                            if (val.is<int64_t>()) {
-                                res->params.push_back(val);
-                            } else {
-                                report(ElabError(p->intParam, res));
-                            }
-                        } else {
-                            Any val = getValue(p);
-                            if (val.is<ParametricUsePtr>()) {
-                                res->params.push_back(val);
-                            } else {
-                                assert(val.isNull());
-                                auto pu = createParametricUsePtr(p->type()->name->getText(), p->type()->params());
-                                res->params.push_back(pu);
-                            }
-                        }
+                        assert(pf->param());
+                        pushParam(pf->param(), params);
                     }
                 }
             }
-            return res;
+            return ParametricUse::get(name, escapeName(name), std::move(params));
         }
 
-        Any getValue(tree::ParseTree* ctx) const {
-            auto it = elabValues.find(ctx);
-            return (it != elabValues.end())? it->second : Any(nullptr);
-        }
+        ElabValue getValue(MinispecRuleContext* ctx) const { return elabValues.get(ctx); }
+        ElabValue getValue(tree::ParseTree* ctx) const { return elabValues.get(ctx); }
     private:
-        void setValue(tree::ParseTree* ctx, const Any& value) {
-            if (value.isNull() && elabValues.find(ctx) == elabValues.end()) return;
-            elabValues[ctx] = value;
-        }
+        void setValue(MinispecRuleContext* ctx, const ElabValue& value) { elabValues.set(ctx, value); }
+        void setValue(tree::ParseTree* ctx, const ElabValue& value) { elabValues.set(ctx, value); }
 
         int64_t getIntegerValue(MinispecParser::ExpressionContext* ctx) {
             assert(ctx);
@@ -702,10 +1465,19 @@ class Elaborator : public MinispecBaseListener {
         }
 
         TranslatedCodePtr createTranslatedCodePtr(bool skipSpaces = false) {
-            return std::make_shared<TranslatedCode>(
+            return makeElabShared<TranslatedCode>(
                     [&](tree::ParseTree* ctx) { return getValue(ctx); }, skipSpaces);
         }
 
+        // Renders the elaborated code of a small fragment (e.g., a type),
+        // skipping source map construction
+        std::string renderCode(tree::ParseTree* ctx) {
+            TranslatedCode tc([this](tree::ParseTree* ctx) { return getValue(ctx); },
+                    /*skipSpaces=*/false, /*textOnly=*/true);
+            tc.emit(ctx);
+            return tc.getCode();
+        }
+
         void checkElaboratedParams(ParserRuleContext* ctx) {
             class SubListener : public MinispecBaseListener {
                 public:
@@ -744,7 +1516,7 @@ class Elaborator : public MinispecBaseListener {
         bool isConcrete(MinispecParser::ParamFormalsContext* ctx) {
             bool res = true;
             for (auto paramFormal : ctx->paramFormal()) {
-                Any val = getValue(paramFormal);
+                ElabValue val = getValue(paramFormal);
                 if ((paramFormal->intName && !val.is<int64_t>()) ||
                         (paramFormal->typeName && !val.is<ParametricUsePtr>())) {
                     res = false;
@@ -754,15 +1526,78 @@ class Elaborator : public MinispecBaseListener {
             return res;
         }
 
-    public:
-        void clearValues(tree::ParseTree* tree) {
-            auto it = elabValues.find(tree);
-            if (it != elabValues.end()) elabValues.erase(it);
+        // A statement of a for loop body. Integer assignments and
+        // declarations whose right-hand sides compile to IntegerExprCode are
+        // evaluated directly on each iteration, without walking them; other
+        // statements (and those whose evaluation fails, e.g., to report
+        // errors) are walked. Statements with forbidden identifiers are
+        // always walked, so their errors are reported on every iteration.
+        struct LoopStmt {
+            MinispecParser::StmtContext* stmt;
+            ParserRuleContext* compiledCtx;  // varAssign or varBinding, nullptr if walked
+            bool isDecl;
+            std::vector<std::string> vars;  // assigned or declared variables
+            std::vector<MinispecParser::ExpressionContext*> rhss;  // may be nullptr in declarations
+            std::vector<IntegerExprCode> codes;
+        };
+        std::vector<int64_t> loopStmtValues;  // scratch space for evalLoopStmt
+
+        static LoopStmt compileLoopStmt(MinispecParser::StmtContext* stmt) {
+            LoopStmt walked = {stmt, nullptr, false, {}, {}, {}};
+            LoopStmt res = walked;
+            auto addVar = [&](const std::string& var, MinispecParser::ExpressionContext* rhs) {
+                IntegerExprCode code;
+                if (!forbiddenIdentifierReasons(var).empty()) return false;
+                if (rhs && !code.compileExpr(rhs)) return false;
+                for (const auto& v : code.getVars()) {
+                    if (!forbiddenIdentifierReasons(v).empty()) return false;
+                }
+                res.vars.push_back(var);
+                res.rhss.push_back(rhs);
+                res.codes.push_back(std::move(code));
+                return true;
+            };
+            if (auto varAssign = stmt->varAssign()) {
+                auto simpleLvalue = dynamic_cast<MinispecParser::SimpleLvalueContext*>(varAssign->var);
+                if (!simpleLvalue || !addVar(simpleLvalue->getText(), varAssign->expression())) return walked;
+                res.compiledCtx = varAssign;
+            } else if (auto varBinding = dynamic_cast<MinispecParser::VarBindingContext*>(stmt->varDecl())) {
+                auto type = varBinding->type();
+                if (type->name->getText() != "Integer" || type->params()) return walked;
+                for (auto varInit : varBinding->varInit()) {
+                    if (!addVar(varInit->var->getText(), varInit->rhs)) return walked;
+                }
+                res.compiledCtx = varBinding;
+                res.isDecl = true;
+            }
+            return res;
+        }
 
-            auto ctx = dynamic_cast<ParserRuleContext*>(tree);
-            if (ctx) for (auto child : ctx->children) clearValues(child);
+        // Same effects as exitVarAssign/exitVarBinding on the statement.
+        // Returns false (with no effects) if the statement must be walked.
+        bool evalLoopStmt(const LoopStmt& ls) {
+            if (!ls.compiledCtx) return false;
+            if (!ls.isDecl && !ic.isInteger(ls.vars[0])) return false;  // not an Integer assignment
+            // Right-hand sides are evaluated before declaring any variables
+            auto& values = loopStmtValues;
+            values.resize(ls.vars.size());
+            for (size_t i = 0; i < ls.vars.size(); i++) {
+                if (!ls.rhss[i]) continue;
+                ElabValue res;
+                if (!ls.codes[i].eval(ic, res) || !res.is<int64_t>()) return false;
+                values[i] = res.as<int64_t>();
+            }
+            for (size_t i = 0; i < ls.vars.size(); i++) {
+                if (ls.isDecl) ic.defineVar(ls.vars[i], true);
+                if (ls.rhss[i]) ic.set(ls.vars[i], values[i]);
+            }
+            setValue(ls.compiledCtx, Skip());
+            return true;
         }
 
+    public:
+        void clearValues(tree::ParseTree* tree) { elabValues.clear(tree); }
+
     public:
         // Context level control
         //void enterModuleDef(MinispecParser::ModuleDefContext* ctx) override { ic.enterImmutableLevel(); }
@@ -804,7 +1639,7 @@ class Elaborator : public MinispecBaseListener {
         void exitLetBinding(MinispecParser::LetBindingContext* ctx) override {
             // Try to see if it's an Integer expression, and deduce the variable as Integer if so
             if (ctx->rhs) {
-                Any value = getValue(ctx->rhs);
+                ElabValue value = getValue(ctx->rhs);
                 if (value.is<int64_t>()) {
                     if (ctx->lowerCaseIdentifier().size() != 1) {
                         report(BasicError(ctx, "cannot assign an Integer value to multiple variables with unknown types"));
@@ -839,7 +1674,7 @@ class Elaborator : public MinispecBaseListener {
                 // because we set it when elaborating each instance
                 if (ic.get(ctx->intName->getText(), id)) {
                     assert(id.state == IntegerContext::VALID);
-                    setValue(ctx, Any(id.value));
+                    setValue(ctx, ElabValue(id.value));
                 }
             } else if (ctx->typeName) {
                 // TODO: Type substitution??
@@ -909,7 +1744,7 @@ class Elaborator : public MinispecBaseListener {
                     if (hasMember) report(BasicError(memberLvalue, "cannot set the input of a submodule's submodule"));
                     if (ic.isInMethod()) report(BasicError(memberLvalue, "a method cannot set the input of a submodule"));
 
-                    TranslatedCodePtr tc = std::make_shared<TranslatedCode>(
+                    TranslatedCodePtr tc = makeElabShared<TranslatedCode>(
                             [&](tree::ParseTree* ctx) { return getValue(ctx); });
                     tc->emitStart(ctx);
                     tc->emitStart(memberLvalue);
@@ -938,7 +1773,7 @@ class Elaborator : public MinispecBaseListener {
                 // Handle Integer elaboration
                 IntegerContext::IntegerData integerData;
                 auto varName = ctx->var->getText();
-                Any res;
+                ElabValue res;
                 if (varName == "True") {
                     res = true;
                 } else if (varName == "False") {
@@ -974,7 +1809,7 @@ class Elaborator : public MinispecBaseListener {
             // First, evaluate the condition
             elaboratorWalker.walk(this, ctx->expression());
             // If we know the condition at elab time, emit only the taken branch
-            Any condValue = getValue(ctx->expression());
+            ElabValue condValue = getValue(ctx->expression());
             bool hasElse = ctx->stmt().size() == 2;
             if (condValue.is<bool>()) {
                 bool cond = condValue.as<bool>();
@@ -1016,7 +1851,7 @@ class Elaborator : public MinispecBaseListener {
             // statically-determined case statements that contain Integer
             // assignments, rather than poisoning those assignments.
             elaboratorWalker.walk(this, ctx->expression());
-            Any exprValue = getValue(ctx->expression());
+            ElabValue exprValue = getValue(ctx->expression());
             if (exprValue.is<bool>() || exprValue.is<int64_t>()) {
                 MinispecParser::StmtContext* matchedStmt = nullptr;
                 bool hasVariableItemExprs = false;
@@ -1024,7 +1859,7 @@ class Elaborator : public MinispecBaseListener {
                     bool match = false;
                     for (auto c : item->expression()) {
                         elaboratorWalker.walk(this, c);
-                        Any cValue = getValue(c);
+                        ElabValue cValue = getValue(c);
                         match =
                             (cValue.is<int64_t>() && exprValue.is<int64_t>() &&
                              cValue.as<int64_t>() == exprValue.as<int64_t>()) ||
@@ -1099,7 +1934,7 @@ class Elaborator : public MinispecBaseListener {
             auto condExpr = ctx->expression()[1];
             auto updateExpr = ctx->expression()[2];
             elaboratorWalker.walk(this, initExpr);
-            Any indVar = getValue(initExpr);
+            ElabValue indVar = getValue(initExpr);
             if (!indVar.is<int64_t>()) {
                 report(ElabError(initExpr, indVar));
                 ic.exitLevel();
@@ -1108,13 +1943,48 @@ class Elaborator : public MinispecBaseListener {
             ic.defineVar(varName, true);
             ic.set(varName, indVar.as<int64_t>());
 
+            // The condition and update are re-evaluated every iteration, so
+            // compile them if possible. If they can't be compiled or their
+            // evaluation fails, walk them (e.g., to report errors).
+            IntegerExprCode condCode, updateCode;
+            condCode.compileExpr(condExpr);
+            updateCode.compileExpr(updateExpr);
+            auto elabLoopExpr = [&](const IntegerExprCode& code, MinispecParser::ExpressionContext* expr) {
+                ElabValue res;
+                if (code.eval(ic, res)) return res;
+                clearValues(expr);
+                elaboratorWalker.walk(this, expr);
+                return getValue(expr);
+            };
+
+            // Only walk the body statements that are not compiled (walking
+            // the body's begin/end block enters a mutable level)
+            auto blockCtx = ctx->stmt()->beginEndBlock();
+            std::vector<LoopStmt> bodyStmts;
+            if (blockCtx) {
+                for (auto stmt : blockCtx->stmt()) bodyStmts.push_back(compileLoopStmt(stmt));
+            } else {
+                bodyStmts.push_back(compileLoopStmt(ctx->stmt()));
+            }
+            bool hasCompiledStmts = std::any_of(bodyStmts.begin(), bodyStmts.end(),
+                    [](const LoopStmt& ls) { return ls.compiledCtx != nullptr; });
+            auto elabBody = [&]() {
+                if (!hasCompiledStmts) {
+                    elaboratorWalker.walk(this, ctx->stmt());
+                    return;
+                }
+                if (blockCtx) ic.enterMutableLevel();
+                for (const auto& ls : bodyStmts) {
+                    if (!evalLoopStmt(ls)) elaboratorWalker.walk(this, ls.stmt);
+                }
+                if (blockCtx) ic.exitLevel();
+            };
+
             auto tc = createTranslatedCodePtr();
             tc->emitStart(ctx);
             tc->emit("/* for loop */");
             while (true) {
-                clearValues(condExpr);
-                elaboratorWalker.walk(this, condExpr);
-                Any condVar = getValue(condExpr);
+                ElabValue condVar = elabLoopExpr(condCode, condExpr);
                 if (!condVar.is<bool>()) {
                     report(ElabError(condExpr, indVar, "could not elaborate Boolean expression (make sure this is a comparison involving only Integers)"));
                     ic.exitLevel();
@@ -1128,18 +1998,19 @@ class Elaborator : public MinispecBaseListener {
                 }
 
                 registerElabStep(ForElabStep({ctx, indVar.as<int64_t>()}));
+                size_t traceId = beginElabTrace(ForElabStep({ctx, indVar.as<int64_t>()}), ctx);
+                size_t startSize = tc->size();
                 clearValues(ctx->stmt());
-                elaboratorWalker.walk(this, ctx->stmt());
+                elabBody();
                 tc->emitStart(ctx->stmt());
                 tc->emit("begin ", ctx->stmt(), " end");
                 tc->emitLine();
                 tc->emitEnd("for loop in " + hlColored(getLoc(ctx)) +
                         ", iteration with " + noteColored(varName +
                             " = " + std::to_string(indVar.as<int64_t>())));
+                endElabTrace(traceId, tc->size() - startSize);
 
-                clearValues(updateExpr);
-                elaboratorWalker.walk(this, updateExpr);
-                indVar = getValue(updateExpr);
+                indVar = elabLoopExpr(updateCode, updateExpr);
                 if (!indVar.is<int64_t>()) {
                     report(ElabError(updateExpr, indVar));
                     ic.exitLevel();
@@ -1162,9 +2033,9 @@ class Elaborator : public MinispecBaseListener {
                 return;
             }
             std::string op = ctx->op->getText();
-            Any left = getValue(ctx->left);
-            Any right = getValue(ctx->right);
-            Any res;
+            ElabValue left = getValue(ctx->left);
+            ElabValue right = getValue(ctx->right);
+            ElabValue res;
             if (left.is<int64_t>() && right.is<int64_t>()) {
                 int64_t l = left.as<int64_t>();
                 int64_t r = right.as<int64_t>();
@@ -1215,8 +2086,8 @@ class Elaborator : public MinispecBaseListener {
             }
             auto xorReduce = [](int64_t v) -> int64_t { return __builtin_parityl(v); };
             std::string op = ctx->op->getText();
-            Any value = getValue(ctx->exprPrimary());
-            Any res;
+            ElabValue value = getValue(ctx->exprPrimary());
+            ElabValue res;
             if (value.is<int64_t>()) {
                 int64_t v = value.as<int64_t>();
                 if (op == "~") res = ~v;
@@ -1242,11 +2113,11 @@ class Elaborator : public MinispecBaseListener {
         }
 
         void exitCondExpr(MinispecParser::CondExprContext *ctx) override {
-            Any predValue = getValue(ctx->pred);
-            Any res;
+            ElabValue predValue = getValue(ctx->pred);
+            ElabValue res;
             if (predValue.is<bool>()) {
                 auto takenCtx = ctx->expression()[predValue.as<bool>()? 1 : 2];
-                Any takenValue = getValue(takenCtx);
+                ElabValue takenValue = getValue(takenCtx);
                 if (takenValue.is<int64_t>() || takenValue.is<bool>()) {
                     // Use elaborated value directly
                     res = takenValue;
@@ -1272,7 +2143,7 @@ class Elaborator : public MinispecBaseListener {
             // If we can determine the right item at compile-time, substitute
             // the whole case-expression with it. This allows elaborating
             // Integer case expressions
-            Any exprValue = getValue(ctx->expression());
+            ElabValue exprValue = getValue(ctx->expression());
             if (exprValue.is<bool>() || exprValue.is<int64_t>()) {
                 MinispecParser::ExpressionContext* matchedBody = nullptr;
                 MinispecParser::ExpressionContext* defaultBody = nullptr;
@@ -1280,7 +2151,7 @@ class Elaborator : public MinispecBaseListener {
                 for (auto item : ctx->caseExprItem()) {
                     bool match = false;
                     for (auto c : item->exprPrimary()) {
-                        Any cValue = getValue(c);
+                        ElabValue cValue = getValue(c);
                         match =
                             (cValue.is<int64_t>() && exprValue.is<int64_t>() &&
                              cValue.as<int64_t>() == exprValue.as<int64_t>()) ||
@@ -1332,8 +2203,8 @@ class Elaborator : public MinispecBaseListener {
 
         void exitCallExpr(MinispecParser::CallExprContext *ctx) override {
             if (ctx->fcn->getText() == "log2" && ctx->expression().size() == 1) {
-                Any v = getValue(ctx->expression()[0]);
-                Any res;
+                ElabValue v = getValue(ctx->expression()[0]);
+                ElabValue res;
                 if (v.is<int64_t>()) {
                     int64_t val = v.as<int64_t>();
                     res = (int64_t) ((val > 0)? (63 - __builtin_clzl(val)) : 0);
@@ -1452,9 +2323,7 @@ class Elaborator : public MinispecBaseListener {
 
             // Emit in order required by bsv: submodules/input wires, then functions, then rules, then methods
             auto moduleName = [this](MinispecParser::TypeContext* modTypeCtx) {
-                auto tc = createTranslatedCodePtr();
-                tc->emit(modTypeCtx);
-                std::string typeName = tc->getSourceMap().getCode();
+                std::string typeName = renderCode(modTypeCtx);
                 if (typeName.find("\\") == 0) return "\\mk" + typeName.substr(1);
                 else return "mk" + typeName.substr(0, typeName.find("#"));
             };
@@ -1608,14 +2477,14 @@ class Elaborator : public MinispecBaseListener {
 
         void exitFunctionDef(MinispecParser::FunctionDefContext* ctx) override {
             auto pu = createParametricUsePtr(ctx->functionId()->name->getText(), ctx->functionId()->paramFormals());
-            if (topLevelParametric && *topLevelParametric == *pu) {
+            if (topLevelParametric == pu) {
                 // Emit synthesis wrapper
                 std::string ifcName = ctx->functionId()->name->getText() + "___";
                 ifcName[0] = std::toupper(ifcName[0]);
                 std::string modName = "mk" + ctx->functionId()->name->getText();
-                auto ifcPu = createParametricUsePtr(ifcName, ctx->functionId()->paramFormals());
                 auto modPu = createParametricUsePtr(modName, ctx->functionId()->paramFormals());
-                ifcPu->escape = true;  // not recognized as a local type, but it is, we're making it up now
+                // Not recognized as a local type, but it is, we're making it up now
+                auto ifcPu = ParametricUse::get(ifcName, /*escape=*/true, std::vector<ElabValue>(modPu->params));
 
                 auto tc = createTranslatedCodePtr();
                 tc->emitStart(ctx);
@@ -1646,7 +2515,7 @@ class Elaborator : public MinispecBaseListener {
         void exitFunctionId(MinispecParser::FunctionIdContext* ctx) override {
             if (ctx->paramFormals()) {
                 auto pu = createParametricUsePtr(ctx->name->getText(), ctx->paramFormals());
-                parametricsEmitted.insert(*pu);
+                parametricsEmitted.insert(pu);
                 setValue(ctx, pu);
             }
         }
@@ -1654,7 +2523,7 @@ class Elaborator : public MinispecBaseListener {
         void exitTypeId(MinispecParser::TypeIdContext* ctx) override {
             if (ctx->paramFormals()) {
                 auto pu = createParametricUsePtr(ctx->name->getText(), ctx->paramFormals());
-                parametricsEmitted.insert(*pu);
+                parametricsEmitted.insert(pu);
                 setValue(ctx, pu);
             }
         }
@@ -1662,7 +2531,7 @@ class Elaborator : public MinispecBaseListener {
         void exitModuleId(MinispecParser::ModuleIdContext* ctx) override {
             if (ctx->paramFormals()) {
                 auto pu = createParametricUsePtr(ctx->name->getText(), ctx->paramFormals());
-                parametricsEmitted.insert(*pu);
+                parametricsEmitted.insert(pu);
                 setValue(ctx, pu);
             }
         }
@@ -1675,12 +2544,10 @@ class Elaborator : public MinispecBaseListener {
                 } else {
                     // Curry params, i.e., given type T with T = Vector#(4),
                     // T#(Reg#(Bit#(8)) will elab to Vector#(4, Reg#(Bit#(8)))
-                    auto pu = createParametricUsePtr("", ctx->params());
                     auto mergedParams = formalPu->params;
-                    mergedParams.insert(mergedParams.end(), pu->params.begin(), pu->params.end());
-                    pu->name = formalPu->name;
-                    pu->escape = formalPu->escape;
-                    pu->params = mergedParams;
+                    auto params = getParamValues(ctx->params());
+                    mergedParams.insert(mergedParams.end(), params.begin(), params.end());
+                    auto pu = ParametricUse::get(formalPu->name, formalPu->escape, std::move(mergedParams));
                     /// std::cout << "XXX " << ctx->name->getText() << "params=" << pu->str() <<  "\n";
                     setValue(ctx, pu);
                 }
@@ -1719,20 +2586,19 @@ class Elaborator : public MinispecBaseListener {
 
         // Forbid some identifiers to avoid conflicts
         void exitLowerCaseIdentifier(MinispecParser::LowerCaseIdentifierContext* ctx) override {
-            auto id = ctx->getText();
-            auto err = [&](const std::string& e) {
+            for (const auto& e : forbiddenIdentifierReasons(ctx->getText())) {
                 report(BasicError(ctx, "lowercase identifier " + quote(ctx) +
                             " " + e + ", which is forbidden"));
-            };
-
-            if (id.find("mk") == 0) err("begins with " + hlColored("'mk'"));
-            if (id.find("___input") != -1ul) err("contains " + hlColored("'___input'"));
-            if (svKeywords.count(id)) err("is a SystemVerilog keyword");
-            if (bsvKeywords.count(id)) err("is a Bluespec (BSV) keyword");
+            }
         }
 
         void exitPackageDef(MinispecParser::PackageDefContext* ctx) override {
             for (auto stmt : ctx->packageStmt()) {
+                if (reachableStmts && !reachableStmts->count(stmt)) {
+                    setValue(stmt, Skip());
+                    continue;
+                }
+
                 // Detect and skip non-concrete parametrics
                 MinispecParser::ParamFormalsContext* paramFormals = nullptr;
                 ParserRuleContext* defCtx = nullptr;
@@ -1776,31 +2642,53 @@ class Elaborator : public MinispecBaseListener {
             setValue(ctx->EOF(), Skip());
         }
 
-        Elaborator(IntegerContext* integerContext, ParametricsMap* parametrics, const std::unordered_set<std::string>* localTypeNames, ParametricUsePtr topLevelParametric) :
-            ic(*integerContext), parametrics(*parametrics), localTypeNames(*localTypeNames), topLevelParametric(topLevelParametric) {}
+        Elaborator(uint32_t nodeIdBound, IntegerContext* integerContext, ParametricsMap* parametrics,
+                const std::unordered_set<std::string>* localTypeNames, ParametricUsePtr topLevelParametric,
+                const std::unordered_set<tree::ParseTree*>* reachableStmts = nullptr) :
+            ic(*integerContext), parametrics(*parametrics), localTypeNames(*localTypeNames), topLevelParametric(topLevelParametric),
+            reachableStmts(reachableStmts), elabValues(nodeIdBound) {}
 
-        bool isParametricEmitted(const ParametricUse& p) const { return parametricsEmitted.count(p); }
+        // Copy for another thread: shares the definitions and all values
+        // elaborated so far, but works on its own Integer context
+        Elaborator(const Elaborator& other, IntegerContext* integerContext) :
+            MinispecBaseListener(other), ic(*integerContext), parametrics(other.parametrics), localTypeNames(other.localTypeNames),
+            topLevelParametric(other.topLevelParametric), reachableStmts(other.reachableStmts),
+            parametricsEmitted(other.parametricsEmitted), elabValues(other.elabValues), submoduleNames(other.submoduleNames) {}
+
+        bool isParametricEmitted(ParametricUsePtr p) const { return parametricsEmitted.count(p); }
+        const std::unordered_set<ParametricUsePtr>& getParametricsEmitted() const { return parametricsEmitted; }
+
+        // Used to merge the parametrics emitted by other elaborators
+        std::unordered_set<ParametricUsePtr> takeParametricsEmitted() {
+            std::unordered_set<ParametricUsePtr> res;
+            res.swap(parametricsEmitted);
+            return res;
+        }
+        void markParametricsEmitted(const std::unordered_set<ParametricUsePtr>& pus) {
+            parametricsEmitted.insert(pus.begin(), pus.end());
+        }
 };
 
-static ParametricUsePtr createTopLevelParametricUsePtr(const std::string& name, MinispecParser::ParamsContext* params, const std::string& errHdr) {
-    auto res = std::make_shared<ParametricUse>();
-    res->name = name;
-    res->escape = false;
-
-    // We can only take literals, but the grammar allows expressions,
-    // so we need to go dooown the hierarchy. This returns nullptr at
-    // any point where the traversal fails, no point in giving more info
-    auto intParamToIntLiteral = [](MinispecParser::ExpressionContext* intParamCtx) -> MinispecParser::IntLiteralContext* {
-        auto opCtx = dynamic_cast<MinispecParser::OperatorExprContext*>(intParamCtx);
-        if (!opCtx) return nullptr;
-        auto binopCtx = opCtx->binopExpr();
-        if (!binopCtx) return nullptr;
-        auto unopCtx = binopCtx->unopExpr();
-        if (!unopCtx) return nullptr;
-        auto primCtx = unopCtx->exprPrimary();
-        if (!primCtx) return nullptr;
-        return dynamic_cast<MinispecParser::IntLiteralContext*>(primCtx);
-    };
+// We can only take literals, but the grammar allows expressions, so we need
+// to go dooown the hierarchy. This returns nullptr at any point where the
+// traversal fails.
+static MinispecParser::IntLiteralContext* intParamToIntLiteral(MinispecParser::ExpressionContext* intParamCtx) {
+    auto opCtx = dynamic_cast<MinispecParser::OperatorExprContext*>(intParamCtx);
+    if (!opCtx) return nullptr;
+    auto binopCtx = opCtx->binopExpr();
+    if (!binopCtx) return nullptr;
+    auto unopCtx = binopCtx->unopExpr();
+    if (!unopCtx) return nullptr;
+    auto primCtx = unopCtx->exprPrimary();
+    if (!primCtx) return nullptr;
+    return dynamic_cast<MinispecParser::IntLiteralContext*>(primCtx);
+}
+
+// Top-level uses are escaped like the elaborator's, so they intern to the
+// same ParametricUses
+static ParametricUsePtr createTopLevelParametricUsePtr(const std::string& name, MinispecParser::ParamsContext* params,
+        const std::unordered_set<std::string>& localTypeNames, const std::string& errHdr) {
+    std::vector<ElabValue> res;
 
     if (params) {
         for (auto p : params->param()) {
@@ -1809,17 +2697,147 @@ static ParametricUsePtr createTopLevelParametricUsePtr(const std::string& name,
                 auto litCtx = intParamToIntLiteral(p->intParam);
                 if (!litCtx) error("%s", (errHdr + errorColored("'" + ipStr + "'") + " is not an integer literal").c_str());
                 if (!isUnsizedLiteral(litCtx)) error("%s", (errHdr + errorColored("'" + ipStr + "'") + " is a sized integer literal (must be unsized)").c_str());
-                res->params.push_back(parseUnsizedLiteral(litCtx));
+                res.push_back(parseUnsizedLiteral(litCtx));
             } else {
-                auto pu = createTopLevelParametricUsePtr(p->type()->name->getText(), p->type()->params(), errHdr);
-                res->params.push_back(pu);
+                auto pu = createTopLevelParametricUsePtr(p->type()->name->getText(), p->type()->params(), localTypeNames, errHdr);
+                res.push_back(pu);
             }
         }
     }
-    return res;
+    bool escape = islower(name[0]) || localTypeNames.count(name);
+    return ParametricUse::get(name, escape, std::move(res));
+}
+
+// Returns the param formals of a parametric definition, and its kind
+static std::tuple<std::vector<MinispecParser::ParamFormalContext*>, std::string> getParamInfo(ParserRuleContext* ctx) {
+    std::vector<MinispecParser::ParamFormalContext*> paramFormals;
+    std::string paramType;
+    if (auto funcCtx = dynamic_cast<MinispecParser::FunctionDefContext*>(ctx)) {
+        paramFormals = funcCtx->functionId()->paramFormals()->paramFormal();
+        paramType = "function";
+    } else if (auto modCtx = dynamic_cast<MinispecParser::ModuleDefContext*>(ctx)) {
+        paramFormals = modCtx->moduleId()->paramFormals()->paramFormal();
+        paramType = "module";
+    } else if (auto typedefCtx = dynamic_cast<MinispecParser::TypeDefSynonymContext*>(ctx)) {
+        paramFormals = typedefCtx->typeId()->paramFormals()->paramFormal();
+        paramType = "typedef";
+    } else if (auto structCtx = dynamic_cast<MinispecParser::TypeDefStructContext*>(ctx)) {
+        paramFormals = structCtx->typeId()->paramFormals()->paramFormal();
+        paramType = "struct";
+    } else {
+        panic("unhandled parametric... did the grammar change? (%s)", ctx->getText().c_str());
+    }
+    return std::make_tuple(paramFormals, paramType);
 }
 
-static ParametricUsePtr validateTopLevel(const std::string& topLevel) {
+// All definitions of a parametric, with an index to find the ones a use may
+// match without binding its params to every definition
+class ParametricDefs {
+    public:
+        struct Def {
+            ParserRuleContext* ctx;
+            std::vector<MinispecParser::ParamFormalContext*> paramFormals;
+            std::string paramType;
+            std::string defStr;  // e.g., lessThan#(Integer n)
+        };
+
+    private:
+        std::vector<Def> defs;  // in priority order
+
+        // Decision trie on param values, one level per param. Params
+        // specialized to an Integer literal follow the edge of their value;
+        // all others (unspecialized, or needing elaboration to compare)
+        // follow the wildcard edge. nodes[0] is the root, so 0 is no child.
+        struct Node {
+            std::unordered_map<int64_t, uint32_t> literals;
+            uint32_t wildcard = 0;
+            std::vector<uint32_t> defIdxs;  // defs whose param formals end here
+        };
+        std::vector<Node> nodes;
+
+        uint32_t child(uint32_t node, const int64_t* literal) {
+            uint32_t c = literal? (nodes[node].literals.count(*literal)? nodes[node].literals[*literal] : 0) : nodes[node].wildcard;
+            if (c) return c;
+            c = nodes.size();
+            nodes.push_back({});
+            if (literal) nodes[node].literals[*literal] = c;
+            else nodes[node].wildcard = c;
+            return c;
+        }
+
+    public:
+        ParametricDefs(const std::string& name, const std::vector<ParserRuleContext*>& ctxs) : nodes(1) {
+            for (auto ctx : ctxs) {
+                auto [paramFormals, paramType] = getParamInfo(ctx);
+
+                // Produce paramFormals string (we don't use getText() to avoid
+                // comments within paramFormals and have our own whitespace rules)
+                assert(paramFormals.size());
+                std::stringstream paramFormalsSs;
+                for (uint32_t i = 0; i < paramFormals.size(); i++) {
+                    if (i > 0) paramFormalsSs << ", ";
+                    auto pf = paramFormals[i];
+                    if (pf->intName) paramFormalsSs << "Integer " << pf->intName->getText();
+                    else if (pf->typeName) paramFormalsSs << "type " << pf->typeName->getText();
+                    else paramFormalsSs << pf->getText();  // it's a param
+                }
+                defs.push_back({ctx, paramFormals, paramType, name + "#(" + paramFormalsSs.str() + ")"});
+            }
+
+            // Because we may have partially specialized parametrics, give
+            // parametrics with more specialized params higher priority
+            auto specializedParams = [](const Def& def) {
+                return std::count_if(def.paramFormals.begin(), def.paramFormals.end(),
+                        [](MinispecParser::ParamFormalContext* pf) { return pf->param() != nullptr; });
+            };
+            std::stable_sort(defs.begin(), defs.end(), [&](const Def& d1, const Def& d2) {
+                return specializedParams(d1) > specializedParams(d2);
+            });
+
+            for (uint32_t d = 0; d < defs.size(); d++) {
+                uint32_t node = 0;
+                for (auto pf : defs[d].paramFormals) {
+                    auto litCtx = (pf->param() && pf->param()->intParam)? intParamToIntLiteral(pf->param()->intParam) : nullptr;
+                    if (litCtx && isUnsizedLiteral(litCtx)) {
+                        int64_t literal = parseUnsizedLiteral(litCtx);
+                        node = child(node, &literal);
+                    } else {
+                        node = child(node, nullptr);
+                    }
+                }
+                nodes[node].defIdxs.push_back(d);
+            }
+        }
+
+        const std::vector<Def>& all() const { return defs; }
+
+        // Returns the definitions that may match params, in priority order.
+        // Callers must still bind params to check them.
+        std::vector<const Def*> candidates(const std::vector<ElabValue>& params) const {
+            std::vector<uint32_t> idxs;
+            std::vector<std::tuple<uint32_t, uint32_t>> stack = {{0, 0}};  // node, param
+            while (!stack.empty()) {
+                auto [node, i] = stack.back();
+                stack.pop_back();
+                const Node& n = nodes[node];
+                if (i == params.size()) {
+                    idxs.insert(idxs.end(), n.defIdxs.begin(), n.defIdxs.end());
+                    continue;
+                }
+                if (n.wildcard) stack.push_back({n.wildcard, i + 1});
+                if (params[i].is<int64_t>()) {
+                    auto it = n.literals.find(params[i].as<int64_t>());
+                    if (it != n.literals.end()) stack.push_back({it->second, i + 1});
+                }
+            }
+            std::sort(idxs.begin(), idxs.end());
+            std::vector<const Def*> res;
+            for (uint32_t idx : idxs) res.push_back(&defs[idx]);
+            return res;
+        }
+};
+
+static ParametricUsePtr validateTopLevel(const std::string& topLevel, const std::unordered_set<std::string>& localTypeNames) {
     if (topLevel == "") return nullptr;
     std::string errHdr = "invalid top-level argument " +
         errorColored("'" + topLevel + "'") + ": ";
@@ -1832,7 +2850,7 @@ static ParametricUsePtr validateTopLevel(const std::string& topLevel) {
         auto topLevelExpr = dynamic_cast<MinispecParser::VarExprContext*>(parser.exprPrimary());
         if (!topLevelExpr) error("%s", (errHdr + "not a module or function id").c_str());
         return createTopLevelParametricUsePtr(topLevelExpr->var->getText(),
-                topLevelExpr->params(), errHdr);
+                topLevelExpr->params(), localTypeNames, errHdr);
     } catch (ParseCancellationException& p) {
         error("%s", (errHdr + "not a module or function id").c_str());
     }
@@ -1848,260 +2866,665 @@ std::string getPrelude() {
     return prelude.str();
 }
 
-SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::string& topLevel) {
-    // Initial validation of topLevel arg
-    auto topLevelParametric = validateTopLevel(topLevel);
+// Returns the package statements reachable from the top-level definition
+// topName, i.e., the definitions of all the names it uses, transitively.
+// Reachability is name-based and conservative: any identifier that matches
+// a definition's name keeps all definitions of that name (e.g., all
+// specializations of a parametric, since elaboration may pick any). Imports
+// are always kept.
+static std::unordered_set<tree::ParseTree*> findReachableStmts(
+        const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::string& topName) {
+    std::unordered_set<tree::ParseTree*> reachable;
+    std::unordered_map<std::string, std::vector<tree::ParseTree*>> defs;
+    for (auto tree : parsedTrees) {
+        for (auto stmt : tree->packageStmt()) {
+            std::vector<std::string> names;
+            if (auto functionDef = stmt->functionDef()) {
+                names.push_back(functionDef->functionId()->name->getText());
+            } else if (auto moduleDef = stmt->moduleDef()) {
+                names.push_back(moduleDef->moduleId()->name->getText());
+            } else if (auto typeDecl = stmt->typeDecl()) {
+                if (typeDecl->typeDefSynonym()) {
+                    names.push_back(typeDecl->typeDefSynonym()->typeId()->name->getText());
+                } else if (auto typeDefEnum = typeDecl->typeDefEnum()) {
+                    names.push_back(typeDefEnum->upperCaseIdentifier()->getText());
+                    // Enum values are used without the type name
+                    for (auto elem : typeDefEnum->typeDefEnumElement()) names.push_back(elem->tag->getText());
+                } else if (typeDecl->typeDefStruct()) {
+                    names.push_back(typeDecl->typeDefStruct()->typeId()->name->getText());
+                }
+            } else if (auto varDecl = stmt->varDecl()) {
+                if (auto varBinding = dynamic_cast<MinispecParser::VarBindingContext*>(varDecl)) {
+                    for (auto varInit : varBinding->varInit()) names.push_back(varInit->var->getText());
+                } else if (auto letBinding = dynamic_cast<MinispecParser::LetBindingContext*>(varDecl)) {
+                    for (auto id : letBinding->lowerCaseIdentifier()) names.push_back(id->getText());
+                }
+            }
+
+            if (names.empty()) reachable.insert(stmt);  // imports
+            for (const auto& name : names) defs[name].push_back(stmt);
+        }
+    }
+
+    // Mark definitions reachable as names are used, scanning each newly
+    // reachable definition's identifiers
+    std::vector<tree::ParseTree*> worklist;
+    std::unordered_set<std::string> usedNames;
+    auto use = [&](const std::string& name) {
+        if (!usedNames.insert(name).second) return;
+        auto it = defs.find(name);
+        if (it == defs.end()) return;
+        for (auto stmt : it->second) {
+            if (reachable.insert(stmt).second) worklist.push_back(stmt);
+        }
+    };
+    use(topName);
+    while (!worklist.empty()) {
+        std::vector<tree::ParseTree*> nodes = {worklist.back()};
+        worklist.pop_back();
+        while (!nodes.empty()) {
+            auto node = nodes.back();
+            nodes.pop_back();
+            if (dynamic_cast<tree::TerminalNode*>(node)) use(node->getText());
+            else nodes.insert(nodes.end(), node->children.begin(), node->children.end());
+        }
+    }
+    return reachable;
+}
+
+TranslatedPackages translateFiles(Compilation& compilation, const std::vector<MinispecParser::PackageDefContext*>& parsedTrees,
+        const std::string& topLevel, const TranslateOptions& options) {
+    bool separatePackages = options.separatePackages;
+    bool prune = options.prune;
+    uint32_t elabThreads = options.elabThreads;
+
+    // Parametric uses are interned until we return, when the trace events
+    // that point to them are resolved and they are destroyed. Workers (see
+    // below) allocate from their own arenas.
+    ParametricUseTable parametricUseTable(compilation.newArena());
+    ElabSteps steps(options.maxElabSteps, options.maxElabDepth);
+    ElabThreadState threadState = {&compilation, compilation.newArena(), &parametricUseTable, &steps,
+        &currentReporter(), fatalErrorsThrow()};
+    ElabThreadScope threadScope(threadState);
+    struct TraceResolver {
+        ~TraceResolver() {
+            std::lock_guard<std::mutex> lock(elabTraceMutex);
+            resolveElabTrace();
+        }
+    } traceResolver;
 
     // Do an initial pass to capture all type and module names. This advance visibility
     // is needed because we need to know whether a parametric type use maps to
     // a Minispec type or to a Bluespec type (it changes the emitted code)
     std::unordered_set<std::string> localTypeNames;
-    for (auto tree : parsedTrees) {
-        for (auto stmt : tree->packageStmt()) {
-            if (stmt->moduleDef()) {
-                localTypeNames.insert(stmt->moduleDef()->moduleId()->name->getText());
-            } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefSynonym()) {
-                auto typeId = stmt->typeDecl()->typeDefSynonym()->typeId();
-                localTypeNames.insert(typeId->name->getText());
-            } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefEnum()) {
-                localTypeNames.insert(stmt->typeDecl()->typeDefEnum()->upperCaseIdentifier()->getText());
-            } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefStruct()) {
-                auto typeId = stmt->typeDecl()->typeDefStruct()->typeId();
-                localTypeNames.insert(typeId->name->getText());
+    {
+        PhaseTimer timer("type names pass");
+        for (auto tree : parsedTrees) {
+            for (auto stmt : tree->packageStmt()) {
+                if (stmt->moduleDef()) {
+                    localTypeNames.insert(stmt->moduleDef()->moduleId()->name->getText());
+                } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefSynonym()) {
+                    auto typeId = stmt->typeDecl()->typeDefSynonym()->typeId();
+                    localTypeNames.insert(typeId->name->getText());
+                } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefEnum()) {
+                    localTypeNames.insert(stmt->typeDecl()->typeDefEnum()->upperCaseIdentifier()->getText());
+                } else if (stmt->typeDecl() && stmt->typeDecl()->typeDefStruct()) {
+                    auto typeId = stmt->typeDecl()->typeDefStruct()->typeId();
+                    localTypeNames.insert(typeId->name->getText());
+                }
             }
         }
     }
 
+    // Initial validation of topLevel arg
+    auto topLevelParametric = validateTopLevel(topLevel, localTypeNames);
+
+    // With a top level, emit only the definitions it reaches. Without one,
+    // all definitions are checked.
+    std::unordered_set<tree::ParseTree*> reachableStmts;
+    if (prune && topLevelParametric) {
+        PhaseTimer timer("reachability pass");
+        reachableStmts = findReachableStmts(parsedTrees, topLevelParametric->name);
+    }
+
     ParametricsMap parametrics;
     IntegerContext integerContext;
-    Elaborator elab(&integerContext, &parametrics, &localTypeNames, topLevelParametric);
-    TranslatedCode tc([&elab](tree::ParseTree* ctx) { return elab.getValue(ctx); });
-
-    // Emit all non-parametrics (or fully elaborated parametrics)
-    tc.emit(getPrelude());
-    for (auto tree : parsedTrees) {
-        elaboratorWalker.walk(&elab, tree);
-        tc.emit(tree);
+    Elaborator elab(compilation.getNodeIdBound(), &integerContext, &parametrics, &localTypeNames, topLevelParametric,
+            (prune && topLevelParametric)? &reachableStmts : nullptr);
+    GetValueFn getValue = [&elab](tree::ParseTree* ctx) { return elab.getValue(ctx); };
+
+    // Emit all non-parametrics (or fully elaborated parametrics). Each file
+    // and each parametric instance is translated separately, and we track
+    // which parametrics each uses, so that in separate-packages mode we can
+    // place instances and derive package imports.
+    std::vector<TranslatedCodePtr> fileCodes;
+    std::vector<std::vector<ParametricUsePtr>> fileUses;
+    std::unordered_map<ParametricUsePtr, size_t> fileDefined;  // fully specialized parametrics defined in each file
+    std::vector<TranslatedCode::ParametricUseInfo> paramUses;
+    auto getFileName = [&](size_t i) -> std::string {
+        return timeReportEnabled()? parsedTrees[i]->start->getTokenSource()->getSourceName() : "";
+    };
+    for (size_t i = 0; i < parsedTrees.size(); i++) {
+        {
+            PhaseTimer timer("elaborate ", getFileName(i));
+            elaboratorWalker.walk(&elab, parsedTrees[i]);
+        }
+        auto fileCode = makeElabShared<TranslatedCode>(getValue);
+        {
+            PhaseTimer timer("emit ", getFileName(i));
+            fileCode->emit(parsedTrees[i]);
+        }
         // Ensure there's a newline between files even if the emmitted file
         // doesn't end with a newline
-        tc.emitLine();
+        fileCode->emitLine();
+        fileCodes.push_back(fileCode);
+
+        for (const auto& p : elab.getParametricsEmitted()) {
+            if (!fileDefined.count(p)) fileDefined[p] = i;
+        }
+        fileUses.push_back({});
+        for (auto& pui : fileCode->dequeueParametricUsesEmitted()) {
+            fileUses.back().push_back(std::get<0>(pui));
+            paramUses.push_back(pui);
+        }
     }
 
+    // Index parametric definitions (all are known once files are elaborated)
+    std::unordered_map<std::string, ParametricDefs> parametricDefs;
+    for (const auto& [name, ctxs] : parametrics) parametricDefs.emplace(name, ParametricDefs(name, ctxs));
+
     // Emit parametrics
+    struct Instance {
+        TranslatedCodePtr code;
+        ParserRuleContext* defCtx;
+        std::vector<ParametricUsePtr> uses;
+    };
+    std::vector<Instance> instances;  // in emission order
+    std::unordered_map<ParametricUsePtr, size_t> instanceIdxs;
+    // Elaborates the instance of parametric p, which must be defined, with
+    // the given elaborator and Integer context
+    struct InstanceResult {
+        bool matched = false;
+        Instance inst;
+        std::vector<TranslatedCode::ParametricUseInfo> nextUses;
+    };
+    auto elabInstance = [&parametricDefs](ParametricUsePtr p, tree::ParseTree* emitCtx, uint64_t elabDepth,
+            Elaborator& elab, IntegerContext& integerContext, const GetValueFn& getValue) {
+        InstanceResult res;
+        PhaseTimer paramTimer("parametric ", p->name);
+        size_t traceId = beginElabTrace(p, emitCtx, elabDepth);
+
+        const ParametricDefs& defs = parametricDefs.at(p->name);
+
+        // Binds p's params to def's param formals in a new immutable level,
+        // and produces the params string. On a mismatch, exits the level and
+        // returns false. Mismatches are errors only if no definition matches,
+        // so they're only produced if errs is given.
+        auto bindParams = [&](const ParametricDefs::Def& def, std::stringstream& paramsSs,
+                std::vector<std::function<void()>>* errs) {
+            const auto& paramFormals = def.paramFormals;
+            bool hasParamsErrs = false;
+            auto paramsErr = [&](const std::string& msg) {
+                hasParamsErrs = true;
+                if (!errs) return;
+                std::stringstream ss;
+                std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
+                ss << hlColored(loc + ":") << " "
+                    << errorColored(" error:") << " cannot instantiate "
+                    << errorColored("'" + p->str(true) + "'")
+                    << " from parametric " << def.paramType << " "
+                    << hlColored(def.defStr) << " defined at "
+                    << hlColored(getLoc(def.ctx)) << ": " << msg << "\n";
+                if (emitCtx) ss << contextStr(emitCtx);
+                errs->push_back(std::bind(reportErr, ss.str(), "", emitCtx));
+            };
+
+            if (p->params.size() != paramFormals.size()) {
+                paramsErr(std::to_string(paramFormals.size())
+                        + " parameter" + ((paramFormals.size() > 1)? "s" : "")
+                        + " required, " + std::to_string(p->params.size())
+                        + " given" );
+                return false;
+            }
+            integerContext.enterImmutableLevel();
+            for (uint32_t i = 0; i < paramFormals.size(); i++) {
+                if (hasParamsErrs && !errs) break;
+                auto paramFormal = paramFormals[i];
+                if (i > 0) paramsSs << ", ";
+                if (paramFormal->intName) {
+                    if (!p->params[i].is<int64_t>()) {
+                        paramsErr("parameter " + std::to_string(i + 1) + " is not an Integer");
+                        continue;
+                    }
+                    auto varName = paramFormal->intName->getText();
+                    integerContext.defineVar(varName, true);
+                    integerContext.set(varName, p->params[i].as<int64_t>());
+                    paramsSs << varName << " = " << p->params[i].as<int64_t>();
+                } else if (paramFormal->typeName) {
+                    if (!p->params[i].is<ParametricUsePtr>()) {
+                        paramsErr("parameter " + std::to_string(i + 1) + " is not a type");
+                        continue;
+                    }
+                    auto typeName = paramFormal->typeName->getText();
+                    integerContext.setType(typeName, p->params[i].as<ParametricUsePtr>());
+                    paramsSs << typeName << " = " << p->params[i].as<ParametricUsePtr>()->str(/*alreadyEscaped=*/true);
+                } else {
+                    auto pfParam = paramFormal->param();
+                    assert(pfParam);
+                    // We're constantly clearing values from params, so re-elaborate
+                    elab.clearValues(pfParam);
+                    elaboratorWalker.walk(&elab, pfParam);
+
+                    auto sameVals = [](ElabValue v1, ElabValue v2) {
+                        if (v1.is<int64_t>() && v2.is<int64_t>())
+                            return v1.as<int64_t>() == v2.as<int64_t>();
+                        if (v1.is<ParametricUsePtr>() && v2.is<ParametricUsePtr>())
+                            return v1.as<ParametricUsePtr>() == v2.as<ParametricUsePtr>();
+                        return false;
+                    };
+
+                    auto valueStr = [](ElabValue v) {
+                        if (v.is<int64_t>()) return std::to_string(v.as<int64_t>());
+                        else if (v.is<ParametricUsePtr>()) return v.as<ParametricUsePtr>()->str(/*alreadyEscaped=*/true);
+                        else panic("Unexpected parametric value");
+                    };
+
+                    ElabValue pv = p->params[i];
+                    ElabValue ppv = elab.getValue(pfParam);
+                    if (!ppv.is<int64_t>()) {
+                        ppv = elab.createParametricUsePtr(pfParam->type()->name->getText(), pfParam->type()->params());
+                    }
+                    if (!sameVals(pv, ppv)) {
+                        paramsErr("parameter " + std::to_string(i + 1) + " (" + valueStr(pv) +
+                                ") does not match specialized parameter (" + valueStr(ppv) + ")");
+                        continue;
+                    }
+                }
+            }
+            if (hasParamsErrs) integerContext.exitLevel();
+            return !hasParamsErrs;
+        };
+
+        // The index filters out definitions whose specialized literals
+        // differ from p's params, so usually the first candidate matches
+        for (const ParametricDefs::Def* def : defs.candidates(p->params)) {
+            std::stringstream paramsSs;
+            if (!bindParams(*def, paramsSs, nullptr)) continue;
+            std::string paramInfo = def->paramType  + " " + hlColored(def->defStr) +
+                " with " + noteColored(paramsSs.str());
+
+            elab.clearValues(def->ctx);
+            elaboratorWalker.walk(&elab, def->ctx);
+            integerContext.exitLevel();
+            auto instCode = makeElabShared<TranslatedCode>(getValue);
+            instCode->emitStart(def->ctx);
+            instCode->emitLine();
+            instCode->emitLine(def->ctx);
+            instCode->emitEnd(paramInfo);
+
+            res.inst = {instCode, def->ctx, {}};
+            res.nextUses = instCode->dequeueParametricUsesEmitted();
+            for (auto& pui : res.nextUses) res.inst.uses.push_back(std::get<0>(pui));
+            res.matched = true;
+            break;
+        }
+
+        if (!res.matched) {
+            // Bind p to all definitions again to produce their errors
+            std::vector<std::function<void()>> paramsErrs;
+            for (const auto& def : defs.all()) {
+                std::stringstream paramsSs;
+                if (bindParams(def, paramsSs, &paramsErrs))
+                    panic("parametric definition index missed a match for %s", p->str(true).c_str());
+            }
+
+            // Dump all errors, and summarize the failure to match any if > 1 parametric
+            if (defs.all().size() > 1) {
+                std::stringstream ss;
+                std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
+                ss << hlColored(loc + ":") << " "
+                    << errorColored(" error:") << " cannot instantiate "
+                    << errorColored("'" + p->str(true) + "'")
+                    << " from any of " << defs.all().size() << " parametric definitions\n";
+                if (emitCtx) ss << contextStr(emitCtx);
+                reportErr(ss.str(), "", emitCtx);
+            }
+            for (auto err : paramsErrs) err();
+        }
+        endElabTrace(traceId, res.matched? res.inst.code->size() : 0);
+        return res;
+    };
+
+    // Instances at the same depth are independent, so with elabThreads > 1,
+    // worker threads elaborate them, each on its own copy of the elaborator.
+    // Results and reports are merged in serial order, so the output does not
+    // depend on the number of threads.
+    struct ElabWorker {
+        IntegerContext integerContext;
+        std::unique_ptr<Elaborator> elab;
+        GetValueFn getValue;
+        std::pmr::memory_resource* arena;
+        bool failed = false;  // its elaborator may be left mid-instance
+    };
+    std::vector<std::unique_ptr<ElabWorker>> workers;  // created on demand, reused across depths
+
     uint64_t elabDepth = 0;
     while (true) {
         elabDepth++;
-        auto paramUses = tc.dequeueParametricUsesEmitted();
         if (elabDepth == 1 && topLevelParametric && !topLevelParametric->params.empty()) {
-            paramUses.push_back(std::make_tuple(*topLevelParametric, nullptr));
+            paramUses.push_back(std::make_tuple(topLevelParametric, nullptr));
         }
         if (paramUses.empty()) break;  // no more parametrics
+        PhaseTimer depthTimer("parametrics at depth ", std::to_string(elabDepth));
+        std::vector<TranslatedCode::ParametricUseInfo> nextParamUses;
 
-        for (auto& [p, emitCtx] : paramUses) {
-            auto it = parametrics.find(p.name);
-            // NOTE: Fail silently so we can use parametric uses for non-local parametric types
-            if (it == parametrics.end()) continue; //error(parametric %s not found", p.name.c_str());
-            if (elab.isParametricEmitted(p)) continue;
-            registerElabStep(p, elabDepth);
-
-            auto getParamInfo = [](ParserRuleContext* ctx) -> std::tuple<std::vector<MinispecParser::ParamFormalContext*>, std::string> {
-                std::vector<MinispecParser::ParamFormalContext*> paramFormals;
-                std::string paramType;
-                if (auto funcCtx = dynamic_cast<MinispecParser::FunctionDefContext*>(ctx)) {
-                    paramFormals = funcCtx->functionId()->paramFormals()->paramFormal();
-                    paramType = "function";
-                } else if (auto modCtx = dynamic_cast<MinispecParser::ModuleDefContext*>(ctx)) {
-                    paramFormals = modCtx->moduleId()->paramFormals()->paramFormal();
-                    paramType = "module";
-                } else if (auto typedefCtx = dynamic_cast<MinispecParser::TypeDefSynonymContext*>(ctx)) {
-                    paramFormals = typedefCtx->typeId()->paramFormals()->paramFormal();
-                    paramType = "typedef";
-                } else if (auto structCtx = dynamic_cast<MinispecParser::TypeDefStructContext*>(ctx)) {
-                    paramFormals = structCtx->typeId()->paramFormals()->paramFormal();
-                    paramType = "struct";
-                } else {
-                    panic("unhandled parametric... did the grammar change? (%s)", ctx->getText().c_str());
-                }
-                return std::make_tuple(paramFormals, paramType);
-            };
-
-            auto specializedParams = [getParamInfo](ParserRuleContext* ctx) {
-                uint32_t s = 0;
-                auto [paramFormals, _] = getParamInfo(ctx);
-                for (auto pf: paramFormals)
-                    if (pf->param()) s++;
-                return s;
-            };
-
-            // Because we may have partially specialized parametrics, give
-            // parametrics with more specialized params higher priority
-            std::vector<ParserRuleContext*> ctxs = it->second;
-            std::stable_sort(ctxs.begin(), ctxs.end(),
-                    [specializedParams](ParserRuleContext* ctx1, ParserRuleContext* ctx2) {
-                        return specializedParams(ctx1) > specializedParams(ctx2);
-                    });
-
-            // We try to match against all ctxs, and produce errors on those
-            // that fail. If no match is found, we later emit those errors
-            std::vector<std::function<void()>> paramsErrs;
-            bool ctxMatched = false;
+        auto addInstance = [&](ParametricUsePtr p, const InstanceResult& res) {
+            instanceIdxs[p] = instances.size();
+            instances.push_back(res.inst);
+            nextParamUses.insert(nextParamUses.end(), res.nextUses.begin(), res.nextUses.end());
+        };
 
-            for (auto ctx : ctxs) {
-                auto [paramFormals, paramType] = getParamInfo(ctx);
+        if (elabThreads <= 1) {
+            for (auto& [p, emitCtx] : paramUses) {
+                // NOTE: Fail silently so we can use parametric uses for non-local parametric types
+                if (!parametrics.count(p->name)) continue; //error(parametric %s not found", p->name.c_str());
+                if (elab.isParametricEmitted(p)) continue;
+                registerElabStep(p, elabDepth);
+                auto res = elabInstance(p, emitCtx, elabDepth, elab, integerContext, getValue);
+                if (res.matched) addInstance(p, res);
+            }
+        } else {
+            std::vector<std::tuple<ParametricUsePtr, tree::ParseTree*>> todo;
+            std::unordered_set<ParametricUsePtr> todoSet;
+            for (auto& [p, emitCtx] : paramUses) {
+                if (!parametrics.count(p->name) || elab.isParametricEmitted(p)) continue;
+                if (!todoSet.insert(p).second) continue;
+                todo.push_back(std::make_tuple(p, emitCtx));
+            }
+            // Past the maximum depth, serial elaboration fails on the first one
+            if (!todo.empty() && elabDepth > threadState.steps->maxDepth && threadState.steps->maxDepth)
+                registerElabStep(std::get<0>(todo[0]), elabDepth);
+
+            size_t numThreads = std::min((size_t) elabThreads, todo.size());
+            while (workers.size() < numThreads) {
+                auto w = std::make_unique<ElabWorker>();
+                w->integerContext = integerContext.clone();
+                w->elab = std::make_unique<Elaborator>(elab, &w->integerContext);
+                w->elab->takeParametricsEmitted();  // track only the worker's own instances
+                w->getValue = [e = w->elab.get()](tree::ParseTree* ctx) { return e->getValue(ctx); };
+                w->arena = compilation.newArena();
+                workers.push_back(std::move(w));
+            }
 
-                // Produce paramFormals string (we don't use getText() to avoid
-                // comments within paramFormals and have our own whitespace rules)
-                assert(paramFormals.size());
-                std::stringstream paramFormalsSs;
-                for (uint32_t i = 0; i < paramFormals.size(); i++) {
-                    if (i > 0) paramFormalsSs << ", ";
-                    auto pf = paramFormals[i];
-                    if (pf->intName) paramFormalsSs << "Integer " << pf->intName->getText();
-                    else if (pf->typeName) paramFormalsSs << "type " << pf->typeName->getText();
-                    else paramFormalsSs << pf->getText();  // it's a param
+            std::vector<InstanceResult> results(todo.size());
+            std::vector<DeferredReports> reports(todo.size());
+            std::vector<ElabStepLog> stepLogs(todo.size());
+            std::vector<std::unordered_set<ParametricUsePtr>> emitted(todo.size());
+            // Fatal errors always throw in workers, and are raised on this
+            // thread when merging, after the reports that precede them. A
+            // failure stops only its worker, as serial elaboration may skip
+            // the failing instance (if an earlier one emits it); instances
+            // left undone when all workers fail are elaborated when merging.
+            std::vector<std::exception_ptr> failures(todo.size());
+            std::vector<char> done(todo.size(), false);
+            // Each parametric takes a step, so serial elaboration exceeds the
+            // step limit if a single one takes this many
+            const ElabSteps& steps = *threadState.steps;
+            uint64_t maxLoggedSteps = !steps.maxSteps? UINT64_MAX :
+                (steps.maxSteps > steps.num + 1)? steps.maxSteps - steps.num - 1 : 0;
+            std::atomic<size_t> nextIdx(0);
+            uint32_t depthPhase = phaseDepth();
+            auto work = [&](ElabWorker* w) {
+                PhaseNesting phaseNesting(depthPhase);
+                ElabThreadState workerState = threadState;
+                workerState.arena = w->arena;
+                workerState.throwFatalErrors = true;
+                ElabThreadScope workerScope(workerState);
+                for (size_t i = nextIdx++; i < todo.size(); i = nextIdx++) {
+                    auto [p, emitCtx] = todo[i];
+                    stepLogs[i].reports = &reports[i];
+                    stepLogs[i].maxSteps = maxLoggedSteps;
+                    elabStepLog = &stepLogs[i];
+                    deferReports(&reports[i]);
+                    try {
+                        results[i] = elabInstance(p, emitCtx, elabDepth, *w->elab, w->integerContext, w->getValue);
+                    } catch (FatalError&) {
+                        failures[i] = std::current_exception();
+                        w->failed = true;
+                    } catch (ElabStepLogFull&) {
+                        stepLogs[i].exceeded = true;
+                        w->failed = true;
+                    }
+                    deferReports(nullptr);
+                    elabStepLog = nullptr;
+                    emitted[i] = w->elab->takeParametricsEmitted();
+                    done[i] = true;
+                    if (w->failed) break;
                 }
-                std::string defStr = p.name + "#(" + paramFormalsSs.str() + ")";
-
-                bool ctxHasParamsErrs = false;
-                auto paramsErr = [&](const std::string& msg) {
-                    std::stringstream ss;
-                    std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
-                    ss << hlColored(loc + ":") << " "
-                        << errorColored(" error:") << " cannot instantiate "
-                        << errorColored("'" + p.str(true) + "'")
-                        << " from parametric " << paramType << " "
-                        << hlColored(defStr) << " defined at "
-                        << hlColored(getLoc(ctx)) << ": " << msg << "\n";
-                    if (emitCtx) ss << contextStr(emitCtx);
-                    paramsErrs.push_back(std::bind(reportErr, ss.str(), "", emitCtx));
-                    ctxHasParamsErrs = true;
-                };
-
-                // Bind params, produce params string
-                integerContext.enterImmutableLevel();
-                std::stringstream paramsSs;
-                if (p.params.size() != paramFormals.size()) {
-                    paramsErr(std::to_string(paramFormals.size())
-                            + " parameter" + ((paramFormals.size() > 1)? "s" : "")
-                            + " required, " + std::to_string(p.params.size())
-                            + " given" );
+            };
+            std::vector<std::thread> threads;
+            for (size_t t = 1; t < numThreads; t++) threads.emplace_back(work, workers[t].get());
+            if (numThreads) work(workers[0].get());
+            for (auto& t : threads) t.join();
+            workers.erase(std::remove_if(workers.begin(), workers.end(),
+                        [](const auto& w) { return w->failed; }), workers.end());
+
+            for (size_t i = 0; i < todo.size(); i++) {
+                ParametricUsePtr p = std::get<0>(todo[i]);
+                // Serial elaboration skips instances emitted by earlier ones
+                if (elab.isParametricEmitted(p)) continue;
+                registerElabStep(p, elabDepth);
+                if (!done[i]) {
+                    auto res = elabInstance(p, std::get<1>(todo[i]), elabDepth, elab, integerContext, getValue);
+                    if (res.matched) addInstance(p, res);
                     continue;
                 }
-                for (uint32_t i = 0; i < paramFormals.size(); i++) {
-                    auto paramFormal = paramFormals[i];
-                    if (i > 0) paramsSs << ", ";
-                    if (paramFormal->intName) {
-                        if (!p.params[i].is<int64_t>()) {
-                            paramsErr("parameter " + std::to_string(i + 1) + " is not an Integer");
-                            continue;
-                        }
-                        auto varName = paramFormal->intName->getText();
-                        integerContext.defineVar(varName, true);
-                        integerContext.set(varName, p.params[i].as<int64_t>());
-                        paramsSs << varName << " = " << p.params[i].as<int64_t>();
-                    } else if (paramFormal->typeName) {
-                        if (!p.params[i].is<ParametricUsePtr>()) {
-                            paramsErr("parameter " + std::to_string(i + 1) + " is not a type");
-                            continue;
-                        }
-                        auto typeName = paramFormal->typeName->getText();
-                        integerContext.setType(typeName, p.params[i].as<ParametricUsePtr>());
-                        paramsSs << typeName << " = " << p.params[i].as<ParametricUsePtr>()->str(/*alreadyEscaped=*/true);
-                    } else {
-                        auto pfParam = paramFormal->param();
-                        assert(pfParam);
-                        // We're constantly clearing values from params, so re-elaborate
-                        elab.clearValues(pfParam);
-                        elaboratorWalker.walk(&elab, pfParam);
-
-                        auto sameVals = [](Any v1, Any v2) {
-                            if (v1.is<int64_t>() && v2.is<int64_t>())
-                                return v1.as<int64_t>() == v2.as<int64_t>();
-                            if (v1.is<ParametricUsePtr>() && v2.is<ParametricUsePtr>())
-                                return *v1.as<ParametricUsePtr>() == *v2.as<ParametricUsePtr>();
-                            return false;
-                        };
-
-                        auto valueStr = [](Any v) {
-                            if (v.is<int64_t>()) return std::to_string(v.as<int64_t>());
-                            else if (v.is<ParametricUsePtr>()) return v.as<ParametricUsePtr>()->str(/*alreadyEscaped=*/true);
-                            else panic("Unexpected parametric value");
-                        };
-
-                        Any pv = p.params[i];
-                        Any ppv = elab.getValue(pfParam);
-                        if (!ppv.is<int64_t>()) {
-                            ppv = elab.createParametricUsePtr(pfParam->type()->name->getText(), pfParam->type()->params());
-                        }
-                        if (!sameVals(pv, ppv)) {
-                            paramsErr("parameter " + std::to_string(i + 1) + " (" + valueStr(pv) +
-                                    ") does not match specialized parameter (" + valueStr(ppv) + ")");
-                            continue;
-                        }
+                size_t replayed = 0;
+                auto replayUpTo = [&](size_t end) {
+                    for (; replayed < end; replayed++) {
+                        const auto& r = reports[i][replayed];
+                        reportMsg(r.isError, r.msg, r.locInfo, r.ctx);
                     }
+                };
+                for (auto& [step, reportsBefore] : stepLogs[i].steps) {
+                    replayUpTo(reportsBefore);
+                    registerElabStep(step);
                 }
-
-                if (!ctxHasParamsErrs) {
-                    ctxMatched = true;
-                    std::string paramInfo = paramType  + " " + hlColored(defStr) +
-                        " with " + noteColored(paramsSs.str());
-
-                    elab.clearValues(ctx);
-                    elaboratorWalker.walk(&elab, ctx);
-                    integerContext.exitLevel();
-                    tc.emitStart(ctx);
-                    tc.emitLine();
-                    tc.emitLine(ctx);
-                    tc.emitEnd(paramInfo);
-                    break;
-                } else {
-                    integerContext.exitLevel();
-                }
-            }
-
-            if (!ctxMatched) {
-                // Dump all errors, and summarize the failure to match any if > 1 parametric
-                if (ctxs.size() > 1) {
-                    std::stringstream ss;
-                    std::string loc = emitCtx? getLoc(emitCtx) : "command-line arg";
-                    ss << hlColored(loc + ":") << " "
-                        << errorColored(" error:") << " cannot instantiate "
-                        << errorColored("'" + p.str(true) + "'")
-                        << " from any of " << ctxs.size() << " parametric definitions\n";
-                    if (emitCtx) ss << contextStr(emitCtx);
-                    reportErr(ss.str(), "", emitCtx);
+                replayUpTo(reports[i].size());
+                if (failures[i]) {
+                    try {
+                        std::rethrow_exception(failures[i]);
+                    } catch (FatalError& e) {
+                        fatalExit(e.exitCode, e.msg);
+                    }
                 }
-                for (auto err : paramsErrs) err();
+                if (stepLogs[i].exceeded) panic("elaboration of %s exceeded the step limit only in parallel", p->str(/*alreadyEscaped=*/true).c_str());
+                elab.markParametricsEmitted(emitted[i]);
+                if (results[i].matched) addInstance(p, results[i]);
             }
         }
+        paramUses = std::move(nextParamUses);
     }
 
     std::string topModule = "";
-    if (topLevelParametric) topModule = "mk" + topLevelParametric->str();
+    if (topLevelParametric) topModule = "mk" + topLevelParametric->str(/*alreadyEscaped=*/true);
 
     // Top-level parametric modules with names containing #() break both bsc
     // -sim (the generated C++ files have the unescaped raw name all over) and
     // produce invalid Verilog output. So produce a wrapper module.
+    TranslatedCodePtr topWrapperCode = nullptr;
     if (topLevelParametric && !topLevelParametric->params.empty()) {
-        if (!elab.isParametricEmitted(*topLevelParametric)) {
+        if (!elab.isParametricEmitted(topLevelParametric)) {
             std::string msg = errorColored("error:") + " cannot find top-level parametric " +
-                errorColored("'" + topLevelParametric->str() + "'");
+                errorColored("'" + topLevelParametric->str(/*alreadyEscaped=*/true) + "'");
             reportErr(msg, "", nullptr);
         }
 
-        ParametricUse ifcPu = *topLevelParametric;
-        if (!isupper(ifcPu.name[0])) {
-            ifcPu.name[0] = toupper(ifcPu.name[0]);
-            ifcPu.name += "___";
+        std::string ifcName = topLevelParametric->name;
+        if (!isupper(ifcName[0])) {
+            ifcName[0] = toupper(ifcName[0]);
+            ifcName += "___";
         }
-        tc.emitLine("\n// Top-level wrapper module");
-        tc.emitLine("module mkTopLevel___( \\", ifcPu.str(), " );");
-        tc.emitLine("  \\", ifcPu.str(), " res <- \\mk", topLevelParametric->str(), " ;");
-        tc.emitLine("  return res;");
-        tc.emitLine("endmodule");
+        auto ifcPu = ParametricUse::get(ifcName, topLevelParametric->escape,
+                std::vector<ElabValue>(topLevelParametric->params));
+        topWrapperCode = makeElabShared<TranslatedCode>(getValue);
+        topWrapperCode->emitLine("\n// Top-level wrapper module");
+        topWrapperCode->emitLine("module mkTopLevel___( \\", ifcPu->str(/*alreadyEscaped=*/true), " );");
+        topWrapperCode->emitLine("  \\", ifcPu->str(/*alreadyEscaped=*/true), " res <- \\mk", topLevelParametric->str(/*alreadyEscaped=*/true), " ;");
+        topWrapperCode->emitLine("  return res;");
+        topWrapperCode->emitLine("endmodule");
         topModule = "mkTopLevel___";
     }
 
     exitIfErrors();
-    return tc.getSourceMap(topModule);
+
+    PhaseTimer emitTimer("emit packages");
+    TranslatedPackages res;
+    res.topModule = topModule;
+    if (!separatePackages) {
+        TranslatedCode tc(getValue);
+        tc.emit(getPrelude());
+        for (auto fileCode : fileCodes) tc.emit(fileCode);
+        for (auto& inst : instances) tc.emit(inst.code);
+        if (topWrapperCode) tc.emit(topWrapperCode);
+        res.names.push_back("Translated");
+        res.sourceMaps.push_back(tc.getSourceMap(topModule));
+        res.topPackage = "Translated";
+        return res;
+    }
+
+    // Separate packages. Package names are derived from file names
+    size_t numFiles = parsedTrees.size();
+    std::vector<std::string> pkgNames;
+    std::unordered_map<std::string, size_t> stemToFile;
+    std::unordered_set<std::string> usedNames;
+    for (size_t i = 0; i < numFiles; i++) {
+        std::string stem = std::filesystem::path(parsedTrees[i]->start->getTokenSource()->getSourceName()).stem();
+        stemToFile[stem] = i;
+        std::string name = "Ms_" + stem;
+        for (char& c : name) if (!isalnum(c) && c != '_') c = '_';
+        std::string uniqueName = name;
+        for (uint32_t n = 2; usedNames.count(uniqueName); n++) uniqueName = name + "_" + std::to_string(n);
+        usedNames.insert(uniqueName);
+        pkgNames.push_back(uniqueName);
+    }
+
+    std::unordered_map<tree::ParseTree*, size_t> treeToFile;
+    for (size_t i = 0; i < numFiles; i++) treeToFile[parsedTrees[i]] = i;
+    auto getDefFile = [&](tree::ParseTree* ctx) {
+        while (ctx->parent) ctx = ctx->parent;
+        return treeToFile[ctx];
+    };
+
+    // Place each instance in the latest (in topological order) of the files
+    // that define its parametric and the definitions it uses. This file may
+    // not import all the others, but they all come earlier, so adding the
+    // missing imports never causes a cycle. Users of the instance see all
+    // these files too, and thus the instance's file. Iterate to a fixpoint
+    // to handle instances that use later-placed instances (and recursion).
+    std::vector<size_t> instanceFiles;
+    for (auto& inst : instances) instanceFiles.push_back(getDefFile(inst.defCtx));
+    auto getUseFile = [&](ParametricUsePtr p) -> ssize_t {
+        auto instIt = instanceIdxs.find(p);
+        if (instIt != instanceIdxs.end()) return instanceFiles[instIt->second];
+        auto fileIt = fileDefined.find(p);
+        if (fileIt != fileDefined.end()) return fileIt->second;
+        return -1;  // not a Minispec definition (e.g., a Bluespec type)
+    };
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (size_t j = 0; j < instances.size(); j++) {
+            for (const auto& p : instances[j].uses) {
+                ssize_t useFile = getUseFile(p);
+                if (useFile > (ssize_t)instanceFiles[j]) {
+                    instanceFiles[j] = useFile;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // Find each file's imports. bsc does not re-export imported definitions,
+    // so each package imports the transitive closure of its dependences
+    std::vector<std::set<size_t>> deps(numFiles);
+    std::vector<std::vector<std::string>> bsvImports(numFiles);
+    for (size_t i = 0; i < numFiles; i++) {
+        for (auto stmt : parsedTrees[i]->packageStmt()) {
+            if (auto importDecl = stmt->importDecl()) {
+                for (auto importItem : importDecl->identifier()) {
+                    auto it = stemToFile.find(importItem->getText());
+                    if (it != stemToFile.end() && it->second < i) deps[i].insert(it->second);
+                }
+            } else if (auto bsvImportDecl = stmt->bsvImportDecl()) {
+                for (auto id : bsvImportDecl->upperCaseIdentifier()) bsvImports[i].push_back(id->getText());
+            }
+        }
+        for (const auto& p : fileUses[i]) {
+            ssize_t useFile = getUseFile(p);
+            if (useFile >= 0 && useFile < (ssize_t)i) deps[i].insert(useFile);
+        }
+    }
+    for (size_t j = 0; j < instances.size(); j++) {
+        size_t file = instanceFiles[j];
+        size_t defFile = getDefFile(instances[j].defCtx);
+        if (defFile < file) deps[file].insert(defFile);
+        for (const auto& p : instances[j].uses) {
+            ssize_t useFile = getUseFile(p);
+            if (useFile >= 0 && useFile < (ssize_t)file) deps[file].insert(useFile);
+        }
+    }
+    std::vector<std::set<size_t>> allDeps(numFiles);
+    for (size_t i = 0; i < numFiles; i++) {
+        for (size_t d : deps[i]) {
+            allDeps[i].insert(d);
+            allDeps[i].insert(allDeps[d].begin(), allDeps[d].end());
+        }
+    }
+
+    // Find the package with the top-level module: the wrapper goes with the
+    // instance it wraps, and non-parametric modules or functions are found
+    // by name. If not found, bsc will report the missing module.
+    size_t topFile = numFiles - 1;
+    if (topWrapperCode) {
+        auto it = instanceIdxs.find(topLevelParametric);
+        if (it != instanceIdxs.end()) topFile = instanceFiles[it->second];
+    } else if (topLevelParametric) {
+        for (size_t i = 0; i < numFiles; i++) {
+            for (auto stmt : parsedTrees[i]->packageStmt()) {
+                if ((stmt->moduleDef() && stmt->moduleDef()->moduleId()->name->getText() == topLevelParametric->name) ||
+                    (stmt->functionDef() && stmt->functionDef()->functionId()->name->getText() == topLevelParametric->name))
+                    topFile = i;
+            }
+        }
+    }
+    res.topPackage = pkgNames[topFile];
+
+    const std::string preludeName = "MsPrelude";
+    TranslatedCode preludeCode(getValue);
+    preludeCode.emit(getPrelude());
+    res.names.push_back(preludeName);
+    res.sourceMaps.push_back(preludeCode.getSourceMap(topModule));
+
+    for (size_t i = 0; i < numFiles; i++) {
+        TranslatedCode tc(getValue);
+        tc.emitLine("import Vector::*;");
+        tc.emitLine("import ", preludeName, "::*;");
+        std::unordered_set<std::string> bsvImportsEmitted(bsvImports[i].begin(), bsvImports[i].end());
+        for (size_t d : allDeps[i]) tc.emitLine("import ", pkgNames[d], "::*;");
+        for (size_t d : allDeps[i]) {
+            for (const auto& bsvImport : bsvImports[d]) {
+                if (bsvImportsEmitted.insert(bsvImport).second) tc.emitLine("import ", bsvImport, "::*;");
+            }
+        }
+        tc.emitLine();
+        tc.emit(fileCodes[i]);
+        for (size_t j = 0; j < instances.size(); j++) {
+            if (instanceFiles[j] == i) tc.emit(instances[j].code);
+        }
+        if (topWrapperCode && i == topFile) tc.emit(topWrapperCode);
+        res.names.push_back(pkgNames[i]);
+        res.sourceMaps.push_back(tc.getSourceMap(topModule));
+    }
+    return res;
 }
@@ -17,32 +17,42 @@
  */
 
 #pragma once
-#include <map>
 #include <sstream>
+#include <string>
+#include <vector>
 #include "antlr4-runtime.h"
 #include "MinispecParser.h"
+#include "parse.h"
 
 // Stores the translated Bluespec source as well as the map to the Minispec
-// source syntax elements that produced each piece of Bluespec code
+// source syntax elements that produced each piece of Bluespec code. Ranges
+// are kept in flat arrays sorted by (start, end), so point lookups are
+// binary searches, and context info ranges are indexed by a static interval
+// tree (a max-end segment tree over the sorted array), so containment queries
+// take logarithmic time per result. Info strings are interned.
 class SourceMap {
     private:
         typedef std::tuple<ssize_t, ssize_t> Range;
-        const std::map<Range, antlr4::tree::ParseTree*> dstToSrc;
-        const std::map<Range, std::string> dstToInfo;
-        const std::string code;
-        const std::string topModule;
+        struct SrcEntry {
+            Range range;
+            antlr4::tree::ParseTree* ctx;
+        };
+        struct InfoEntry {
+            Range range;
+            const std::string* info;  // interned
+        };
+
+        std::vector<SrcEntry> srcs;
+        std::vector<InfoEntry> infos;
+        std::vector<ssize_t> infoMaxEnd;  // segment tree over infos
+        std::string code;
+        std::string topModule;
         std::vector<size_t> lineToPos;
 
-        SourceMap(const std::map<Range, antlr4::tree::ParseTree*>& dstToSrc,
-                  const std::map<Range, std::string>& dstToInfo,
-                  const std::string& code, const std::string& topModule) :
-            dstToSrc(dstToSrc), dstToInfo(dstToInfo), code(code), topModule(topModule)
-        {
-            lineToPos.push_back(0);
-            for (size_t p = 0; p < code.size(); p++) {
-                if (code[p] == '\n') lineToPos.push_back(p + 1);
-            }
-        }
+        // Entries are given in insertion order; when several have the same
+        // range, the last one wins
+        SourceMap(std::vector<SrcEntry>&& srcs, std::vector<InfoEntry>&& infos,
+                  std::string&& code, const std::string& topModule);
 
         size_t getPos(size_t line, size_t lineChar) const {
             assert(line <= lineToPos.size());
@@ -51,50 +61,70 @@ class SourceMap {
             return lineToPos[line - 1] + (lineChar - 1);
         }
 
+        ssize_t buildInfoIndex(size_t node, size_t lo, size_t hi);
+        void findInfos(size_t node, size_t lo, size_t hi, size_t limit, ssize_t pos,
+                std::vector<const std::string*>& res) const;
+
         friend class TranslatedCode;  // for private constructor
 
     public:
         // Find source element for this output position
-	antlr4::tree::ParseTree* find(size_t line, size_t lineChar) const {
-            size_t pos = getPos(line, lineChar);
-            Range range = std::make_tuple(pos, pos);
-            auto it = dstToSrc.lower_bound(range);
-            if (it == dstToSrc.end()) return nullptr;
-            auto [foundStart, foundEnd] = it->first;
-            if (foundStart != (ssize_t)pos) return nullptr;
-            return it->second;
-        }
+        antlr4::tree::ParseTree* find(size_t line, size_t lineChar) const;
 
         // Find exact source element match for output text
-	antlr4::tree::ParseTree* find(size_t line, size_t lineChar, std::string_view sv) const {
-            size_t pos = getPos(line, lineChar);
-            Range range = std::make_tuple(pos, pos + sv.size());
-            auto it = dstToSrc.find(range);
-            if (it == dstToSrc.end()) return nullptr;
-            if (getCode().substr(pos, sv.size()) != sv) return nullptr;
-            return it->second;
-        }
+        antlr4::tree::ParseTree* find(size_t line, size_t lineChar, std::string_view sv) const;
 
-        std::string getContextInfo(size_t line, size_t lineChar) const {
-            // Include all context info, outside-in.
-            // NOTE: There are faster implementation, but this one is simple
-            // and fast enough (used only on errors, few infos, etc.)
-            size_t pos = getPos(line, lineChar);
-            std::stringstream ss;
-            for (auto& [range, info] : dstToInfo) {
-                auto& [start, end] = range;
-                if (start <= (ssize_t)pos && end >= (ssize_t)pos) {
-                    ss << "In " << info << "\n";
-                }
-                if (start > (ssize_t)pos) break;  // nothing useful beyond...
-            }
-            return ss.str();
-        }
+        // Returns the context info of all ranges that include this output
+        // position, outside-in
+        std::string getContextInfo(size_t line, size_t lineChar) const;
 
         const std::string& getCode() const { return code; }
         const std::string& getTopModule() const { return topModule; }
 };
 
-void setElabLimits(uint64_t maxSteps, uint64_t maxDepth);
+// Translated Bluespec packages. By default, all code is translated into a
+// single package, Translated. With separate packages, there is a prelude
+// package plus one package per Minispec file, and each elaborated parametric
+// is placed in a package that can see all its dependences.
+struct TranslatedPackages {
+    std::vector<std::string> names;
+    std::vector<SourceMap> sourceMaps;
+    std::string topPackage;  // package to compile (contains the top-level module, if any)
+    std::string topModule;
+
+    // Returns the SourceMap for a bsc-reported file name, or nullptr if the
+    // file is not one of ours (e.g., an imported BSV file)
+    const SourceMap* find(const std::string& fileName) const {
+        std::string baseName = fileName.substr(fileName.rfind('/') + 1);
+        for (size_t i = 0; i < names.size(); i++) {
+            if (baseName == names[i] + ".bsv") return &sourceMaps[i];
+        }
+        return nullptr;
+    }
+};
+
+// Records elaboration steps (parametric instantiations and for loop
+// iterations), to be written as a Chrome trace to fileName
+void enableElabTrace(const std::string& fileName);
+void writeElabTrace();
+
+// Translation options. With prune, emits only the definitions reachable
+// from topLevel (if given). elabThreads > 1 elaborates independent
+// parametric instances in parallel (the output is the same as with a single
+// thread). Elaboration fails after maxElabSteps steps (parametric
+// instantiations and for loop iterations) or beyond maxElabDepth nested
+// instantiations; 0 disables each limit.
+struct TranslateOptions {
+    bool separatePackages = false;
+    bool prune = false;
+    uint32_t elabThreads = 1;
+    uint64_t maxElabSteps = 50000;
+    uint64_t maxElabDepth = 1000;
+};
 
-SourceMap translateFiles(const std::vector<MinispecParser::PackageDefContext*>& parsedTrees, const std::string& topLevel);
+// parsedTrees must belong to compilation, which must outlive the returned
+// packages (their source maps point into the parse trees and into strings
+// interned in the compilation). Elaboration objects are allocated from
+// compilation's arenas.
+TranslatedPackages translateFiles(Compilation& compilation, const std::vector<MinispecParser::PackageDefContext*>& parsedTrees,
+        const std::string& topLevel, const TranslateOptions& options = {});
@@ -0,0 +1,107 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Generator for large bsc outputs: writes a Minispec design with many
+# registers and rules, translates it with msc (-o bsv), and synthesizes a bsc
+# output with a few warnings per rule at the rule's and register's locations
+# in the translated BSV. The warnings follow bsc's message formats, and cover
+# both the codes msc rewrites and ones it passes through. Used by
+# tests/bscoutput.py and bench/bscoutput.py.
+
+import os
+import re
+import subprocess as sp
+
+def genDesign(n):
+    code = "module Many;\n"
+    for i in range(n):
+        code += '''    Reg#(Bit#(8)) r%(i)d(0);
+    rule step%(i)d;
+        r%(i)d <= r%(i)d + r%(j)d;
+    endrule
+''' % {"i": i, "j": (i + 1) % n}
+    code += "endmodule\n"
+    return code
+
+def genWarnings(regs, rules):
+    # regs and rules are lists of (name, line, column) in the translated BSV
+    loc = lambda l, c: '"Translated.bsv", line %d, column %d' % (l, c)
+    out = "checking package dependencies\ncompiling Translated.bsv\ncode generation for mkMany starts\n"
+    n = min(len(regs), len(rules))
+    for i in range(n):
+        reg, rl, rc = regs[i]
+        nreg = regs[(i + 1) % n][0]
+        rule, ul, uc = rules[i]
+        nrule, nl, nc = rules[(i + 1) % n]
+        kind = i % 4
+        if kind == 0:
+            out += '''Warning: %s: (G0010)
+  Rule "%s" was treated as more urgent than "%s". Conflicts:
+    "%s" cannot fire before "%s": calls to %s.write vs. %s.read
+    "%s" cannot fire before "%s": calls to %s.write vs. %s.read
+''' % (loc(ul, uc), rule, nrule, rule, nrule, nreg, nreg, nrule, rule, reg, reg)
+        elif kind == 1:
+            out += '''Warning: %s: (G0117)
+  Rule `%s' shadows the effects of `%s' when they execute in the same clock
+  cycle. Affected method calls:
+    %s.write
+  To silence this warning, use the `-no-warn-action-shadowing' flag.
+''' % (loc(ul, uc), rule, nrule, reg)
+        elif kind == 2:
+            out += '''Warning: %s: (G0036)
+  Rule "%s" will appear to fire before "%s" when both fire in the same clock
+  cycle, affecting:
+    calls to %s.write vs. %s.read
+''' % (loc(ul, uc), nrule, rule, reg, reg)
+        else:
+            out += '''Warning: %s: (G0015)
+  Instance `%s' requires the following method to be always enabled, but the
+  condition for executing the method could not be proven to be always True:
+  _write
+''' % (loc(rl, rc), reg)
+        out += '''Warning: %s: (G0004)
+  Rule `%s' uses methods that conflict in parallel:
+    %s.read
+  and
+    %s.write
+  For the complete expressions use the flag `-show-range-conflict'.
+''' % (loc(nl, nc), nrule, nreg, nreg)
+    return out
+
+def genBscOutput(msc, dir, n):
+    """Writes Many.ms and Many.bscout (with 2*n warnings) to dir, and
+    returns their paths. Needs an msc that can produce bsv output."""
+    srcFile = os.path.join(dir, "Many.ms")
+    with open(srcFile, "w") as f: f.write(genDesign(n))
+    p = sp.run([msc, srcFile, "Many", "-o", "bsv"], cwd=dir, stdout=sp.PIPE, stderr=sp.STDOUT)
+    if p.returncode != 0:
+        print(p.stdout.decode("utf-8"))
+        raise SystemExit("%s failed with exit code %d" % (msc, p.returncode))
+    regs, rules = [], []
+    with open(os.path.join(dir, "Many.bsv"), "r") as f:
+        for line, text in enumerate(f, 1):
+            m = re.search(r"Reg#\(.*\)\s+(\w+)\s*<-", text)
+            if m: regs.append((m.group(1), line, m.start(1) + 1))
+            m = re.search(r"\brule\s+(\w+)", text)
+            if m: rules.append((m.group(1), line, m.start(1) + 1))
+    if len(regs) < n or len(rules) < n:
+        raise SystemExit("could not find the registers and rules of Many.ms in Many.bsv")
+    bscoutFile = os.path.join(dir, "Many.bscout")
+    with open(bscoutFile, "w") as f: f.write(genWarnings(regs, rules))
+    return srcFile, bscoutFile
@@ -0,0 +1,101 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Bluespec error translation test: replays the bsc outputs in bscoutput/
+# through msc --replay-bsc-output, and compares the translated messages
+# against the expected outputs recorded next to them. Each
+# bscoutput/<name>.bscout file holds a bsc output for <name>.ms (compiled at
+# its last module, as in run.py), and bscoutput/<name>.out holds its expected
+# translation.
+#
+# The corpus is synthetic, not captured from bsc: each output was written by
+# hand, following the formats of bsc's messages, with locations that point to
+# the translated BSV of its Minispec file.
+#
+# Expected outputs come from the regex-based translator msc used before
+# bscoutput.cpp, never from the msc under test. To record them, build the
+# commit that precedes bscoutput.cpp with bscoutput/regex-replay.patch
+# applied (it adds --replay-bsc-output and nothing else), and run with
+# --ref-msc <that msc> --record. With --ref-msc alone, outputs are compared
+# against the reference directly, including a generated one with hundreds of
+# warnings (see bscgen.py).
+import argparse
+import os
+import shutil
+import sys
+import tempfile
+from bscgen import genBscOutput
+from mstest import Results, runMsc
+
+testDir = os.path.dirname(os.path.realpath(__file__))
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, default="msc", help="msc binary")
+parser.add_argument("-d", "--dir", type=str,
+        default=os.path.join(testDir, "bscoutput"),
+        help="directory with bsc outputs and their expected translations")
+parser.add_argument("--ref-msc", type=str, default=None,
+        help="reference (regex-based) msc binary to compare against")
+parser.add_argument("--record", default=False, action="store_true",
+        help="record expected outputs from the reference msc")
+parser.add_argument("-w", "--warnings", type=int, default=250,
+        help="size of the generated bsc output (2x warnings) compared against the reference msc, 0 to skip it")
+args = parser.parse_args()
+if args.record and args.ref_msc is None:
+    parser.error("--record needs --ref-msc")
+
+def mscPath(msc):
+    # msc runs in the Minispec file's directory, so reported locations do not
+    # depend on where the test runs
+    return os.path.abspath(msc) if os.sep in msc else msc
+
+def replay(msc, srcFile, bscoutFile):
+    opts = ["--no-cache", "--all-errors", "--replay-bsc-output", bscoutFile]
+    return runMsc(mscPath(msc), os.path.basename(srcFile), opts,
+            cwd=os.path.dirname(srcFile), merge=True)[1]
+
+inputs = []
+for f in sorted(os.listdir(args.dir)):
+    if not f.endswith(".bscout"): continue
+    name = os.path.splitext(f)[0]
+    inputs.append((name, os.path.join(testDir, name + ".ms"), os.path.abspath(os.path.join(args.dir, f))))
+tmpDir = tempfile.mkdtemp(suffix="_mstest")
+if args.ref_msc is not None and not args.record and args.warnings > 0:
+    inputs.append(("Many",) + genBscOutput(args.msc, tmpDir, args.warnings))
+
+results = Results(24)
+for name, srcFile, bscoutFile in inputs:
+    expFile = os.path.join(args.dir, name + ".out")
+    if args.ref_msc is not None:
+        expected = replay(args.ref_msc, srcFile, bscoutFile)
+        if args.record:
+            with open(expFile, "w") as f: f.write(expected)
+            continue
+    elif not os.path.exists(expFile):
+        results.check(name, False, "--- no expected output %s (record it with --ref-msc and --record)\n" % expFile)
+        continue
+    else:
+        with open(expFile, "r") as f: expected = f.read()
+    output = replay(args.msc, srcFile, bscoutFile)
+    results.check(name, output == expected, "--- expected\n%s--- got\n%s" % (expected, output))
+
+shutil.rmtree(tmpDir)
+if args.record:
+    print("Recorded expected outputs for %d bsc outputs in %s" % (len(inputs), args.dir))
+    sys.exit(0)
+results.exit("bsc outputs translated as expected")
@@ -0,0 +1,67 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Parallel elaboration test: compiles examples to BSV with --elab-jobs 1 and
+# with several elaboration threads, and checks that the BSV, the diagnostics,
+# and the exit code are the same. Each example is also compiled with small
+# elaboration limits, so that elaboration fails midway.
+
+import argparse
+import filecmp
+import os
+import shutil
+import tempfile
+from mstest import Results, runMsc
+
+testDir = os.path.dirname(os.path.realpath(__file__))
+examplesDir = os.path.join(testDir, "..", "examples")
+parser = argparse.ArgumentParser()
+parser.add_argument("--msc", type=str, default="msc", help="msc binary")
+parser.add_argument("-j", "--jobs", type=int, default=8,
+        help="elaboration threads to compare against a single one")
+parser.add_argument("files", type=str, nargs="*",
+        default=[os.path.join(examplesDir, f) for f in ["tree.ms", "recursion3.ms"]],
+        help="Minispec files to compile")
+args = parser.parse_args()
+
+limits = [[], ["--max-elab-steps", "5"], ["--max-elab-steps", "40"], ["--max-elab-depth", "2"]]
+
+def compile(srcFile, jobs, opts, dir):
+    os.makedirs(dir)
+    return runMsc(args.msc, os.path.abspath(srcFile), ["-o", "bsv", "--elab-jobs", str(jobs)] + opts, cwd=dir)
+
+tmpDir = tempfile.mkdtemp(suffix="_mstest")
+results = Results(40)
+for srcFile in args.files:
+    for opts in limits:
+        run = results.runs + 1
+        name = "%s %s" % (os.path.basename(srcFile), " ".join(opts))
+        serialDir = os.path.join(tmpDir, str(run), "serial")
+        parallelDir = os.path.join(tmpDir, str(run), "parallel")
+        serial = compile(srcFile, 1, opts, serialDir)
+        parallel = compile(srcFile, args.jobs, opts, parallelDir)
+        bsvFiles = [f for f in set(os.listdir(serialDir)) | set(os.listdir(parallelDir)) if f.endswith(".bsv")]
+        _, mismatch, errors = filecmp.cmpfiles(serialDir, parallelDir, sorted(bsvFiles), shallow=False)
+        details = ""
+        for what, s, p in zip(["exit code", "stdout", "stderr"], serial, parallel):
+            if s != p: details += "--- %s with 1 thread\n%s\n--- with %d threads\n%s\n" % (what, s, args.jobs, p)
+        for f in mismatch + errors: details += "--- %s differs\n" % f
+        results.check(name, serial == parallel and not mismatch and not errors, details)
+shutil.rmtree(tmpDir)
+results.exit("compilations match with %d elaboration threads" % args.jobs)
@@ -0,0 +1,91 @@
+/** $lic$
+ * Copyright (C) 2019-2022 by Daniel Sanchez
+ *
+ * This file is part of the Minispec compiler and toolset.
+ *
+ * Minispec is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU General Public License as published by the Free Software
+ * Foundation, version 2.
+ *
+ * Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ * FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+ * details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// libminispec isolation test: compiles, concurrently and several times, a
+// file with a syntax error and one that exceeds the elaboration depth limit,
+// each with its own Compiler. Checks that both fail without exiting the
+// process, that each compiler's diagnostics hold only its own errors, and
+// that a later compile in the same process succeeds. Run from the repo's
+// root directory (or pass it as the only argument).
+
+#include <iostream>
+#include <string>
+#include <thread>
+#include "minispec.h"
+
+static const int rounds = 20;
+static int failures = 0;
+
+static void check(bool cond, const std::string& what, const minispec::Compiler& compiler) {
+    if (cond) return;
+    failures++;
+    std::cout << "FAIL: " << what << "\n--- diagnostics\n" << compiler.diagnostics() << "---\n";
+}
+
+static bool contains(const std::string& str, const std::string& sub) {
+    return str.find(sub) != std::string::npos;
+}
+
+int main(int argc, const char* argv[]) {
+    std::string rootDir = (argc > 1)? argv[1] : ".";
+    std::string syntaxFile = rootDir + "/tests/noviablealt1.ms";
+    std::string limitFile = rootDir + "/tests/noterm1.ms";
+
+    minispec::Compiler syntaxCompiler, limitCompiler;
+    std::thread syntaxThread([&]() {
+        for (int i = 0; i < rounds; i++) {
+            bool ok = syntaxCompiler.compile(syntaxFile);
+            const std::string& diags = syntaxCompiler.diagnostics();
+            check(!ok, "file with a syntax error compiled", syntaxCompiler);
+            check(contains(diags, "could not parse file"), "no parse error reported", syntaxCompiler);
+            check(!contains(diags, "elaboration depth") && !contains(diags, "noterm1.ms"),
+                    "parse diagnostics have errors from the other compiler", syntaxCompiler);
+        }
+    });
+    std::thread limitThread([&]() {
+        minispec::CompileOptions options;
+        options.topLevel = "TestAdd";
+        options.maxElabDepth = 3;
+        options.elabThreads = 2;
+        for (int i = 0; i < rounds; i++) {
+            bool ok = limitCompiler.compile(limitFile, options);
+            const std::string& diags = limitCompiler.diagnostics();
+            check(!ok, "non-terminating file compiled", limitCompiler);
+            check(contains(diags, "exceeded maximum elaboration depth (3)"), "no elaboration limit error reported", limitCompiler);
+            check(!contains(diags, "could not parse file") && !contains(diags, "noviablealt1.ms"),
+                    "elaboration diagnostics have errors from the other compiler", limitCompiler);
+        }
+    });
+    syntaxThread.join();
+    limitThread.join();
+
+    // Fatal errors must not leave per-thread or global state behind
+    minispec::Compiler compiler;
+    minispec::CompileOptions options;
+    options.topLevel = "TestRecursion";
+    bool ok = compiler.compile(rootDir + "/examples/recursion3.ms", options);
+    check(ok && compiler.numPackages() > 0 && compiler.topModule() == "mkTestRecursion",
+            "valid file did not compile after failed compiles", compiler);
+
+    if (failures) {
+        std::cout << failures << " checks failed\n";
+        return 1;
+    }
+    std::cout << "libminispec: " << 2 * rounds + 1 << " compiles OK\n";
+    return 0;
+}
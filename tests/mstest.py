@@ -0,0 +1,64 @@
+#!/usr/bin/python3
+
+# $lic$
+# Copyright (C) 2019-2022 by Daniel Sanchez
+#
+# This file is part of the Minispec compiler and toolset.
+#
+# Minispec is free software; you can redistribute it and/or modify it under
+# the terms of the GNU General Public License as published by the Free Software
+# Foundation, version 2.
+#
+# Minispec is distributed in the hope that it will be useful, but WITHOUT ANY
+# WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+# FOR A PARTICULAR PURPOSE. See the GNU General Public License for more
+# details.
+#
+# You should have received a copy of the GNU General Public License along with
+# this program. If not, see <http://www.gnu.org/licenses/>.
+
+# Helpers shared by the test and benchmark scripts that run msc directly
+# (bscoutput.py, elabjobs.py, and those in bench/).
+
+import os
+import re
+import subprocess as sp
+import sys
+
+def lastModule(srcFile):
+    # Same heuristic as run.py: compile the last (non-parametric) module
+    with open(srcFile, "r") as f: input = f.read()
+    m = None
+    for m in re.finditer('module ([a-zA-Z0-9_]+);', input):
+        pass
+    return [m.group(1).strip()] if m is not None else []
+
+def mscCmd(msc, srcFile, opts, cwd=None):
+    """Returns the command that compiles srcFile at its last module with the
+    given msc binary and options. A relative srcFile is relative to cwd."""
+    return [msc, srcFile] + lastModule(os.path.join(cwd or "", srcFile)) + opts
+
+def runMsc(msc, srcFile, opts, cwd=None, merge=False):
+    """Runs mscCmd(msc, srcFile, opts) and returns its exit code, stdout, and
+    stderr. If merge is set, stderr is interleaved into stdout."""
+    p = sp.run(mscCmd(msc, srcFile, opts, cwd), cwd=cwd, stdout=sp.PIPE,
+            stderr=sp.STDOUT if merge else sp.PIPE)
+    return (p.returncode, p.stdout.decode("utf-8"), "" if merge else p.stderr.decode("utf-8"))
+
+class Results:
+    """Prints an OK or FAIL line per check, and a final summary."""
+    def __init__(self, width):
+        self.width = width
+        self.runs = 0
+        self.failures = 0
+
+    def check(self, name, ok, details=""):
+        self.runs += 1
+        print("  %-*s %s" % (self.width, name, "OK" if ok else "FAIL"))
+        if not ok:
+            self.failures += 1
+            sys.stdout.write(details)
+
+    def exit(self, what):
+        print("%d/%d %s" % (self.runs - self.failures, self.runs, what))
+        sys.exit(1 if self.failures else 0)